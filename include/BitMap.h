@@ -1,9 +1,22 @@
 #pragma once
 
+// bits are kept in 64-bit words, with two summary levels above them: a bit
+// per word set once the word is full, and a bit per summary word set once
+// that is full. a vacant bit is found by walking down the levels, and claimed
+// with a CAS on its word, no lock is taken.
+//
+// summaries may briefly claim a word has room when it has not, searches then
+// repair them and retry. every write that marks a word full checks it again
+// afterwards, so a summary never keeps hiding a vacant bit.
+
+#include <cstddef>
 #include <cstdint>
-#include <mutex>
+#include <utility>
 #include <vector>
 
+// granularity the bitmap is persisted in.
+const size_t BITMAP_PAGE_SIZE = 1 << 12;
+
 class BitMap {
   public:
     BitMap(int size);
@@ -15,15 +28,37 @@ class BitMap {
     void Set(int i, bool v);
     bool Get(int i) const;
     int FindVacantAndSet();
+    // like FindVacantAndSet(), within bits [first, last). both are multiples
+    // of 64, so ranges that do not overlap never share a word.
+    int FindVacantAndSet(size_t first, size_t last);
+    // claims `n` adjacent vacant bits within one word in [first, last),
+    // returns the first of them or -1. n is at most 64.
+    int FindVacantRunAndSet(int n, size_t first, size_t last);
     uint32_t count_vacant();
+    uint32_t count_vacant(size_t first, size_t last);
     const std::vector<unsigned char> GetUnderlayBytes();
+    const unsigned char* UnderlayData() const;
+    // clears the dirty marks and returns the dirty pages as runs of
+    // [first page, number of pages). changes made after the call mark their
+    // pages dirty again, so the pages can be written straight from
+    // UnderlayData().
+    std::vector<std::pair<size_t, size_t>> TakeDirtyPages();
 
   private:
-    std::vector<unsigned char> store;
-    int lastVacant;
-    std::mutex vacantMutex;
+    void Init(size_t bits);
+    void MarkDirty(size_t byteIndex);
+    void MarkFull(size_t word);
+    void MarkNotFull(size_t word);
 
-    static uint32_t bitMask32(int i);
-    static unsigned char fastLog2(unsigned char b);
+    size_t nBits;
+    // bytes of the persisted form, bit i is bit i % 8 of byte i / 8.
+    size_t nBytes;
+    // little endian, so the words read as bytes are the persisted form. bits
+    // past nBits are set, so they are never handed out.
+    std::vector<uint64_t> words;
+    std::vector<uint64_t> summary;
+    std::vector<uint64_t> top;
+    // a bit per page, set when the page changes. new bitmaps start all dirty,
+    // loaded ones all clean.
+    std::vector<uint64_t> dirtyPages;
 };
-
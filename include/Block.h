@@ -1,54 +1,239 @@
 #pragma once
 
 #include "BitMap.h"
-#include "channel.h"
+#include "io_ring.h"
 #include "rw_spin_lock.h"
 #include <atomic>
-#include <semaphore>
-#include <thread>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <unordered_map>
 #include <vector>
 
 // Constants
-const uint32_t BLOCK_SIZE = (1 << 30) + (1 << 12);
 const size_t BITMAP_SIZE =
     1 << 17; // number of bytes bitmap occupies, not capacity.
 const uint32_t BLOCK_MAX_CAP = 1 << 20;
+// every block holds slots of one size class. a slot starts with the length
+// of its value, so a value of n bytes goes to the smallest class of at least
+// n + BLOCK_SLOT_HEADER_SIZE bytes.
+const uint32_t BLOCK_SLOT_SIZES[] = {64, 128, 256, 512, 1024, 2048, 4096};
+const size_t BLOCK_N_SLOT_SIZES = std::size(BLOCK_SLOT_SIZES);
+const uint32_t BLOCK_MAX_SLOT_SIZE = 4096;
+const uint32_t BLOCK_SLOT_HEADER_SIZE = sizeof(uint32_t);
+// values too large for any slot are stored in blocks of the largest class as
+// extents, runs of adjacent slots taken together. the length at the start of
+// the first slot covers the whole run, the value carries on across the slots
+// that follow. a run never spans two words of the bitmap.
+const uint32_t BLOCK_EXTENT_SLOT_SIZE = BLOCK_MAX_SLOT_SIZE;
+const uint32_t BLOCK_MAX_EXTENT_SLOTS = 64;
+const uint32_t BLOCK_MAX_VALUE_SIZE =
+    BLOCK_MAX_EXTENT_SLOTS * BLOCK_EXTENT_SLOT_SIZE - BLOCK_SLOT_HEADER_SIZE;
+// a block starts with a BlockHeader, padded to a page, then the bitmap and
+// the slots. blocks with extents have a second bitmap before the slots, with
+// a bit set for every slot that continues the one before it.
+const size_t BLOCK_HEADER_SIZE = 1 << 12;
 const size_t BLOCK_BUFFER_SIZE = 512;
+// slots are handed out from shards, ranges of BLOCK_SHARD_CAP slots with a
+// vacancy count of their own. a thread takes slots from its home shard and
+// only moves on to the others once that is full, so threads putting at the
+// same time touch neither the same bitmap words nor the same counter.
+const uint32_t BLOCK_ALLOC_SHARDS = 16;
+const uint32_t BLOCK_SHARD_CAP = BLOCK_MAX_CAP / BLOCK_ALLOC_SHARDS;
+// longest run of adjacent slots get_batch reads with a single preadv.
+const size_t BLOCK_MAX_READ_RUN = 64;
+// longest run of adjacent slots a flush writes with a single pwritev.
+const size_t BLOCK_MAX_WRITE_RUN = 256;
 
 typedef uint32_t MagritteInBlockIndex;
 typedef std::vector<char> MagritteValue;
 
+typedef struct {
+    char magic[4];
+    uint32_t slot_size;
+} BlockHeader;
+
+// index into BLOCK_SLOT_SIZES of the class a value of `len` bytes goes to, or
+// -1 if it is too large even for an extent.
+inline int slot_class_for(size_t len) {
+    for (size_t i = 0; i < BLOCK_N_SLOT_SIZES; i++) {
+        if (len + BLOCK_SLOT_HEADER_SIZE <= BLOCK_SLOT_SIZES[i])
+            return i;
+    }
+    return len <= BLOCK_MAX_VALUE_SIZE ? BLOCK_N_SLOT_SIZES - 1 : -1;
+}
+
+// bytes the bitmaps of a block of `slot_size` slots take in the file.
+inline int64_t bitmaps_size(uint32_t slot_size) {
+    return slot_size == BLOCK_EXTENT_SLOT_SIZE ? BITMAP_SIZE * 2 : BITMAP_SIZE;
+}
+
+// bytes a block of `slot_size` slots takes in the file.
+inline int64_t block_size(uint32_t slot_size) {
+    return BLOCK_HEADER_SIZE + bitmaps_size(slot_size) +
+           int64_t(BLOCK_MAX_CAP) * slot_size;
+}
+
+class FlushScheduler;
+
+typedef struct {
+    uint64_t n_flushes;
+    // slots written, and the bytes and syscalls it took including the
+    // bitmap.
+    uint64_t n_slots;
+    uint64_t n_bytes;
+    uint64_t n_syscalls;
+} BlockFlushStats;
+
+// a value read in place. while a view points into the block it pins the
+// block's lock shared, so it must be released before writing to the same
+// store from the same thread.
+class BlockView {
+  public:
+    BlockView();
+    BlockView(BlockView&& other);
+    BlockView& operator=(BlockView&& other);
+    ~BlockView();
+
+    std::span<const char> data() const { return view; }
+    void release();
+
+  private:
+    friend class Block;
+
+    std::span<const char> view;
+    // set while the view points into the block.
+    rw_spin_lock* lock;
+    // holds the value when it could not be read in place.
+    MagritteValue owned;
+};
+
 class Block {
   public:
-    Block(int file, uint32_t offset, BitMap&& bmp);
-    Block(int file, uint32_t offset);
+    // without a scheduler, pending changes are only written by flush(),
+    // flush_sync() and when the buffer fills up. with the IoUring backend,
+    // reads go through `ring`, which may be shared with other blocks of the
+    // file and has to outlive the block.
+    Block(int file, int64_t offset, uint32_t slot_size, BitMap&& bmp,
+          MagritteIoBackend backend = Pread,
+          FlushScheduler* scheduler = nullptr, IoRing* ring = nullptr);
+    // a new block, its header is written with the first flush.
+    Block(int file, int64_t offset, uint32_t slot_size,
+          MagritteIoBackend backend = Pread,
+          FlushScheduler* scheduler = nullptr, IoRing* ring = nullptr);
     Block(Block&& other);
     ~Block();
 
+    // reads the slot size from the header of the block at `offset`, throws
+    // if there is no block.
+    static uint32_t read_slot_size(int file, int64_t offset);
+    // reads bitmap `n` of the block at `offset`, 1 is the bitmap of
+    // continued slots of a block with extents.
+    static BitMap read_bitmap(int file, int64_t offset, int n = 0);
+    uint32_t slot_size() const { return slot_size_; }
+    bool extents() const { return continued != nullptr; }
+    // whether a value of `len` bytes takes the same slots as the value at
+    // `slot`, so it can be updated in place.
+    bool same_slots(MagritteInBlockIndex slot, size_t len) const;
+
+    // asks the scheduler to flush soon, flushes right away without one.
     void flush();
     void flush_sync();
+    // writes out pending changes and the bitmap on the calling thread.
+    BlockFlushStats flush_now();
+    // totals over every flush of the block.
+    BlockFlushStats flush_stats();
+    size_t dirty_bytes() const;
     bool vacant() const;
-    bool put(MagritteValue data, MagritteInBlockIndex& offset);
-    bool update(MagritteValue data, MagritteInBlockIndex offset);
+    // puts fail for values too large for the slots, and when there is no run
+    // of slots long enough left for an extent. updates fail unless the value
+    // takes the same slots.
+    bool put(const MagritteValue& data, MagritteInBlockIndex& offset);
+    bool put(MagritteValue&& data, MagritteInBlockIndex& offset);
+    bool update(MagritteValue&& data, MagritteInBlockIndex offset);
     MagritteValue get(MagritteInBlockIndex inBlockIndex);
+    // copies the value into `out` if it fits, returns its length either way.
+    size_t get_into(MagritteInBlockIndex inBlockIndex, std::span<char> out);
+    // like get(), but points `view` into the mapping or the pending value
+    // instead of copying when the block is mapped.
+    void get_view(MagritteInBlockIndex inBlockIndex, BlockView& view);
+    // reads the values of `slots`, which must be sorted, into `values`.
+    void get_batch(const std::vector<MagritteInBlockIndex>& slots,
+                   std::vector<MagritteValue>& values);
+    // values must fit the slots, a value no run is left for ends the batch.
+    size_t put_batch(std::vector<MagritteValue>& values, size_t first,
+                     std::vector<MagritteInBlockIndex>& slots);
+    void update_batch(std::vector<MagritteValue>& values,
+                      const std::vector<MagritteInBlockIndex>& slots);
+    // puts `data` at `slot` again when the log is replayed, claiming its
+    // slots unless they are already.
+    void restore(MagritteInBlockIndex slot, MagritteValue&& data);
+    // marks `slot` in use without a value, so it is never handed out.
+    void reserve(MagritteInBlockIndex slot);
+    // a slot that is not in use is left alone.
     void remove(MagritteInBlockIndex inBlockIndex);
     void shutdown();
 
   private:
-    void flush_worker();
+    void mark_dirty(size_t n_bytes);
+    void detach();
+    BitMap&& take_bitmap();
+    bool get_batch_ring(const std::vector<MagritteInBlockIndex>& slots,
+                        std::vector<MagritteValue>& values);
     int64_t get_offset_of(MagritteInBlockIndex i) const;
-    bool adjust_vacancy(int diff);
+    // the length of the value stored in `slot`, the first of `n_slots`. a
+    // slot never written is empty.
+    size_t slot_length(const char* slot, uint32_t n_slots = 1) const;
+    bool fits(size_t len) const;
+    // number of slots a value of `len` bytes takes.
+    uint32_t slots_for(size_t len) const;
+    // number of slots the value at `slot` takes.
+    uint32_t run_length(MagritteInBlockIndex slot) const;
+    void map_region();
+    void unmap_region();
+    // the slot in the mapping, or nullptr if it is not mapped or not yet
+    // backed by the file.
+    const char* mapped(MagritteInBlockIndex i) const;
+    void init_shards();
+    // claims `n` adjacent vacant slots, from the home shard of the calling
+    // thread if it has them. returns the first or -1 when there is no room.
+    int64_t allocate_slots(uint32_t n);
+
+    struct alignas(64) Shard {
+        std::atomic<uint32_t> vacancy;
+    };
 
     BitMap bitmap;
-    bool bitmapDirty;
-    std::atomic<uint32_t> vacancy;
-    uint32_t offset;
+    // set for blocks with extents.
+    std::unique_ptr<BitMap> continued;
+    std::unique_ptr<Shard[]> shards;
+    int64_t offset;
+    uint32_t slot_size_;
+    // set until the header of a new block is written.
+    bool header_dirty;
     std::unordered_map<MagritteInBlockIndex, MagritteValue> pendingChanges;
     rw_spin_lock lock;
-    channel<std::binary_semaphore*> flushSignal;
     std::atomic<bool> shutdown_;
     int file_no;
-    std::thread flush_thread;
+    // reads go through the ring when set, otherwise pread. not owned.
+    IoRing* ring;
+    // the block's region when mapped, starting at the page `offset` is in.
+    const char* mapping;
+    size_t mapping_size;
+    int64_t mapping_base;
+    // end of the file as far as this block knows, slots past it are not
+    // read through the mapping as that would fault.
+    std::atomic<int64_t> file_end;
+
+    FlushScheduler* scheduler;
+    // serializes flushes from the scheduler and the writers.
+    std::mutex flush_mutex;
+    // set from the first write after a flush until the next flush.
+    std::atomic<bool> dirty;
+    std::atomic<size_t> dirty_bytes_;
+    // guarded by flush_mutex.
+    BlockFlushStats total_stats;
 };
 
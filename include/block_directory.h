@@ -0,0 +1,66 @@
+#pragma once
+
+// tells Magritte which block new keys go to without looking at every block.
+//
+// new keys fill one block at a time, the fill block, which is
+// MAGRITTE_MAX_BLOCKS while there is none yet. a block that regains slots
+// through remove() is marked in a bitset, and once the fill block is full the
+// lowest marked block that still has room takes over. the bitset has a bit
+// for every block an index can address, so finding the next block costs the
+// same however many blocks there are.
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+// an index keeps the block in its upper 12 bits.
+const uint32_t MAGRITTE_MAX_BLOCKS = 1 << 12;
+
+class BlockDirectory {
+  public:
+    BlockDirectory() : fill_block(MAGRITTE_MAX_BLOCKS) {}
+    BlockDirectory& operator=(const BlockDirectory& other);
+
+    uint32_t fill() const { return fill_block.load(); }
+    void set_fill(uint32_t block) { fill_block = block; }
+    void mark_free(uint32_t block);
+    // unmarks the marked blocks in order until `vacant` accepts one, returns
+    // it or -1.
+    template <typename F> int64_t take_free(F&& vacant);
+
+  private:
+    std::array<std::atomic<uint64_t>, MAGRITTE_MAX_BLOCKS / 64> free_blocks{};
+    std::atomic<uint32_t> fill_block;
+};
+
+inline BlockDirectory& BlockDirectory::operator=(const BlockDirectory& other) {
+    for (size_t w = 0; w < free_blocks.size(); w++)
+        free_blocks[w] = other.free_blocks[w].load();
+    fill_block = other.fill_block.load();
+    return *this;
+}
+
+inline void BlockDirectory::mark_free(uint32_t block) {
+    auto& word = free_blocks[block / 64];
+    auto bit = uint64_t(1) << (block % 64);
+    // most removes hit a block that is already marked.
+    if ((word.load(std::memory_order_relaxed) & bit) == 0)
+        word.fetch_or(bit);
+}
+
+// a block is unmarked before it is asked, a remove in between marks it again
+// after its slot is already counted, so no vacancy is missed.
+template <typename F> int64_t BlockDirectory::take_free(F&& vacant) {
+    for (size_t w = 0; w < free_blocks.size(); w++) {
+        auto bits = free_blocks[w].load();
+        while (bits) {
+            auto bit = std::countr_zero(bits);
+            bits &= bits - 1;
+            free_blocks[w].fetch_and(~(uint64_t(1) << bit));
+            if (vacant(uint32_t(w * 64 + bit)))
+                return w * 64 + bit;
+        }
+    }
+    return -1;
+}
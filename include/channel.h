@@ -1,134 +1,220 @@
 #pragma once
 
+// bounded multi producer multi consumer queue, after Dmitry Vyukov's design:
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+// every cell carries a sequence number telling whether it is ready to be
+// written or read in the current lap, so producers and consumers only contend
+// on a single fetch-and-add each. a side that finds the queue full or empty
+// spins briefly, then parks on a futex until the other side moves.
+
 #include <atomic>
-#include <iostream>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <memory>
+#include <stdexcept>
+#include <sys/syscall.h>
 #include <unistd.h>
-#include <vector>
+#include <utility>
+
+// attempts before a blocked push or pop parks.
+const int CHANNEL_SPIN = 64;
 
 template <typename T> class channel {
   public:
     channel(int capacity);
-    ~channel();
     channel& operator<<(T value);
     channel& operator>>(T& dest);
 
     void push(T value);
     T pop();
+    // waits at most `timeout` milliseconds, the flag is false on timeout.
     std::pair<T, bool> pop_timeout(uint32_t timeout);
+    bool try_push(T& value);
+    bool try_pop(T& dest);
+    // number of free slots.
     int length();
 
   private:
-    int full_w_pipe_no;
-    int empty_r_pipe_no;
-    int empty_w_pipe_no;
-    int full_r_pipe_no;
-    std::vector<T> buffer;
-    std::atomic<bool> closed;
-    std::atomic<int> len;
-};
+    struct alignas(64) cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
 
-#include <bits/types/struct_timeval.h>
-#include <channel.h>
-#include <cstdint>
-#include <cstdio>
-#include <fstream>
-#include <stdexcept>
-#include <string>
-#include <sys/select.h>
-#include <unistd.h>
-#include <utility>
+    // bumped after every push and pop, waiters park on them.
+    struct alignas(64) event {
+        std::atomic<uint32_t> epoch;
+        std::atomic<uint32_t> waiters;
+    };
 
-template <typename T> channel<T>::channel(int size) : closed(false), len(size) {
-    std::fstream pipe_max_file("/proc/sys/fs/pipe-max-size", std::ios_base::in);
-    int curr_pipe_size;
-    pipe_max_file >> curr_pipe_size;
-
-    if (size * 4 > curr_pipe_size) {
-        throw std::invalid_argument("channel size is too large, try setting "
-                                    "/proc/sys/fs/pipe-max-size to " +
-                                    std::to_string(size * 4) +
-                                    " or larger(currently " +
-                                    std::to_string(curr_pipe_size) + ")");
-    }
+    void wait(event& e, uint32_t epoch, const struct timespec* timeout);
+    void notify(event& e);
 
-    int pipedes[2];
-    pipe(pipedes);
-    this->empty_r_pipe_no = pipedes[0];
-    this->empty_w_pipe_no = pipedes[1];
+    size_t mask;
+    std::unique_ptr<cell[]> cells;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+    event pushed;
+    event popped;
+    std::atomic<bool> closed;
+};
 
-    pipe(pipedes);
-    this->full_r_pipe_no = pipedes[0];
-    this->full_w_pipe_no = pipedes[1];
+template <typename T>
+channel<T>::channel(int capacity)
+    : enqueue_pos(0), dequeue_pos(0), closed(false) {
+    if (capacity <= 0)
+        throw std::invalid_argument("channel capacity must be positive");
+
+    // rounded up to a power of two, so positions wrap with a mask.
+    auto n_cells = size_t(capacity);
+    size_t size = 2;
+    while (size < n_cells)
+        size <<= 1;
+    mask = size - 1;
+
+    cells = std::make_unique<cell[]>(size);
+    for (size_t i = 0; i < size; i++)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+
+    pushed.epoch = pushed.waiters = 0;
+    popped.epoch = popped.waiters = 0;
+}
 
-    buffer.resize(size);
+template <typename T> bool channel<T>::try_push(T& value) {
+    auto pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        auto& c = cells[pos & mask];
+        auto seq = c.sequence.load(std::memory_order_acquire);
+        auto diff = intptr_t(seq) - intptr_t(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the cell still holds the value of the previous lap.
+            return false;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
 
-    for (uint32_t i = 0; i < size; i++)
-        write(this->empty_w_pipe_no, &i, 4);
+    auto& c = cells[pos & mask];
+    c.data = std::move(value);
+    c.sequence.store(pos + 1, std::memory_order_release);
+    notify(pushed);
+    return true;
 }
 
-template <typename T> channel<T>::~channel() {
-    close(this->empty_r_pipe_no);
-    close(this->empty_w_pipe_no);
-    close(this->full_r_pipe_no);
-    close(this->full_w_pipe_no);
+template <typename T> bool channel<T>::try_pop(T& dest) {
+    auto pos = dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        auto& c = cells[pos & mask];
+        auto seq = c.sequence.load(std::memory_order_acquire);
+        auto diff = intptr_t(seq) - intptr_t(pos + 1);
+        if (diff == 0) {
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // nothing pushed to the cell in this lap yet.
+            return false;
+        } else {
+            pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    auto& c = cells[pos & mask];
+    dest = std::move(c.data);
+    c.sequence.store(pos + mask + 1, std::memory_order_release);
+    notify(popped);
+    return true;
 }
 
 template <typename T> channel<T>& channel<T>::operator<<(T value) {
     if (closed)
         throw std::invalid_argument("channel is closed");
 
-    uint32_t idx;
-    read(this->empty_r_pipe_no, &idx, 4);
-    this->buffer[idx] = value;
-    write(this->full_w_pipe_no, &idx, 4);
-
-    len--;
-    return *this;
+    for (int spin = 0;; spin++) {
+        // read the epoch first, a pop in between makes the wait return.
+        auto epoch = popped.epoch.load();
+        if (try_push(value))
+            return *this;
+        if (spin >= CHANNEL_SPIN)
+            wait(popped, epoch, nullptr);
+    }
 }
 
 template <typename T> channel<T>& channel<T>::operator>>(T& dest) {
     if (closed)
         throw std::invalid_argument("channel is closed");
 
-    uint32_t idx;
-    read(this->full_r_pipe_no, &idx, 4);
-    dest = this->buffer[idx];
-    write(this->empty_w_pipe_no, &idx, 4);
-
-    len++;
+    dest = this->pop();
     return *this;
 }
 
-template <typename T> void channel<T>::push(T value) { this << value; }
+template <typename T> void channel<T>::push(T value) { *this << value; }
 
 template <typename T> T channel<T>::pop() {
-    uint32_t idx;
-    read(this->full_r_pipe_no, &idx, 4);
-    auto dest = this->buffer[idx];
-    write(this->empty_w_pipe_no, &idx, 4);
-
-    len++;
-    return dest;
+    T dest;
+    for (int spin = 0;; spin++) {
+        auto epoch = pushed.epoch.load();
+        if (try_pop(dest))
+            return dest;
+        if (spin >= CHANNEL_SPIN)
+            wait(pushed, epoch, nullptr);
+    }
 }
 
-template <typename T> int channel<T>::length() { return this->len; }
-
 template <typename T>
 std::pair<T, bool> channel<T>::pop_timeout(uint32_t timeout) {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(this->full_r_pipe_no, &set);
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    T dest;
+    for (int spin = 0;; spin++) {
+        auto epoch = pushed.epoch.load();
+        if (try_pop(dest))
+            return std::make_pair(std::move(dest), true);
+        if (spin < CHANNEL_SPIN)
+            continue;
+
+        auto left = deadline - std::chrono::steady_clock::now();
+        if (left <= std::chrono::nanoseconds(0))
+            return std::make_pair(T{}, false);
+        auto nanosecs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+        struct timespec ts = {.tv_sec = nanosecs / 1000000000,
+                              .tv_nsec = nanosecs % 1000000000};
+        wait(pushed, epoch, &ts);
+    }
+}
 
-    struct timeval timeout_tv{
-        .tv_sec = timeout / 1000,
-        .tv_usec = (timeout % 1000) * 1000,
-    };
-    auto retval = select(this->full_r_pipe_no + 1, &set, nullptr, nullptr, &timeout_tv);
+template <typename T> int channel<T>::length() {
+    auto used = enqueue_pos.load() - dequeue_pos.load();
+    return int(mask + 1 - used);
+}
 
-    if (retval > 0) {
-        return std::make_pair(this->pop(), true);
-    } else {
-        return std::make_pair(nullptr, false);
+// parks until `e` moves past `epoch`, `timeout` is relative.
+template <typename T>
+void channel<T>::wait(event& e, uint32_t epoch,
+                      const struct timespec* timeout) {
+    // announce before checking the epoch, notify() bumps the epoch before
+    // looking for waiters, so one of the two sides sees the other.
+    e.waiters.fetch_add(1);
+    if (e.epoch.load() == epoch) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&e.epoch),
+                FUTEX_WAIT_PRIVATE, epoch, timeout, nullptr, 0);
     }
+    e.waiters.fetch_sub(1);
 }
 
+template <typename T> void channel<T>::notify(event& e) {
+    e.epoch.fetch_add(1);
+    if (e.waiters.load() != 0) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&e.epoch),
+                FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
@@ -0,0 +1,507 @@
+#pragma once
+
+// a cache split into shards by key hash, every shard a flat open addressing
+// table evicted by CLOCK.
+//
+// a hit only sets the reference bit of its entry, under the shard's lock held
+// shared, so readers of a shard never wait for each other. the clock hand
+// sweeps the table on insert, clearing reference bits until it finds an entry
+// that was not used since the last sweep. new entries start unreferenced, so
+// keys seen once are evicted before keys seen twice.
+//
+// the capacity is in the units of the weigher, entries by default, bytes
+// with CacheByteWeigher. an admission policy may be given, a full shard then
+// only takes a new key in place of its victims if the policy agrees.
+//
+// how many shards are used follows the capacity, set_capacity() moves the
+// entries when a new capacity calls for another number of shards.
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <rw_spin_lock.h>
+#include <utility>
+#include <vector>
+
+// shards a cache has, not all of them are used by small caches.
+const size_t CLOCK_CACHE_SHARDS = 16;
+// shards are only split off while each keeps at least this many entries.
+const size_t CLOCK_CACHE_MIN_SHARD = 64;
+// slots a shard starts with at most, tables grow as they fill.
+const size_t CLOCK_CACHE_INITIAL_SLOTS = 1 << 10;
+// header malloc puts in front of every allocation.
+const size_t CACHE_MALLOC_OVERHEAD = 16;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    // puts into a full cache, that took the place of another entry or were
+    // turned away by the admission policy.
+    uint64_t admitted;
+    uint64_t rejected;
+} CacheStats;
+
+// every entry weighs one.
+struct CacheUnitWeigher {
+    // weight of a typical entry, shards and sketches are sized by it.
+    static constexpr size_t unit = 1;
+
+    template <typename K, typename V>
+    static size_t weigh(const K&, const V&) {
+        return 1;
+    }
+};
+
+// an entry weighs the bytes it holds: the heap block of its value, and the
+// two table slots it takes as tables are kept at most half full.
+struct CacheByteWeigher {
+    static constexpr size_t unit = 1024;
+
+    template <typename K, typename V>
+    static size_t weigh(const K&, const V& value) {
+        auto slot = sizeof(K) + sizeof(V) + 2 * sizeof(size_t);
+        return value.capacity() * sizeof(value[0]) + CACHE_MALLOC_OVERHEAD +
+               2 * slot;
+    }
+};
+
+template <typename K, typename V, typename W = CacheUnitWeigher>
+class ClockCache {
+  public:
+    // whether `candidate` may take the place of `victim`.
+    typedef std::function<bool(const K& candidate, const K& victim)> Admission;
+
+    ClockCache(size_t capacity, Admission admission = nullptr);
+    ClockCache& operator=(ClockCache&& other);
+    bool get(const K& key, V& value);
+    // calls `reader` with the cached value under the lock, so it can be
+    // copied straight to where it is needed.
+    template <typename F> bool get_with(const K& key, F&& reader);
+    void put(const K& key, const V& value);
+    void put(const K& key, V&& value);
+    // like put(), returns false if the entry was turned away. entries
+    // evicted for it are appended to `evicted`.
+    bool put(const K& key, V&& value, std::vector<std::pair<K, V>>* evicted);
+    // only updates an entry already cached.
+    bool replace(const K& key, V&& value);
+    void remove(const K& key);
+    // evicts down to the new capacity right away, and spreads the entries
+    // over the number of shards the new capacity calls for.
+    void set_capacity(size_t capacity);
+    size_t size();
+    // the sum of the weights of the entries.
+    size_t weight();
+    CacheStats stats();
+
+  private:
+    struct Slot {
+        K key;
+        V value;
+        size_t hash;
+        size_t weight;
+        bool used;
+        std::atomic<bool> referenced;
+    };
+
+    struct alignas(64) Shard {
+        rw_spin_lock lock;
+        std::unique_ptr<Slot[]> slots;
+        size_t mask;
+        size_t capacity;
+        size_t size;
+        size_t weight;
+        size_t hand;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        // guarded by the lock.
+        uint64_t admitted;
+        uint64_t rejected;
+
+        void init(size_t n_slots);
+        // empties the shard and sizes its table for `capacity`.
+        void reset(size_t capacity);
+        // the slot holding `key`, or the empty slot ending its probe.
+        size_t find(const K& key, size_t hash) const;
+        // puts an entry for a key not in the shard, growing the table if
+        // needed. the caller makes room for its weight.
+        void place(K&& key, V&& value, size_t hash, size_t weight,
+                   bool referenced);
+        // moves the hand to the next entry not referenced since the last
+        // sweep.
+        size_t victim();
+        void erase(size_t i);
+        // doubles the table.
+        void grow();
+    };
+
+    static size_t hash_of(const K& key);
+    // the number of shards used for `capacity`, a power of two.
+    static size_t shards_for(size_t capacity);
+    // locks the shard of `hash`, shared or exclusively, and returns it.
+    Shard& lock_shard(size_t hash, bool shared);
+    // moves the entries to the first `n` shards, each sized for `share`.
+    // caller holds every shard lock.
+    void reshard(size_t n, size_t share);
+
+    // CLOCK_CACHE_SHARDS of them, the first n_shards are used.
+    std::unique_ptr<Shard[]> shards;
+    // only changed while every shard lock is held, so it is settled for
+    // whoever holds one.
+    std::atomic<size_t> n_shards;
+    Admission admission;
+};
+
+template <typename K, typename V, typename W>
+ClockCache<K, V, W>::ClockCache(size_t capacity, Admission admission)
+    : shards(std::make_unique<Shard[]>(CLOCK_CACHE_SHARDS)),
+      n_shards(shards_for(capacity)), admission(std::move(admission)) {
+    auto n = n_shards.load();
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++) {
+        auto& shard = shards[i];
+        shard.reset(i < n ? (capacity + n - 1) / n : 0);
+        shard.hits = shard.misses = 0;
+        shard.admitted = shard.rejected = 0;
+    }
+}
+
+template <typename K, typename V, typename W>
+ClockCache<K, V, W>& ClockCache<K, V, W>::operator=(ClockCache&& other) {
+    this->shards = std::move(other.shards);
+    this->n_shards = other.n_shards.load();
+    this->admission = std::move(other.admission);
+    return *this;
+}
+
+// std::hash of an integer is the integer itself, mixed so that both the shard
+// bits and the slot bits are spread.
+template <typename K, typename V, typename W>
+size_t ClockCache<K, V, W>::hash_of(const K& key) {
+    uint64_t h = std::hash<K>{}(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+template <typename K, typename V, typename W>
+size_t ClockCache<K, V, W>::shards_for(size_t capacity) {
+    return std::bit_floor(std::clamp<size_t>(
+        capacity / W::unit / CLOCK_CACHE_MIN_SHARD, 1, CLOCK_CACHE_SHARDS));
+}
+
+// the shard is picked before its lock is taken, a resharding in between
+// moves the key elsewhere, it is then picked again.
+template <typename K, typename V, typename W>
+typename ClockCache<K, V, W>::Shard&
+ClockCache<K, V, W>::lock_shard(size_t hash, bool shared) {
+    for (;;) {
+        auto n = n_shards.load(std::memory_order_acquire);
+        auto& shard = shards[(hash >> 56) & (n - 1)];
+        if (shared)
+            shard.lock.lock_shared();
+        else
+            shard.lock.lock();
+        if (n_shards.load(std::memory_order_relaxed) == n)
+            return shard;
+        if (shared)
+            shard.lock.unlock_shared();
+        else
+            shard.lock.unlock();
+    }
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::Shard::init(size_t n_slots) {
+    slots = std::make_unique<Slot[]>(n_slots);
+    for (size_t j = 0; j < n_slots; j++)
+        slots[j].used = false;
+    mask = n_slots - 1;
+    hand = 0;
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::Shard::reset(size_t capacity) {
+    this->capacity = capacity;
+    auto n_entries = std::max<size_t>(capacity / W::unit, 1);
+    init(std::bit_ceil(std::min(n_entries * 2, CLOCK_CACHE_INITIAL_SLOTS)));
+    size = weight = 0;
+}
+
+template <typename K, typename V, typename W>
+size_t ClockCache<K, V, W>::Shard::find(const K& key, size_t hash) const {
+    auto i = hash & mask;
+    while (slots[i].used && !(slots[i].hash == hash && slots[i].key == key))
+        i = (i + 1) & mask;
+    return i;
+}
+
+template <typename K, typename V, typename W>
+bool ClockCache<K, V, W>::get(const K& key, V& value) {
+    return this->get_with(key, [&value](const V& v) { value = v; });
+}
+
+template <typename K, typename V, typename W>
+template <typename F>
+bool ClockCache<K, V, W>::get_with(const K& key, F&& reader) {
+    auto hash = hash_of(key);
+    auto& shard = lock_shard(hash, true);
+
+    auto& slot = shard.slots[shard.find(key, hash)];
+    if (!slot.used) {
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        shard.lock.unlock_shared();
+        return false;
+    }
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+    // most hits are on entries already referenced, leave their line clean.
+    if (!slot.referenced.load(std::memory_order_relaxed))
+        slot.referenced.store(true, std::memory_order_relaxed);
+    reader(slot.value);
+
+    shard.lock.unlock_shared();
+    return true;
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::put(const K& key, const V& value) {
+    this->put(key, V(value));
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::put(const K& key, V&& value) {
+    this->put(key, std::move(value), nullptr);
+}
+
+// an update takes the place of the old entry, the admission policy is not
+// asked.
+template <typename K, typename V, typename W>
+bool ClockCache<K, V, W>::put(const K& key, V&& value,
+                              std::vector<std::pair<K, V>>* evicted) {
+    auto hash = hash_of(key);
+    auto weight = W::weigh(key, value);
+    auto& shard = lock_shard(hash, false);
+
+    auto i = shard.find(key, hash);
+    auto update = shard.slots[i].used;
+    if (update)
+        shard.erase(i);
+    if (weight > shard.capacity) {
+        shard.lock.unlock();
+        return false;
+    }
+
+    if (shard.weight + weight > shard.capacity) {
+        auto& victim = shard.slots[shard.victim()];
+        if (!update && admission && !admission(key, victim.key)) {
+            shard.rejected++;
+            shard.lock.unlock();
+            return false;
+        }
+        shard.admitted++;
+    }
+    while (shard.weight + weight > shard.capacity) {
+        auto& victim = shard.slots[shard.victim()];
+        if (evicted)
+            evicted->emplace_back(std::move(victim.key),
+                                  std::move(victim.value));
+        shard.erase(shard.hand);
+    }
+
+    shard.place(K(key), std::move(value), hash, weight, update);
+
+    shard.lock.unlock();
+    return true;
+}
+
+template <typename K, typename V, typename W>
+bool ClockCache<K, V, W>::replace(const K& key, V&& value) {
+    auto hash = hash_of(key);
+    auto& shard = lock_shard(hash, true);
+    auto found = shard.slots[shard.find(key, hash)].used;
+    shard.lock.unlock_shared();
+    if (!found)
+        return false;
+
+    // may race with an eviction of the key, which only caches it again.
+    this->put(key, std::move(value), nullptr);
+    return true;
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::remove(const K& key) {
+    auto hash = hash_of(key);
+    auto& shard = lock_shard(hash, false);
+
+    auto i = shard.find(key, hash);
+    if (shard.slots[i].used)
+        shard.erase(i);
+
+    shard.lock.unlock();
+}
+
+// every shard is locked, in order, as a resharding touches all of them. no
+// one else holds two shard locks.
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::set_capacity(size_t capacity) {
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++)
+        shards[i].lock.lock();
+
+    auto n = shards_for(capacity);
+    auto share = (capacity + n - 1) / n;
+    if (n != n_shards.load(std::memory_order_relaxed))
+        reshard(n, share);
+    for (size_t i = 0; i < n; i++) {
+        auto& shard = shards[i];
+        shard.capacity = share;
+        while (shard.weight > shard.capacity)
+            shard.erase(shard.victim());
+    }
+
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++)
+        shards[i].lock.unlock();
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::reshard(size_t n, size_t share) {
+    struct Entry {
+        K key;
+        V value;
+        size_t hash;
+        size_t weight;
+        bool referenced;
+    };
+    std::vector<Entry> entries;
+    for (size_t i = 0; i < n_shards.load(std::memory_order_relaxed); i++) {
+        auto& shard = shards[i];
+        for (size_t j = 0; j <= shard.mask; j++) {
+            auto& slot = shard.slots[j];
+            if (slot.used)
+                entries.push_back({std::move(slot.key), std::move(slot.value),
+                                   slot.hash, slot.weight,
+                                   slot.referenced.load()});
+        }
+    }
+
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++)
+        shards[i].reset(i < n ? share : 0);
+    n_shards.store(n, std::memory_order_release);
+    for (auto& entry : entries)
+        shards[(entry.hash >> 56) & (n - 1)].place(
+            std::move(entry.key), std::move(entry.value), entry.hash,
+            entry.weight, entry.referenced);
+}
+
+template <typename K, typename V, typename W>
+size_t ClockCache<K, V, W>::size() {
+    size_t n = 0;
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++) {
+        shards[i].lock.lock_shared();
+        n += shards[i].size;
+        shards[i].lock.unlock_shared();
+    }
+    return n;
+}
+
+template <typename K, typename V, typename W>
+size_t ClockCache<K, V, W>::weight() {
+    size_t n = 0;
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++) {
+        shards[i].lock.lock_shared();
+        n += shards[i].weight;
+        shards[i].lock.unlock_shared();
+    }
+    return n;
+}
+
+template <typename K, typename V, typename W>
+CacheStats ClockCache<K, V, W>::stats() {
+    CacheStats stats = {};
+    for (size_t i = 0; i < CLOCK_CACHE_SHARDS; i++) {
+        auto& shard = shards[i];
+        shard.lock.lock_shared();
+        stats.hits += shard.hits.load();
+        stats.misses += shard.misses.load();
+        stats.admitted += shard.admitted;
+        stats.rejected += shard.rejected;
+        shard.lock.unlock_shared();
+    }
+    return stats;
+}
+
+// caller holds the lock exclusively, the shard is not empty.
+template <typename K, typename V, typename W>
+size_t ClockCache<K, V, W>::Shard::victim() {
+    for (;;) {
+        auto& slot = slots[hand];
+        if (slot.used && !slot.referenced)
+            return hand;
+        slot.referenced = false;
+        hand = (hand + 1) & mask;
+    }
+}
+
+// backward shift deletion: entries after `i` in its probe run move up into
+// the hole when that keeps them reachable from their home slot, so the table
+// needs no tombstones.
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::Shard::erase(size_t i) {
+    size--;
+    weight -= slots[i].weight;
+
+    for (auto j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+        auto home = slots[j].hash & mask;
+        // distance from home, cyclic.
+        if (((j - home) & mask) < ((j - i) & mask))
+            continue;
+
+        slots[i].key = std::move(slots[j].key);
+        slots[i].value = std::move(slots[j].value);
+        slots[i].hash = slots[j].hash;
+        slots[i].weight = slots[j].weight;
+        slots[i].referenced = slots[j].referenced.load();
+        i = j;
+    }
+
+    slots[i].used = false;
+    slots[i].value = V();
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::Shard::place(K&& key, V&& value, size_t hash,
+                                       size_t weight, bool referenced) {
+    if ((size + 1) * 2 > mask + 1)
+        grow();
+
+    auto& slot = slots[find(key, hash)];
+    slot.key = std::move(key);
+    slot.value = std::move(value);
+    slot.hash = hash;
+    slot.weight = weight;
+    slot.used = true;
+    slot.referenced = referenced;
+    size++;
+    this->weight += weight;
+}
+
+template <typename K, typename V, typename W>
+void ClockCache<K, V, W>::Shard::grow() {
+    auto old = std::move(slots);
+    auto n_old = mask + 1;
+    init(n_old * 2);
+
+    for (size_t j = 0; j < n_old; j++) {
+        if (!old[j].used)
+            continue;
+        auto& slot = slots[find(old[j].key, old[j].hash)];
+        slot.key = std::move(old[j].key);
+        slot.value = std::move(old[j].value);
+        slot.hash = old[j].hash;
+        slot.weight = old[j].weight;
+        slot.used = true;
+        slot.referenced = old[j].referenced.load();
+    }
+}
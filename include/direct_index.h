@@ -0,0 +1,64 @@
+#pragma once
+
+// direct addressed index for dense key spaces. keys are mapped to their slot
+// in a paged array, so a lookup is a directory access plus one load. pages
+// cover DIRECT_INDEX_PAGE_CAP consecutive keys and are allocated the first
+// time a key in their range is put.
+
+#include "index.h"
+#include "magritte_typedefs.h"
+#include "rw_spin_lock.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+const int DIRECT_INDEX_PAGE_SHIFT = 12;
+const int DIRECT_INDEX_PAGE_CAP = 1 << DIRECT_INDEX_PAGE_SHIFT;
+// page number followed by DIRECT_INDEX_PAGE_CAP indices.
+const int DIRECT_INDEX_PAGE_SIZE =
+    sizeof(uint32_t) + DIRECT_INDEX_PAGE_CAP * sizeof(MagritteIndex);
+// marks a slot without key. it is the index of the last slot of the last
+// block, which Magritte reserves, see MAGRITTE_RESERVED_SLOT.
+const MagritteIndex DIRECT_INDEX_EMPTY = UINT32_MAX;
+
+typedef struct {
+    // page number, i.e. the unsigned key of the first slot shifted down.
+    uint32_t no;
+    // position of the page in the index region.
+    uint32_t slot;
+    std::atomic<bool> dirty;
+    std::atomic<MagritteIndex> entries[DIRECT_INDEX_PAGE_CAP];
+} DirectIndexPage;
+
+class DirectIndex : public Index {
+  public:
+    DirectIndex(int file, int64_t offset, uint32_t n_pages);
+    ~DirectIndex();
+
+    bool get(MagritteKey, MagritteIndex&) override;
+    bool put(MagritteKey, MagritteIndex) override;
+    bool remove(MagritteKey, MagritteIndex&) override;
+    size_t range(MagritteKey from, MagritteKey to, size_t limit,
+                 std::vector<MagritteKeyIndexPair>& out) override;
+    bool flush(FlushReason reason) override;
+    size_t size() override;
+
+  private:
+    // pages in the order they are persisted.
+    std::deque<DirectIndexPage> pages;
+    // directory[no - directory_base] points to page `no`, or is null.
+    std::vector<DirectIndexPage*> directory;
+    uint32_t directory_base;
+    int64_t offset;
+    int file;
+
+    // directory is only resized under exclusive lock, lookups and writes into
+    // existing pages hold it shared.
+    rw_spin_lock lock;
+
+    DirectIndexPage* find_page(uint32_t no);
+    DirectIndexPage* allocate_page(uint32_t no);
+    static uint32_t page_of(MagritteKey key);
+    static uint32_t slot_of(MagritteKey key);
+};
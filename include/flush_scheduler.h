@@ -0,0 +1,71 @@
+#pragma once
+
+// flushes the dirty blocks of a store from a small pool of workers, instead
+// of every block running a thread of its own.
+//
+// a block enqueues itself when it turns dirty, and is flushed once it has been
+// dirty for `millisec_flush_timeout`, or right away when asked to. when
+// several blocks are due, the one with the most dirty bytes times age goes
+// first.
+
+#include "channel.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class Block;
+
+const int FLUSH_SCHEDULER_WORKERS = 2;
+const int FLUSH_SCHEDULER_QUEUE_SIZE = 1024;
+
+typedef struct {
+    Block* block;
+    // flush as soon as possible instead of after the timeout.
+    bool urgent;
+} FlushRequest;
+
+class FlushScheduler {
+  public:
+    FlushScheduler(uint32_t millisec_flush_timeout,
+                   int n_workers = FLUSH_SCHEDULER_WORKERS);
+    FlushScheduler(const FlushScheduler&) = delete;
+    FlushScheduler& operator=(const FlushScheduler&) = delete;
+    ~FlushScheduler();
+
+    // blocks register when created and must be removed before they go away,
+    // remove() waits for a flush of the block in progress.
+    void add(Block* block);
+    void remove(Block* block);
+    void enqueue(Block* block, bool urgent);
+    void shutdown();
+
+  private:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    struct Entry {
+        time_point since;
+        bool urgent;
+    };
+
+    void worker();
+    // the due block with the highest priority, or nullptr. `next_due` is set
+    // to when the earliest block not yet due will be.
+    Block* pick(time_point now, time_point& next_due);
+
+    std::chrono::milliseconds timeout;
+    channel<FlushRequest> requests;
+
+    std::mutex mutex;
+    std::condition_variable flushed;
+    std::unordered_set<Block*> registered;
+    std::unordered_map<Block*, Entry> queued;
+    std::unordered_multiset<Block*> flushing;
+
+    std::atomic<bool> shutdown_;
+    std::vector<std::thread> workers;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+// open addressing hash index for workloads that only do point operations.
+// slots are probed a group at a time, every slot has a control byte holding
+// 7 bits of the key's hash, so a whole group is matched with one SIMD compare
+// before any key is touched.
+//
+// tables grow incrementally: once a table is too loaded a table twice as
+// large is created, and every following put/remove moves a few groups over,
+// lookups consult both tables until the old one is drained.
+
+#include "index.h"
+#include "index_block.h"
+#include "magritte_typedefs.h"
+#include "rw_spin_lock.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+const int HASH_INDEX_GROUP_WIDTH = 16;
+// groups persisted together as one page of the index region.
+const int HASH_INDEX_PAGE_GROUPS = 64;
+const int HASH_INDEX_PAGE_SLOTS =
+    HASH_INDEX_PAGE_GROUPS * HASH_INDEX_GROUP_WIDTH;
+// groups moved from the old table by every put and remove while resizing.
+const int HASH_INDEX_MIGRATE_GROUPS = 8;
+
+const uint8_t HASH_INDEX_CTRL_EMPTY = 0x80;
+const uint8_t HASH_INDEX_CTRL_DELETED = 0xFE;
+
+typedef struct {
+    // number of groups of the table the page belongs to.
+    uint32_t n_groups;
+    uint32_t page_no;
+    // 1 if the page belongs to the table being drained by a resize.
+    uint32_t old;
+    uint32_t reserved;
+} HashIndexPageHeader;
+
+const int HASH_INDEX_PAGE_SIZE = sizeof(HashIndexPageHeader) +
+                                 HASH_INDEX_PAGE_SLOTS +
+                                 HASH_INDEX_PAGE_SLOTS *
+                                     sizeof(MagritteKeyIndexPair);
+
+struct HashIndexTable {
+    uint32_t n_groups;
+    uint32_t n_items;
+    uint32_t n_deleted;
+    std::vector<uint8_t> ctrl;
+    std::vector<MagritteKeyIndexPair> slots;
+    std::vector<bool> dirty_mark;
+
+    HashIndexTable(uint32_t n_groups);
+    // slot holding `key`, or -1.
+    int64_t find(MagritteKey key, uint32_t hash) const;
+    // puts `key` into a free slot, the key must not be in the table.
+    void insert(MagritteKey key, MagritteIndex index, uint32_t hash);
+    void erase(int64_t slot);
+    bool overloaded() const;
+    uint32_t n_pages() const;
+};
+
+class HashIndex : public Index {
+  public:
+    HashIndex(int file, int64_t offset, uint32_t n_pages);
+    ~HashIndex();
+
+    bool get(MagritteKey, MagritteIndex&) override;
+    bool put(MagritteKey, MagritteIndex) override;
+    bool remove(MagritteKey, MagritteIndex&) override;
+    size_t range(MagritteKey from, MagritteKey to, size_t limit,
+                 std::vector<MagritteKeyIndexPair>& out) override;
+    bool flush(FlushReason reason) override;
+    size_t size() override;
+
+  private:
+    std::unique_ptr<HashIndexTable> table;
+    // table being drained into `table`, null unless resizing.
+    std::unique_ptr<HashIndexTable> old_table;
+    // groups of old_table below this are already moved.
+    uint32_t migrated;
+    int64_t offset;
+    int file;
+
+    rw_spin_lock lock;
+
+    void migrate_step();
+    void start_resize();
+    bool flush_table(HashIndexTable& source, bool old, uint32_t first_slot);
+    static uint32_t hash_of(MagritteKey key);
+};
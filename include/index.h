@@ -0,0 +1,53 @@
+#pragma once
+
+// common interface of the key -> MagritteIndex mappings a Magritte instance
+// can be opened with, the kind is chosen by MagritteConfig::index_type when
+// the file is created and recorded in MagritteMeta afterwards.
+
+#include "magritte_typedefs.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+typedef enum {
+    // a periodic flush while the index is in use. an index that cannot write
+    // part of itself while it changes skips it and returns false.
+    Timeout,
+    Manually,
+} FlushReason;
+
+class Index {
+  public:
+    virtual ~Index() = default;
+
+    virtual bool get(MagritteKey, MagritteIndex&) = 0;
+    virtual bool put(MagritteKey, MagritteIndex) = 0;
+    virtual bool remove(MagritteKey, MagritteIndex&) = 0;
+    // appends pairs with from <= key <= to to `out` in key order. stops once
+    // `limit` pairs are appended, unless collecting them costs a full sweep
+    // anyway, returns the number of pairs appended.
+    virtual size_t range(MagritteKey from, MagritteKey to, size_t limit,
+                         std::vector<MagritteKeyIndexPair>& out) = 0;
+    // batched get and put, by default one call per key. found[i] tells
+    // whether keys[i] exists, and indices[i] holds its index if so.
+    virtual void multi_get(const std::vector<MagritteKey>& keys,
+                           std::vector<MagritteIndex>& indices,
+                           std::vector<bool>& found);
+    virtual void multi_put(const std::vector<MagritteKeyIndexPair>& pairs);
+    virtual bool flush(FlushReason reason) = 0;
+    // number of persisted units, recorded as MagritteMeta::n_index_blocks.
+    virtual size_t size() = 0;
+
+    // called by a Timeout flush once it holds what it writes and before
+    // writing it. nothing is written if it returns false.
+    void set_flush_barrier(std::function<bool()> barrier) {
+        this->flush_barrier = std::move(barrier);
+    }
+
+  protected:
+    std::function<bool()> flush_barrier;
+};
+
+std::unique_ptr<Index> load_index(MagritteIndexType type, int file,
+                                  int64_t offset, uint32_t n_blocks);
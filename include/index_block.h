@@ -4,21 +4,26 @@
 // within a lower bound and upper bound, and provide wrapper method for put,
 // update and delete, and also a split function that splits the block into two
 // index block with splited upper and lower bound if the block is full.
+//
+// pairs in `store` are kept sorted by key, lookups narrow the range with a
+// branchless binary search and finish with a SIMD compare kernel (AVX2/SSE2
+// when the compiler targets them, scalar otherwise).
 
 #include "magritte_typedefs.h"
 #include "rw_spin_lock.h"
 #include <vector>
 
-typedef struct {
-    MagritteKey key;
-    MagritteIndex index;
-} MagritteKeyIndexPair;
-
 const int INDEX_BLOCK_MAX_CAP = 1 << 10;
 const int INDEX_BLOCK_DATA_SEG_SIZE =
     INDEX_BLOCK_MAX_CAP * sizeof(MagritteKeyIndexPair);
 const int INDEX_BLOCK_SIZE =
     INDEX_BLOCK_DATA_SEG_SIZE + 2 * sizeof(MagritteKey);
+// binary search stops once the candidate range is no longer than this, the
+// rest is resolved by counting smaller keys in one pass.
+const int INDEX_BLOCK_SEARCH_WINDOW = 8;
+// index of the pairs filling the unused tail of a written block, they are
+// dropped when it is loaded.
+const MagritteIndex INDEX_BLOCK_NO_INDEX = ~MagritteIndex(0);
 
 class IndexBlock {
   public:
@@ -32,6 +37,16 @@ class IndexBlock {
     std::pair<bool, IndexBlock> put_or_split_put(MagritteKey key,
                                                    MagritteIndex index);
     bool get(MagritteKey key, MagritteIndex& value);
+    // looks up keys[0..n), sorted by key, under one lock. keys[i].index is
+    // the position the result is stored at in `indices` and `found`.
+    void get_many(const MagritteKeyIndexPair* keys, size_t n,
+                  std::vector<MagritteIndex>& indices,
+                  std::vector<bool>& found);
+    // puts pairs[0..n) under one lock, stops at the first new key that finds
+    // the block full. returns the number of pairs put.
+    size_t put_many(const MagritteKeyIndexPair* pairs, size_t n);
+    size_t range(MagritteKey from, MagritteKey to, size_t limit,
+                 std::vector<MagritteKeyIndexPair>& out);
     bool remove(MagritteKey key, MagritteIndex& index);
     bool fit_in(MagritteKey key);
     bool full();
@@ -42,6 +57,9 @@ class IndexBlock {
     MagritteKey upper_bound();
     int size();
     std::pair<char*, size_t> data();
+    // copies the block as it is written to the file, INDEX_BLOCK_SIZE bytes,
+    // into `out` under a shared lock.
+    void snapshot(std::vector<char>& out);
 
   private:
     MagritteKey _lower_bound;
@@ -52,4 +70,7 @@ class IndexBlock {
 
     void put_lockfree(MagritteKey key, MagritteIndex value);
     IndexBlock split_lockfree();
+    IndexBlock split_lockfree(MagritteKey mid);
+    MagritteKey midpoint();
+    size_t lower_bound_of(MagritteKey key) const;
 };
@@ -1,36 +1,54 @@
 #pragma once
 
+#include "index.h"
 #include "index_block.h"
 #include "magritte_typedefs.h"
 #include "rw_spin_lock.h"
+#include <atomic>
+#include <deque>
 #include <vector>
 
-typedef enum {
-    Timeout,
-    Manually,
-    OffsetChange,
-} FlushReason;
+// blocks a flush copies before writing them.
+const size_t INDEX_CLUSTER_FLUSH_BATCH = 256;
 
-class IndexCluster {
+class IndexCluster : public Index {
   public:
-    IndexCluster(int file, uint32_t offset, uint32_t n_blocks);
+    IndexCluster(int file, int64_t offset, uint32_t n_blocks);
     ~IndexCluster();
 
     IndexCluster& operator=(IndexCluster&) = delete;
     IndexCluster& operator=(IndexCluster&&);
-    bool get(MagritteKey, MagritteIndex&);
-    bool put(MagritteKey, MagritteIndex);
-    bool remove(MagritteKey, MagritteIndex&);
-    bool flush(FlushReason reason);
-    bool set_offset(uint32_t offset);
-    size_t size();
+    bool get(MagritteKey, MagritteIndex&) override;
+    bool put(MagritteKey, MagritteIndex) override;
+    bool remove(MagritteKey, MagritteIndex&) override;
+    size_t range(MagritteKey from, MagritteKey to, size_t limit,
+                 std::vector<MagritteKeyIndexPair>& out) override;
+    void multi_get(const std::vector<MagritteKey>& keys,
+                   std::vector<MagritteIndex>& indices,
+                   std::vector<bool>& found) override;
+    void multi_put(const std::vector<MagritteKeyIndexPair>& pairs) override;
+    bool flush(FlushReason reason) override;
+    size_t size() override;
 
   private:
-    std::vector<IndexBlock> index_blocks;
-    std::vector<bool> dirty_mark;
-    uint32_t offset;
+    // blocks are kept in the order they are persisted, slot i lives at
+    // offset + i * INDEX_BLOCK_SIZE. deque keeps references stable while
+    // splits append, so routed blocks stay valid under the shared lock.
+    std::deque<IndexBlock> index_blocks;
+    std::deque<std::atomic<bool>> dirty_mark;
+    // sorted lower bounds of all blocks, fence_slots[i] is the slot in
+    // index_blocks of the block starting at fences[i].
+    std::vector<MagritteKey> fences;
+    std::vector<uint32_t> fence_slots;
+    int64_t offset;
     int file;
 
+    size_t route(MagritteKey key) const;
+    size_t group_end(const std::vector<MagritteKeyIndexPair>& sorted,
+                     size_t first, size_t pos) const;
+    bool split_put(MagritteKey key, MagritteIndex index);
+    void rebuild_fences();
+
     rw_spin_lock lock;
 };
 
@@ -0,0 +1,94 @@
+#pragma once
+
+// a minimal io_uring reader for one file, driven by the raw syscalls so there
+// is no dependency on liburing. the file and a staging buffer are registered
+// with the ring, reads are submitted as fixed buffer reads and a whole batch
+// is submitted and reaped with a single io_uring_enter.
+//
+// when the kernel refuses to set up the ring (old kernels, seccomp, memlock
+// limits...) reads fall back to pread, stats() counts them. a ring pins
+// IO_RING_DEPTH * IO_RING_MAX_READ bytes of locked memory, so a store shares
+// a few of them between all of its blocks.
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+typedef enum : char {
+    // blocking pread on the calling thread, the default.
+    Pread = 0,
+    // io_uring, falls back to pread when unavailable.
+    IoUring = 1,
+    // blocks are mapped and read in place, falls back to pread when the
+    // mapping fails.
+    Mmap = 2,
+} MagritteIoBackend;
+
+// number of reads in flight per ring.
+const unsigned IO_RING_DEPTH = 128;
+// largest single read, a slot of the largest size class. reads are staged
+// in a registered buffer of IO_RING_DEPTH * IO_RING_MAX_READ bytes.
+const uint32_t IO_RING_MAX_READ = 4096;
+
+typedef struct {
+    char* buffer;
+    uint32_t len;
+    int64_t offset;
+    // bytes read, or -errno.
+    int32_t result;
+} IoRingRead;
+
+typedef struct {
+    // reads submitted to the ring.
+    uint64_t n_ring_reads;
+    // reads done with pread instead, as the ring was unavailable, busy or
+    // failed to take them.
+    uint64_t n_pread_reads;
+} IoRingStats;
+
+class IoRing {
+  public:
+    IoRing(int file, unsigned depth = IO_RING_DEPTH);
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+    ~IoRing();
+
+    bool available() const;
+    // reads every entry of `reads`, `depth` of them in flight at a time. when
+    // the ring is busy with another thread and `wait` is false, or it is not
+    // available at all, the reads are done with pread instead.
+    void read(IoRingRead* reads, size_t n, bool wait = true);
+    IoRingStats stats() const;
+
+  private:
+    bool setup();
+    void teardown();
+    void read_pread(IoRingRead* reads, size_t n);
+    // submits reads[0..n), n <= depth, and waits for all of them.
+    bool submit_and_wait(IoRingRead* reads, size_t n);
+
+    int file;
+    unsigned depth;
+    int ring_fd;
+    std::mutex mutex;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    void* sqes_ptr;
+    size_t sqes_size;
+
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    void* cqes;
+
+    char* staging;
+
+    std::atomic<uint64_t> n_ring_reads;
+    std::atomic<uint64_t> n_pread_reads;
+};
@@ -4,13 +4,18 @@
 #include <list>
 #include <rw_spin_lock.h>
 #include <unordered_map>
+#include <utility>
 
 template <typename K, typename V> class LRUCache {
   public:
     LRUCache(size_t capacity);
     LRUCache<K, V>& operator=(LRUCache<K, V>&& other);
     bool get(const K& key, V& value);
+    // calls `reader` with the cached value under the lock, so it can be
+    // copied straight to where it is needed.
+    template <typename F> bool get_with(const K& key, F&& reader);
     void put(const K& key, const V& value);
+    void put(const K& key, V&& value);
     void remove(const K& key);
 
   private:
@@ -37,26 +42,49 @@ LRUCache<K, V>& LRUCache<K, V>::operator=(LRUCache<K, V>&& other) {
 
 template <typename K, typename V>
 bool LRUCache<K, V>::get(const K& key, V& value) {
-    lock.lock_shared();
+    // splice reorders the list, a shared lock is not enough.
+    lock.lock();
 
     auto it = cacheMap.find(key);
     if (it == cacheMap.end()) {
-        lock.unlock_shared();
+        lock.unlock();
         return false;
     }
     cacheList.splice(cacheList.begin(), cacheList, it->second);
     value = it->second->second;
 
-    lock.unlock_shared();
+    lock.unlock();
+    return true;
+}
+
+template <typename K, typename V>
+template <typename F>
+bool LRUCache<K, V>::get_with(const K& key, F&& reader) {
+    lock.lock();
+
+    auto it = cacheMap.find(key);
+    if (it == cacheMap.end()) {
+        lock.unlock();
+        return false;
+    }
+    cacheList.splice(cacheList.begin(), cacheList, it->second);
+    reader(it->second->second);
+
+    lock.unlock();
     return true;
 }
 
 template <typename K, typename V>
 void LRUCache<K, V>::put(const K& key, const V& value) {
+    this->put(key, V(value));
+}
+
+template <typename K, typename V>
+void LRUCache<K, V>::put(const K& key, V&& value) {
     lock.lock();
     auto it = cacheMap.find(key);
     if (it != cacheMap.end()) {
-        it->second->second = value;
+        it->second->second = std::move(value);
         cacheList.splice(cacheList.begin(), cacheList, it->second);
     } else {
         if (cacheList.size() == capacity) {
@@ -65,7 +93,7 @@ void LRUCache<K, V>::put(const K& key, const V& value) {
             cacheMap.erase(last->first);
             cacheList.pop_back();
         }
-        cacheList.emplace_front(key, value);
+        cacheList.emplace_front(key, std::move(value));
         cacheMap[key] = cacheList.begin();
     }
     lock.unlock();
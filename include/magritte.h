@@ -7,8 +7,15 @@ __attribute__((visibility("default"))) int magritte_init(const char* filepath);
 __attribute__((visibility("default"))) bool magritte_put(int m_no, int32_t key, char* value, int len);
 __attribute__((visibility("default"))) bool magritte_probe(int m_no, int32_t key);
 __attribute__((visibility("default"))) bool magritte_get(int m_no, int32_t key, char* value, int* len);
+__attribute__((visibility("default"))) int magritte_mget(int m_no, int n, int32_t* keys, char** values, int* lens);
+__attribute__((visibility("default"))) bool magritte_mput(int m_no, int n, int32_t* keys, char** values, int* lens);
 __attribute__((visibility("default"))) bool magritte_remove(int m_no, int32_t key, char* value, int len);
+__attribute__((visibility("default"))) bool magritte_cache_stats(int m_no, uint64_t* hits, uint64_t* misses, uint64_t* admitted, uint64_t* rejected);
+__attribute__((visibility("default"))) bool magritte_set_cache_budget(int m_no, uint64_t read_bytes, uint64_t write_bytes);
 __attribute__((visibility("default"))) bool magritte_shutdown(int m_no);
+__attribute__((visibility("default"))) int magritte_iter_open(int m_no, int32_t from, int32_t to);
+__attribute__((visibility("default"))) bool magritte_iter_next(int iter, int32_t* key, char* value, int* len);
+__attribute__((visibility("default"))) bool magritte_iter_close(int iter);
 __attribute__((visibility("default"))) bool last_error(char* error);
 
 }
@@ -1,35 +1,120 @@
 #pragma once
 
 #include "Block.h"
-#include "index_cluster.h"
+#include "block_directory.h"
+#include "clock_cache.h"
+#include "flush_scheduler.h"
+#include "index.h"
 #include "job_conter.h"
-#include "lru.h"
 #include "magritte_typedefs.h"
+#include "tiny_lfu.h"
+#include "wal.h"
+#include <array>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <rw_spin_lock.h>
+#include <span>
 #include <string>
+#include <thread>
 #include <vector>
 
 struct MagritteMeta {
     char version_major;
     char version_minor;
     char version_patch;
+    MagritteIndexType index_type;
     uint32_t n_blocks;
     uint32_t n_index_blocks;
     uint32_t n_stored_items;
     uint32_t extras;
 };
 
+// version of the file format written. files of another major.minor are not
+// opened, there is no upgrade path between them, see the README:
+// - 0.1: fixed 1 KiB slots, the index after the blocks in the store file.
+// - 0.2: slab size classes, a length prefix in front of every value.
+// - 0.3: the index in `<file>.idx`.
+const char MAGRITTE_VERSION_MAJOR = 0;
+const char MAGRITTE_VERSION_MINOR = 3;
+const char MAGRITTE_VERSION_PATCH = 0;
+
+// cache budgets when the config leaves them 0.
+const uint64_t MAGRITTE_READ_CACHE_BYTES = 3 << 20;
+const uint64_t MAGRITTE_WRITE_CACHE_BYTES = 1 << 20;
+
+// the last slot of the last block is never handed out, its index is
+// UINT32_MAX, which DIRECT_INDEX_EMPTY and WAL_NO_INDEX use to mean no slot.
+const MagritteInBlockIndex MAGRITTE_RESERVED_SLOT = BLOCK_MAX_CAP - 1;
+static_assert(((MAGRITTE_MAX_BLOCKS - 1) << 20 | MAGRITTE_RESERVED_SLOT) ==
+              UINT32_MAX);
+
+// number of pairs scan() reads from the index and blocks at a time.
+const size_t MAGRITTE_SCAN_BATCH = 256;
+
+// writers of a key hold one of these, picked by the key, see key_lock().
+const size_t MAGRITTE_KEY_LOCKS = 256;
+
+// rings the blocks of a store share with the IoUring backend.
+const size_t MAGRITTE_IO_RINGS = 4;
+
+typedef struct {
+    MagritteKey next;
+    MagritteKey to;
+    bool done;
+} MagritteScanCursor;
+
 class Magritte {
   public:
     Magritte(std::string filepath, MagritteConfig* config = nullptr);
     Magritte(Magritte&&);
     ~Magritte();
     bool put(MagritteKey key, std::vector<char> value);
+    bool put(MagritteKey key, std::span<const char> value);
     bool get(MagritteKey key, std::vector<char>& value);
+    // copies the value of `key` into `out` if it fits. returns its length,
+    // or -1 if the key is not found.
+    int64_t get_into(MagritteKey key, std::span<char> out);
     bool remove(MagritteKey key, std::vector<char>& value);
     bool probe(MagritteKey key);
+    // reads the value of `key` without copying it when blocks are mapped,
+    // see BlockView. caches are not consulted.
+    bool get_view(MagritteKey key, BlockView& view);
+    // batched get/put, the index is walked once for the whole batch and
+    // values are read in file order. found[i] tells whether keys[i] exists.
+    void multi_get(const std::vector<MagritteKey>& keys,
+                   std::vector<MagritteValue>& values,
+                   std::vector<bool>& found);
+    bool multi_put(const std::vector<MagritteKey>& keys,
+                   std::vector<MagritteValue> values);
+    // calls `callback` for every key in [from, to] in key order, until it
+    // returns false.
+    bool scan(MagritteKey from, MagritteKey to,
+              std::function<bool(MagritteKey, MagritteValue&)> callback);
+    // appends up to `limit` pairs following `cursor` to `out` and advances
+    // it, returns false once the cursor is exhausted.
+    bool scan_batch(MagritteScanCursor& cursor, size_t limit,
+                    std::vector<std::pair<MagritteKey, MagritteValue>>& out);
+    // write-back totals summed over all blocks.
+    BlockFlushStats flush_stats();
+    // reads of the IoUring backend summed over the rings. reads that fell
+    // back to pread are counted apart, all of them are when io_uring is
+    // unavailable. zero with other backends.
+    IoRingStats io_stats();
+    // lookups of the read and write caches by get(), a lookup is a miss if
+    // neither has the key. admitted and rejected are those of the read cache.
+    CacheStats cache_stats();
+    // resizes the caches to the given bytes, evicting what no longer fits.
+    // 0 turns a cache off.
+    void set_cache_budget(uint64_t read_bytes, uint64_t write_bytes);
+    // writes out blocks, index and meta, then empties the log. writers wait
+    // for it.
+    void checkpoint();
+    // records appended and syncs done by the log, zero without one.
+    WalStats wal_stats();
     void shutdown();
 
   private:
@@ -37,22 +122,95 @@ class Magritte {
     std::string filepath;
     MagritteConfig config;
     int file;
+    // `<file>.idx`, see the constructor.
+    int index_file;
 
     std::atomic_bool shutdown_;
     job_couter counter;
 
+    // declared before blocks, they unregister from it when destroyed.
+    std::unique_ptr<FlushScheduler> flush_scheduler;
+    // empty unless the backend is IoUring. block i reads through ring
+    // i % MAGRITTE_IO_RINGS, they outlive the blocks like the scheduler.
+    std::vector<std::unique_ptr<IoRing>> rings;
+    IoRing* ring_for(size_t block_index) {
+        return this->rings.empty()
+                   ? nullptr
+                   : this->rings[block_index % this->rings.size()].get();
+    }
+    // reserved for MAGRITTE_MAX_BLOCKS up front, blocks never move. blocks
+    // of all size classes follow each other in the order they were made.
     std::vector<Block> blocks;
-    std::pair<Block*, int> allocate_block(int expect_size);
+    // where the next block goes.
+    int64_t blocks_end;
+    // one for the blocks of each size class.
+    std::array<BlockDirectory, BLOCK_N_SLOT_SIZES> directories;
+    // the block of `size_class` new values go to, or nullptr when the store
+    // is full. `failed` is not returned, a put to it just failed.
+    std::pair<Block*, int> vacant_block(int size_class,
+                                        const Block* failed = nullptr);
+    // caller holds allocation_lock.
+    std::pair<Block*, int> allocate_block(int size_class);
+    // puts `value` in a new slot of its size class and returns its index.
+    bool insert(MagritteValue&& value, int size_class, MagritteIndex& index);
+    // frees the slot at `index` and marks its block in its directory.
+    void free_slot(MagritteIndex index);
 
+    // serializes moving on to another fill block.
     rw_spin_lock allocation_lock;
 
-    IndexCluster indicies;
+    std::unique_ptr<Index> indicies;
 
     // cache recently read data
-    LRUCache<MagritteKey, std::vector<char>> r_cache;
+    TinyLfuCache<MagritteKey, std::vector<char>, CacheByteWeigher> r_cache;
     // recently writed data also have cache for fast reading, but in smaller
     // size.
-    LRUCache<MagritteKey, std::vector<char>> w_cache;
+    ClockCache<MagritteKey, std::vector<char>, CacheByteWeigher> w_cache;
+
+    // the bodies of put, remove and multi_put, run under a shared
+    // checkpoint_lock. `position` is where the log has to be synced to.
+    bool put_locked(MagritteKey key, MagritteValue&& value,
+                    uint64_t& position);
+    bool remove_locked(MagritteKey key, MagritteValue& value,
+                       uint64_t& position);
+    bool multi_put_locked(const std::vector<MagritteKey>& keys,
+                          std::vector<MagritteValue>& values,
+                          uint64_t& position);
+
+    // held by put, remove and multi_put from reading the index of a key
+    // until the slot it had is freed, so two writers never move the same
+    // value, nor does one update a slot another frees.
+    std::array<rw_spin_lock, MAGRITTE_KEY_LOCKS> key_locks;
+    rw_spin_lock& key_lock(MagritteKey key) {
+        return this->key_locks[uint32_t(key) % MAGRITTE_KEY_LOCKS];
+    }
+
+    // nullptr with no durability.
+    std::unique_ptr<WriteAheadLog> wal;
+    // held shared by writers between changing the store and appending to
+    // the log, exclusively by checkpoint().
+    rw_spin_lock checkpoint_lock;
+    // applies a record of the log at open.
+    void redo(const WalRecordHeader& header, std::span<const char> value);
+    // makes everything done so far durable in the store file.
+    void persist();
+    // waits for the log as the durability asks, and checkpoints once the log
+    // is large.
+    bool commit(uint64_t position);
+
+    // writes the index blocks changed since the last time every
+    // millisec_flush_timeout, after the log holds their changes.
+    std::thread index_checkpointer;
+    std::mutex checkpointer_mutex;
+    std::condition_variable checkpointer_wake;
+    void start_index_checkpointer();
+    void stop_index_checkpointer();
+    void checkpoint_index();
 
+    // writes out the index and records its size in the meta.
+    bool flush_index();
     bool flush_meta();
+    void read_indices(const std::vector<MagritteIndex>& indices,
+                      const std::vector<bool>& found,
+                      std::vector<MagritteValue>& values);
 };
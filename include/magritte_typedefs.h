@@ -7,9 +7,54 @@ typedef int32_t MagritteKey;
 typedef uint32_t MagritteIndex;
 
 typedef struct {
+    MagritteKey key;
+    MagritteIndex index;
+} MagritteKeyIndexPair;
+
+typedef enum : char {
+    // range partitioned IndexCluster, the default.
+    Cluster = 0,
+    // DirectIndex, for dense and mostly sequential keys.
+    Direct = 1,
+    // HashIndex, for point operations only.
+    Hash = 2,
+} MagritteIndexType;
+
+typedef enum : char {
+    // every value read is cached, CLOCK picks what is evicted.
+    Clock = 0,
+    // W-TinyLFU admission in front of the read cache, see tiny_lfu.h.
+    TinyLfu = 1,
+} MagritteCachePolicy;
+
+typedef enum : char {
+    // no log, changes reach the file with the next flush of their block. the
+    // default, a log is only kept when the config asks for one.
+    NoLog = 0,
+    // changes are logged and the log is synced every few milliseconds, a
+    // crash loses at most those.
+    Batched = 1,
+    // put() and remove() return once their change is synced to the log,
+    // changes made at the same time share a sync.
+    PerOp = 2,
+} MagritteDurability;
+
+typedef struct {
+    // unused, the caches are sized by read_cache_bytes and write_cache_bytes.
     uint32_t n_read_cache;
     uint32_t n_write_buffer_per_block;
     uint32_t millisec_flush_timeout;
+    // only used when creating a new file, existing files keep their kind.
+    MagritteIndexType index_type;
+    MagritteIoBackend io_backend;
+    MagritteCachePolicy cache_policy;
+    // memory the caches may take, values and per entry overhead included. 0
+    // picks the default, see Magritte::set_cache_budget() to change them
+    // later.
+    uint64_t read_cache_bytes;
+    uint64_t write_cache_bytes;
+    // see wal.h.
+    MagritteDurability durability;
 } MagritteConfig;
 
 inline std::pair<uint16_t, MagritteInBlockIndex> get_block_index(MagritteIndex key) {
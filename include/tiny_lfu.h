@@ -0,0 +1,257 @@
+#pragma once
+
+// W-TinyLFU in front of a ClockCache, after Einziger et al., "TinyLFU: A
+// Highly Efficient Cache Admission Policy".
+//
+// every lookup counts its key in a count-min sketch of 4-bit counters, which
+// are halved once the sketch has seen ten times as many lookups as the cache
+// holds, so old popularity fades. new keys go to a small window cache first.
+// what the window evicts is offered to the main cache, and only takes the
+// place of the main cache's victim if its key was looked up more often. keys
+// read once, like those of a full scan, then pass through the window without
+// pushing hot keys out.
+//
+// without admission the window and sketch are left out, it is a plain
+// ClockCache.
+
+#include "clock_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <rw_spin_lock.h>
+#include <utility>
+#include <vector>
+
+// share of the capacity given to the window.
+const size_t TINY_LFU_WINDOW_PERCENT = 1;
+// lookups between agings, per entry of the cache.
+const size_t TINY_LFU_SAMPLE_FACTOR = 10;
+
+class FrequencySketch {
+  public:
+    FrequencySketch(size_t capacity);
+
+    void increment(uint64_t hash);
+    // an estimate of how often `hash` was counted, at most 15.
+    uint32_t frequency(uint64_t hash) const;
+    // sizes the sketch for a cache of `capacity` entries. the counts start
+    // over if the table changes size.
+    void resize(size_t capacity);
+
+  private:
+    // word and bit offset of the counter of `hash` in `row`.
+    std::pair<size_t, uint32_t> counter(uint64_t hash, uint64_t row) const;
+    void age();
+
+    // 16 counters to a word, a key has one counter in each of 4 words.
+    std::unique_ptr<std::atomic<uint64_t>[]> table;
+    size_t mask;
+    size_t sample_size;
+    std::atomic<size_t> additions;
+    // held shared while counting and estimating, exclusively by resize().
+    mutable rw_spin_lock lock;
+};
+
+inline FrequencySketch::FrequencySketch(size_t capacity) : mask(0) {
+    resize(capacity);
+}
+
+inline void FrequencySketch::resize(size_t capacity) {
+    auto n_words = std::bit_ceil(std::max<size_t>(capacity, 64));
+    lock.lock();
+    if (n_words != mask + 1) {
+        table = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+        for (size_t i = 0; i < n_words; i++)
+            table[i] = 0;
+        mask = n_words - 1;
+        additions = 0;
+    }
+    sample_size = std::max<size_t>(capacity, 1) * TINY_LFU_SAMPLE_FACTOR;
+    lock.unlock();
+}
+
+// the counter of `row` is nibble `x % 16` of word `x / 16`, rows step by an
+// odd multiple of the upper half of the hash.
+inline std::pair<size_t, uint32_t>
+FrequencySketch::counter(uint64_t hash, uint64_t row) const {
+    hash *= 0x9e3779b97f4a7c15ULL;
+    auto x = hash + row * ((hash >> 32) | 1);
+    return std::make_pair((x >> 4) & mask, uint32_t(x & 15) * 4);
+}
+
+inline void FrequencySketch::increment(uint64_t hash) {
+    lock.lock_shared();
+    for (uint64_t row = 0; row < 4; row++) {
+        auto [i, shift] = counter(hash, row);
+        auto value = table[i].load(std::memory_order_relaxed);
+        auto one = uint64_t(1) << shift;
+        while (((value >> shift) & 15) != 15 &&
+               !table[i].compare_exchange_weak(value, value + one,
+                                               std::memory_order_relaxed))
+            ;
+    }
+
+    if (additions.fetch_add(1, std::memory_order_relaxed) + 1 == sample_size)
+        age();
+    lock.unlock_shared();
+}
+
+inline uint32_t FrequencySketch::frequency(uint64_t hash) const {
+    uint32_t frequency = 15;
+    lock.lock_shared();
+    for (uint64_t row = 0; row < 4; row++) {
+        auto [i, shift] = counter(hash, row);
+        auto count = (table[i].load(std::memory_order_relaxed) >> shift) & 15;
+        frequency = std::min<uint32_t>(frequency, count);
+    }
+    lock.unlock_shared();
+    return frequency;
+}
+
+// halves every counter. increments racing with it may be lost, which only
+// makes the estimate a little lower.
+inline void FrequencySketch::age() {
+    for (size_t i = 0; i <= mask; i++) {
+        auto value = table[i].load(std::memory_order_relaxed);
+        table[i].store((value >> 1) & 0x7777777777777777ULL,
+                       std::memory_order_relaxed);
+    }
+    additions.store(0, std::memory_order_relaxed);
+}
+
+template <typename K, typename V, typename W = CacheUnitWeigher>
+class TinyLfuCache {
+  public:
+    // `capacity` is in the units of the weigher, like ClockCache.
+    TinyLfuCache(size_t capacity, bool admission);
+    TinyLfuCache& operator=(TinyLfuCache&& other);
+    bool get(const K& key, V& value);
+    // calls `reader` with the cached value under the lock, so it can be
+    // copied straight to where it is needed.
+    template <typename F> bool get_with(const K& key, F&& reader);
+    void put(const K& key, const V& value);
+    void put(const K& key, V&& value);
+    void remove(const K& key);
+    // resizes the sketch along with the caches.
+    void set_capacity(size_t capacity);
+    size_t weight();
+    // lookups of both caches, and what the main cache admitted and turned
+    // away.
+    CacheStats stats();
+
+  private:
+    // the window's share of `capacity`, the main cache gets the rest.
+    static size_t window_capacity(size_t capacity);
+
+    std::unique_ptr<FrequencySketch> sketch;
+    std::unique_ptr<ClockCache<K, V, W>> window;
+    std::unique_ptr<ClockCache<K, V, W>> main;
+};
+
+template <typename K, typename V, typename W>
+size_t TinyLfuCache<K, V, W>::window_capacity(size_t capacity) {
+    return std::min(
+        capacity, std::max(capacity * TINY_LFU_WINDOW_PERCENT / 100, W::unit));
+}
+
+template <typename K, typename V, typename W>
+TinyLfuCache<K, V, W>::TinyLfuCache(size_t capacity, bool admission) {
+    if (!admission) {
+        main = std::make_unique<ClockCache<K, V, W>>(capacity);
+        return;
+    }
+
+    auto n_window = window_capacity(capacity);
+    sketch = std::make_unique<FrequencySketch>(capacity / W::unit);
+    window = std::make_unique<ClockCache<K, V, W>>(n_window);
+
+    // the sketch is owned here, the pointer stays valid when moved.
+    auto s = sketch.get();
+    main = std::make_unique<ClockCache<K, V, W>>(
+        capacity - n_window, [s](const K& candidate, const K& victim) {
+            return s->frequency(std::hash<K>{}(candidate)) >
+                   s->frequency(std::hash<K>{}(victim));
+        });
+}
+
+template <typename K, typename V, typename W>
+TinyLfuCache<K, V, W>&
+TinyLfuCache<K, V, W>::operator=(TinyLfuCache&& other) {
+    this->sketch = std::move(other.sketch);
+    this->window = std::move(other.window);
+    this->main = std::move(other.main);
+    return *this;
+}
+
+template <typename K, typename V, typename W>
+bool TinyLfuCache<K, V, W>::get(const K& key, V& value) {
+    return this->get_with(key, [&value](const V& v) { value = v; });
+}
+
+template <typename K, typename V, typename W>
+template <typename F>
+bool TinyLfuCache<K, V, W>::get_with(const K& key, F&& reader) {
+    if (!sketch)
+        return main->get_with(key, reader);
+
+    sketch->increment(std::hash<K>{}(key));
+    return window->get_with(key, reader) || main->get_with(key, reader);
+}
+
+template <typename K, typename V, typename W>
+void TinyLfuCache<K, V, W>::put(const K& key, const V& value) {
+    this->put(key, V(value));
+}
+
+template <typename K, typename V, typename W>
+void TinyLfuCache<K, V, W>::put(const K& key, V&& value) {
+    if (!sketch) {
+        main->put(key, std::move(value));
+        return;
+    }
+    if (main->replace(key, std::move(value)))
+        return;
+
+    std::vector<std::pair<K, V>> evicted;
+    window->put(key, std::move(value), &evicted);
+    for (auto& [k, v] : evicted)
+        main->put(k, std::move(v), nullptr);
+}
+
+template <typename K, typename V, typename W>
+void TinyLfuCache<K, V, W>::remove(const K& key) {
+    if (window)
+        window->remove(key);
+    main->remove(key);
+}
+
+template <typename K, typename V, typename W>
+void TinyLfuCache<K, V, W>::set_capacity(size_t capacity) {
+    if (!window) {
+        main->set_capacity(capacity);
+        return;
+    }
+    auto n_window = window_capacity(capacity);
+    sketch->resize(capacity / W::unit);
+    window->set_capacity(n_window);
+    main->set_capacity(capacity - n_window);
+}
+
+template <typename K, typename V, typename W>
+size_t TinyLfuCache<K, V, W>::weight() {
+    return main->weight() + (window ? window->weight() : 0);
+}
+
+// a lookup that misses the window goes on to the main cache, so the misses
+// of the main cache are the misses of both.
+template <typename K, typename V, typename W>
+CacheStats TinyLfuCache<K, V, W>::stats() {
+    auto stats = main->stats();
+    if (window)
+        stats.hits += window->stats().hits;
+    return stats;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+// an append-only log of the changes made to a store since its last
+// checkpoint, kept next to it in `<file>.wal`.
+//
+// records are appended to a buffer shared by all writers. a writer that needs
+// its record on disk waits for it, the first one to wait writes the buffer out
+// and calls fdatasync for everyone whose record it holds, the others wait for
+// that. with batched durability nobody waits, a thread of the log does the
+// same every WAL_SYNC_INTERVAL_MS.
+//
+// a record names the slot a value went to, so replaying it claims the same
+// slots again. records are checksummed, replay stops at the first one that
+// does not check out, a write torn by a crash.
+
+#include "magritte_typedefs.h"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// how often the log is synced with batched durability.
+const uint32_t WAL_SYNC_INTERVAL_MS = 10;
+// size of the log a store checkpoints at.
+const uint64_t WAL_CHECKPOINT_BYTES = 64 << 20;
+// old_index of a record that freed no slot.
+const MagritteIndex WAL_NO_INDEX = ~MagritteIndex(0);
+
+typedef enum : char {
+    // `key` now has the value of the record at `index`, the slot at
+    // `old_index` is freed unless it is WAL_NO_INDEX.
+    WalPut = 1,
+    // `key` was removed, freeing the slot at `index`.
+    WalRemove = 2,
+    // block `index` was made, with slots of `old_index` bytes.
+    WalBlock = 3,
+} WalRecordType;
+
+typedef struct {
+    // of the rest of the header and the value.
+    uint32_t checksum;
+    uint32_t length;
+    WalRecordType type;
+    MagritteKey key;
+    MagritteIndex index;
+    MagritteIndex old_index;
+} WalRecordHeader;
+
+typedef struct {
+    uint64_t n_records;
+    uint64_t n_syncs;
+} WalStats;
+
+class WriteAheadLog {
+  public:
+    // opens the log at `path`, or creates it.
+    WriteAheadLog(const std::string& path, MagritteDurability durability);
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    ~WriteAheadLog();
+
+    // a record of `type` for `key` with room for `value`, encoded before the
+    // value is moved into a block. append() fills in the slots.
+    static std::vector<char> encode(WalRecordType type, MagritteKey key,
+                                    std::span<const char> value = {});
+    // appends `record` and returns the position after it, to commit.
+    uint64_t append(std::vector<char>& record, MagritteIndex index,
+                    MagritteIndex old_index = WAL_NO_INDEX);
+    // returns once the log is on disk up to `position`, right away unless
+    // the durability is per op. false if the log could not be written.
+    bool commit(uint64_t position);
+    // returns once everything appended so far is on disk, whatever the
+    // durability.
+    bool flush();
+    // calls `apply` with every intact record in order, returns the number of
+    // records.
+    size_t replay(
+        std::function<void(const WalRecordHeader&, std::span<const char>)>
+            apply);
+    // bytes in the log since the last reset.
+    uint64_t size();
+    // empties the log once a checkpoint made its records redundant. no
+    // record may be appended meanwhile.
+    void reset();
+    WalStats stats();
+    void shutdown();
+
+  private:
+    // writes out the buffer and syncs it, unless another thread is at it.
+    // returns false if the log could not be written.
+    bool sync(std::unique_lock<std::mutex>& guard);
+    bool sync_to(uint64_t position);
+    void syncer();
+
+    int file;
+    MagritteDurability durability;
+
+    // guards the buffer and the positions.
+    std::mutex mutex;
+    std::condition_variable synced;
+    std::vector<char> buffer;
+    // positions count every byte ever appended, across resets.
+    uint64_t appended;
+    uint64_t durable;
+    // appended at the last reset.
+    uint64_t base;
+    bool syncing;
+    bool failed;
+    WalStats total_stats;
+
+    bool shutdown_;
+    std::thread sync_thread;
+};
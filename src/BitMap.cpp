@@ -1,139 +1,297 @@
 #include "BitMap.h"
-#include <bitset>
+#include <algorithm>
+#include <bit>
 #include <cstdint>
-#include <mutex>
+#include <cstring>
 #include <stdexcept>
 
-BitMap::BitMap(int size) : lastVacant(0) {
-    int bytes = size / 8;
-    if (size % 8 != 0) {
-        bytes += 1;
-    }
-    store.resize(bytes);
-}
+static_assert(std::endian::native == std::endian::little,
+              "bitmap words are persisted as bytes");
 
-// Copy constractor
-BitMap::BitMap(BitMap& bmp) {
-    this->store = bmp.store;
-    this->lastVacant = bmp.lastVacant;
-}
+static const uint64_t FULL = ~uint64_t(0);
 
-// Move constracotr
-BitMap::BitMap(BitMap&& other) {
-    this->store = std::move(other.store);
-    this->lastVacant = other.lastVacant;
+static uint64_t load(const uint64_t* p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
 }
 
-uint32_t BitMap::count_vacant() {
-    auto count = 0;
-    for (int i = 0; i < store.size(); ++i) {
-        std::bitset<8> bits(store[i]);
-        count += bits.count();
-    }
-    return store.size() * 8 - count;
+BitMap::BitMap(int size) {
+    Init(size);
+
+    auto pages = (nBytes + BITMAP_PAGE_SIZE - 1) / BITMAP_PAGE_SIZE;
+    dirtyPages.assign((pages + 63) / 64, FULL);
+    if (pages % 64)
+        dirtyPages.back() = (uint64_t(1) << (pages % 64)) - 1;
 }
 
+// Copy constractor
+BitMap::BitMap(BitMap& bmp) { *this = bmp; }
+
+// Move constracotr
+BitMap::BitMap(BitMap&& other)
+    : nBits(other.nBits), nBytes(other.nBytes),
+      words(std::move(other.words)), summary(std::move(other.summary)),
+      top(std::move(other.top)), dirtyPages(std::move(other.dirtyPages)) {}
+
 // Copy assignment
 BitMap& BitMap::operator=(BitMap& bmp) {
-    this->store = bmp.store;
-    this->lastVacant = bmp.lastVacant;
+    this->nBits = bmp.nBits;
+    this->nBytes = bmp.nBytes;
+    this->words = bmp.words;
+    this->summary = bmp.summary;
+    this->top = bmp.top;
+    this->dirtyPages = bmp.dirtyPages;
     return *this;
 }
 
+// sizes the levels for `bits` bits, all vacant, and sets the padding bits of
+// every level.
+void BitMap::Init(size_t bits) {
+    nBits = bits;
+    nBytes = (bits + 7) / 8;
+
+    words.assign((bits + 63) / 64, 0);
+    if (bits % 64)
+        words.back() = FULL << (bits % 64);
+
+    summary.assign((words.size() + 63) / 64, 0);
+    if (words.size() % 64)
+        summary.back() = FULL << (words.size() % 64);
+
+    top.assign((summary.size() + 63) / 64, 0);
+    if (summary.size() % 64)
+        top.back() = FULL << (summary.size() % 64);
+}
+
 BitMap BitMap::LoadExisting(std::vector<unsigned char>&& b) {
     if (b.empty()) {
         throw std::invalid_argument("bitmap: invalid byte length");
     }
 
     BitMap bmp(0);
-    bmp.store = std::move(b);
+    bmp.Init(b.size() * 8);
+    memcpy(bmp.words.data(), b.data(), b.size());
+    for (size_t w = 0; w < bmp.words.size(); w++) {
+        if (bmp.words[w] == FULL)
+            bmp.MarkFull(w);
+    }
+
+    // what was loaded is what is on disk.
+    auto pages = (bmp.nBytes + BITMAP_PAGE_SIZE - 1) / BITMAP_PAGE_SIZE;
+    bmp.dirtyPages.assign((pages + 63) / 64, 0);
     return bmp;
 }
 
+uint32_t BitMap::count_vacant() { return count_vacant(0, words.size() * 64); }
+
+uint32_t BitMap::count_vacant(size_t first, size_t last) {
+    uint32_t count = 0;
+    for (size_t w = first / 64; w < last / 64; w++)
+        count += std::popcount(~load(&words[w]));
+    return count;
+}
+
 void BitMap::Set(int i, bool v) {
-    auto byteIndex = i / 8;
-    auto bitIndex = i % 8;
-    auto mask = bitMask32(i);
+    auto w = i / 64;
+    auto mask = uint64_t(1) << (i % 64);
 
+    auto oldValue = load(&words[w]);
+    uint64_t newValue;
     do {
-        auto oldValue = __atomic_load_n(&store[byteIndex], __ATOMIC_SEQ_CST);
-        auto newValue = oldValue;
-        if (v) {
-            newValue |= mask;
-        } else {
-            newValue &= ~mask;
-        }
-
-        auto ok = __atomic_compare_exchange_n(&store[byteIndex], &oldValue,
-                                              newValue, false, __ATOMIC_SEQ_CST,
-                                              __ATOMIC_SEQ_CST);
-        if (ok) {
-            std::scoped_lock<std::mutex> lock(vacantMutex);
-            if (i < lastVacant && !v) {
-                lastVacant = i;
-            }
+        newValue = v ? oldValue | mask : oldValue & ~mask;
+        if (newValue == oldValue)
             return;
-        }
+    } while (!__atomic_compare_exchange_n(&words[w], &oldValue, newValue, false,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
 
-    } while (true);
+    MarkDirty(w * 8 + (i % 64) / 8);
+    if (newValue == FULL)
+        MarkFull(w);
+    else if (oldValue == FULL)
+        MarkNotFull(w);
 }
 
 // Get the value of the bit at index `i`
 bool BitMap::Get(int i) const {
-    int byteIndex = i / 8;
-    int bitIndex = i % 8;
-    unsigned char mask = 1 << bitIndex;
+    return (load(&words[i / 64]) >> (i % 64)) & 1;
+}
 
-    auto bytePtr = &store[byteIndex];
-    auto byteValue = __atomic_load_n(bytePtr, __ATOMIC_SEQ_CST);
+// Find a vacant bit and set it, the lowest one unless summaries are stale.
+int BitMap::FindVacantAndSet() {
+    for (;;) {
+        // each top word is loaded once, it may fill up between two loads.
+        size_t t = 0;
+        auto topValue = FULL;
+        while (t < top.size() && (topValue = load(&top[t])) == FULL)
+            t++;
+        if (t == top.size())
+            return -1;
+
+        auto s = t * 64 + std::countr_one(topValue);
+        auto summaryValue = load(&summary[s]);
+        if (summaryValue == FULL) {
+            // stale top bit, repair it and look again.
+            __atomic_or_fetch(&top[t], uint64_t(1) << (s % 64),
+                              __ATOMIC_SEQ_CST);
+            if (load(&summary[s]) != FULL)
+                __atomic_and_fetch(&top[t], ~(uint64_t(1) << (s % 64)),
+                                   __ATOMIC_SEQ_CST);
+            continue;
+        }
 
-    return (byteValue & mask) != 0;
+        auto w = s * 64 + std::countr_one(summaryValue);
+        auto value = load(&words[w]);
+        while (value != FULL) {
+            auto bit = std::countr_one(value);
+            auto claimed = value | (uint64_t(1) << bit);
+            if (__atomic_compare_exchange_n(&words[w], &value, claimed, false,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+                MarkDirty(w * 8 + bit / 8);
+                if (claimed == FULL)
+                    MarkFull(w);
+                return w * 64 + bit;
+            }
+        }
+
+        // the word filled up under us.
+        MarkFull(w);
+    }
 }
 
-// Find a vacant bit and set it
-int BitMap::FindVacantAndSet() {
-    std::unique_lock<std::mutex> lock(vacantMutex);
+// walks the summary words covering the range, words outside of it are taken
+// as full. the top level is left alone, it is shared by every range.
+int BitMap::FindVacantAndSet(size_t first, size_t last) {
+    auto firstWord = first / 64, lastWord = std::min(last / 64, words.size());
+    auto s = firstWord / 64;
+    while (s * 64 < lastWord) {
+        auto lo = std::max(firstWord, s * 64) - s * 64;
+        auto hi = std::min(lastWord - s * 64, size_t(64));
+        auto inside = (hi == 64 ? FULL : (uint64_t(1) << hi) - 1) & FULL << lo;
 
-    int nextVacant = -1;
-    for (size_t i = lastVacant / 8; i < store.size(); ++i) {
-        if (store[i] != static_cast<unsigned char>(0xFF)) {
-            unsigned char byte = ~store[i];
-            unsigned char complement = -byte;
-            unsigned char bitwiseIndex = fastLog2(byte & complement);
+        auto summaryValue = load(&summary[s]) | ~inside;
+        if (summaryValue == FULL) {
+            s++;
+            continue;
+        }
 
-            nextVacant = i * 8 + bitwiseIndex;
-            break;
+        auto w = s * 64 + std::countr_one(summaryValue);
+        auto value = load(&words[w]);
+        while (value != FULL) {
+            auto bit = std::countr_one(value);
+            auto claimed = value | (uint64_t(1) << bit);
+            if (__atomic_compare_exchange_n(&words[w], &value, claimed, false,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+                MarkDirty(w * 8 + bit / 8);
+                if (claimed == FULL)
+                    MarkFull(w);
+                return w * 64 + bit;
+            }
         }
+
+        // full, or filled up under us, look at the same summary word again.
+        MarkFull(w);
     }
+    return -1;
+}
 
-    lastVacant = nextVacant;
+// the lowest bit starting `n` set bits in a row in `bits`, or -1. every
+// step halves the runs left to check.
+static int run_start(uint64_t bits, int n) {
+    for (int covered = 1; covered < n && bits;) {
+        auto step = std::min(covered, n - covered);
+        bits &= bits >> step;
+        covered += step;
+    }
+    return bits ? std::countr_zero(bits) : -1;
+}
+
+// words are looked at in order, full ones skipped by their summary bit. a run
+// never spans two words, so it is claimed with a single CAS.
+int BitMap::FindVacantRunAndSet(int n, size_t first, size_t last) {
+    auto mask = n == 64 ? FULL : (uint64_t(1) << n) - 1;
+    auto lastWord = std::min(last / 64, words.size());
+    for (auto w = first / 64; w < lastWord; w++) {
+        if ((load(&summary[w / 64]) >> (w % 64)) & 1)
+            continue;
+
+        auto value = load(&words[w]);
+        for (;;) {
+            auto bit = run_start(~value, n);
+            if (bit == -1)
+                break;
+            auto claimed = value | (mask << bit);
+            if (__atomic_compare_exchange_n(&words[w], &value, claimed, false,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+                for (auto b = bit / 8; b <= (bit + n - 1) / 8; b++)
+                    MarkDirty(w * 8 + b);
+                if (claimed == FULL)
+                    MarkFull(w);
+                return w * 64 + bit;
+            }
+        }
+    }
+    return -1;
+}
 
-    if (nextVacant != -1) {
-        int byteIndex = nextVacant / 8;
-        int bitIndex = nextVacant % 8;
-        store[byteIndex] |= static_cast<unsigned char>(1 << bitIndex);
+// sets the summary bits of `word`, then checks the word again, a bit freed in
+// between would otherwise stay hidden.
+void BitMap::MarkFull(size_t word) {
+    auto s = word / 64;
+    auto value = __atomic_or_fetch(&summary[s], uint64_t(1) << (word % 64),
+                                   __ATOMIC_SEQ_CST);
+    if (value == FULL) {
+        __atomic_or_fetch(&top[s / 64], uint64_t(1) << (s % 64),
+                          __ATOMIC_SEQ_CST);
+        if (load(&summary[s]) != FULL)
+            __atomic_and_fetch(&top[s / 64], ~(uint64_t(1) << (s % 64)),
+                               __ATOMIC_SEQ_CST);
     }
 
-    return nextVacant;
+    if (load(&words[word]) != FULL)
+        MarkNotFull(word);
+}
+
+void BitMap::MarkNotFull(size_t word) {
+    auto s = word / 64;
+    __atomic_and_fetch(&summary[s], ~(uint64_t(1) << (word % 64)),
+                       __ATOMIC_SEQ_CST);
+    __atomic_and_fetch(&top[s / 64], ~(uint64_t(1) << (s % 64)),
+                       __ATOMIC_SEQ_CST);
 }
 
 // Get the underlying bytes of the bitmap
 const std::vector<unsigned char> BitMap::GetUnderlayBytes() {
-    return this->store;
+    auto data = this->UnderlayData();
+    return std::vector<unsigned char>(data, data + nBytes);
 }
 
-uint32_t BitMap::bitMask32(int i) {
-    int bitOff = i % 8;
-    int bytOff = (i % 32) / 8;
-    return static_cast<uint32_t>(1 << (bytOff * 8 + bitOff));
+const unsigned char* BitMap::UnderlayData() const {
+    return reinterpret_cast<const unsigned char*>(words.data());
 }
 
-// Fast log base 2 function for bytes
-unsigned char BitMap::fastLog2(unsigned char b) {
-    unsigned char i = 0;
-    while (b != 1 && i < 8) {
-        b >>= 1;
-        ++i;
+void BitMap::MarkDirty(size_t byteIndex) {
+    auto page = byteIndex / BITMAP_PAGE_SIZE;
+    auto word = &dirtyPages[page / 64];
+    auto bit = uint64_t(1) << (page % 64);
+    // most changes land on a page that is already dirty.
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0)
+        __atomic_or_fetch(word, bit, __ATOMIC_SEQ_CST);
+}
+
+std::vector<std::pair<size_t, size_t>> BitMap::TakeDirtyPages() {
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t w = 0; w < dirtyPages.size(); w++) {
+        auto bits = __atomic_exchange_n(&dirtyPages[w], 0, __ATOMIC_SEQ_CST);
+        while (bits) {
+            auto page = w * 64 + std::countr_zero(bits);
+            bits &= bits - 1;
+            if (!runs.empty() && runs.back().first + runs.back().second == page)
+                runs.back().second++;
+            else
+                runs.emplace_back(page, 1);
+        }
     }
-    return i;
+    return runs;
 }
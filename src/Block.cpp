@@ -1,167 +1,741 @@
 #include "Block.h"
 #include "BitMap.h"
+#include "flush_scheduler.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
-#include <semaphore>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <unordered_map>
 
-Block::Block(int file, uint32_t offset, BitMap&& bmp)
-    : file_no(file), offset(offset), shutdown_(false), flushSignal(1),
-      bitmap(std::move(bmp)), bitmapDirty(false) {
-    vacancy = bitmap.count_vacant();
-    flush_thread = std::thread(&Block::flush_worker, this);
+static const char BLOCK_MAGIC[4] = {'M', 'G', 'B', 'K'};
+
+Block::Block(int file, int64_t offset, uint32_t slot_size, BitMap&& bmp,
+             MagritteIoBackend backend, FlushScheduler* scheduler,
+             IoRing* ring)
+    : bitmap(std::move(bmp)), offset(offset), slot_size_(slot_size),
+      header_dirty(false), shutdown_(false), file_no(file),
+      ring(backend == IoUring ? ring : nullptr), mapping(nullptr),
+      file_end(0), scheduler(scheduler), dirty(false), dirty_bytes_(0),
+      total_stats() {
+    if (slot_size == BLOCK_EXTENT_SLOT_SIZE)
+        continued = std::make_unique<BitMap>(read_bitmap(file, offset, 1));
+    init_shards();
+    if (backend == Mmap)
+        map_region();
+    if (scheduler)
+        scheduler->add(this);
 }
 
-Block::Block(int file, uint32_t offset)
-    : file_no(file), offset(offset), shutdown_(false), flushSignal(1),
-      bitmap(BLOCK_MAX_CAP), bitmapDirty(false), vacancy(BLOCK_MAX_CAP) {
-    flush_thread = std::thread(&Block::flush_worker, this);
+Block::Block(int file, int64_t offset, uint32_t slot_size,
+             MagritteIoBackend backend, FlushScheduler* scheduler,
+             IoRing* ring)
+    : bitmap(BLOCK_MAX_CAP), offset(offset), slot_size_(slot_size),
+      header_dirty(true), shutdown_(false), file_no(file),
+      ring(backend == IoUring ? ring : nullptr), mapping(nullptr),
+      file_end(0), scheduler(scheduler), dirty(false), dirty_bytes_(0),
+      total_stats() {
+    if (slot_size == BLOCK_EXTENT_SLOT_SIZE)
+        continued = std::make_unique<BitMap>(BLOCK_MAX_CAP);
+    init_shards();
+    if (backend == Mmap)
+        map_region();
+    if (scheduler)
+        scheduler->add(this);
 }
 
+// bitmap is the first member, so other is detached before anything else is
+// taken from it and writes out what it has pending with its own file.
 Block::Block(Block&& other)
-    : file_no(other.file_no), offset(other.offset), shutdown_(false),
-      flushSignal(1), bitmap(std::move(other.bitmap)) {
-    vacancy = other.vacancy.load();
-    other.shutdown();
-
-    flush_thread = std::thread(&Block::flush_worker, this);
+    : bitmap(other.take_bitmap()), continued(std::move(other.continued)),
+      offset(other.offset),
+      slot_size_(other.slot_size_), header_dirty(false), shutdown_(false),
+      scheduler(other.scheduler), dirty(false), dirty_bytes_(0),
+      total_stats() {
+    file_no = other.file_no;
+    other.file_no = -1;
+    shards = std::move(other.shards);
+    ring = other.ring;
+    mapping = other.mapping;
+    other.mapping = nullptr;
+    mapping_size = other.mapping_size;
+    mapping_base = other.mapping_base;
+    file_end = other.file_end.load();
+    total_stats = other.total_stats;
+
+    if (scheduler)
+        scheduler->add(this);
 }
 
 Block::~Block() { shutdown(); }
 
+uint32_t Block::read_slot_size(int file, int64_t offset) {
+    BlockHeader header;
+    if (pread(file, &header, sizeof(header), offset) != sizeof(header) ||
+        memcmp(header.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0)
+        throw std::runtime_error("Failed to read block header");
+
+    auto sizes = std::span(BLOCK_SLOT_SIZES);
+    if (std::find(sizes.begin(), sizes.end(), header.slot_size) == sizes.end())
+        throw std::runtime_error("Unknown slot size in block header");
+    return header.slot_size;
+}
+
+BitMap Block::read_bitmap(int file, int64_t offset, int n) {
+    std::vector<unsigned char> buffer(BITMAP_SIZE);
+    auto read_size = pread(file, buffer.data(), BITMAP_SIZE,
+                           offset + BLOCK_HEADER_SIZE + n * BITMAP_SIZE);
+    if (read_size != BITMAP_SIZE)
+        throw std::runtime_error("Failed to read bitmap from file");
+    return BitMap::LoadExisting(std::move(buffer));
+}
+
 int64_t Block::get_offset_of(MagritteInBlockIndex i) const {
-    return offset + i * 1024 + BITMAP_SIZE;
+    return offset + BLOCK_HEADER_SIZE + bitmaps_size(slot_size_) +
+           int64_t(i) * slot_size_;
 }
 
-bool Block::adjust_vacancy(int diff) {
-    if (diff > 0) {
-        vacancy.fetch_add(diff);
-    } else {
-        vacancy.fetch_sub(abs(diff));
+size_t Block::slot_length(const char* slot, uint32_t n_slots) const {
+    uint32_t len;
+    memcpy(&len, slot, sizeof(len));
+    return std::min<size_t>(len,
+                            n_slots * slot_size_ - BLOCK_SLOT_HEADER_SIZE);
+}
+
+bool Block::fits(size_t len) const {
+    return len + BLOCK_SLOT_HEADER_SIZE <= slot_size_ ||
+           (continued && len <= BLOCK_MAX_VALUE_SIZE);
+}
+
+uint32_t Block::slots_for(size_t len) const {
+    return (len + BLOCK_SLOT_HEADER_SIZE + slot_size_ - 1) / slot_size_;
+}
+
+// the run ends at the first slot not continuing the one before, at the
+// latest with its word of the bitmap.
+uint32_t Block::run_length(MagritteInBlockIndex slot) const {
+    if (!continued)
+        return 1;
+    uint32_t n = 1;
+    while ((slot + n) % 64 != 0 && continued->Get(slot + n))
+        n++;
+    return n;
+}
+
+bool Block::same_slots(MagritteInBlockIndex slot, size_t len) const {
+    return fits(len) && slots_for(len) == run_length(slot);
+}
+
+void Block::map_region() {
+    auto page_size = sysconf(_SC_PAGESIZE);
+    mapping_base = offset & ~int64_t(page_size - 1);
+    mapping_size = get_offset_of(BLOCK_MAX_CAP) - mapping_base;
+
+    struct stat st;
+    if (fstat(file_no, &st) != 0)
+        return;
+    file_end = st.st_size;
+
+    // the region is mapped whole even if the file is shorter, pages are
+    // only touched once the file covers them.
+    auto ptr = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, file_no,
+                    mapping_base);
+    if (ptr != MAP_FAILED)
+        mapping = static_cast<const char*>(ptr);
+}
+
+void Block::unmap_region() {
+    if (mapping) {
+        munmap(const_cast<char*>(mapping), mapping_size);
+        mapping = nullptr;
     }
-    return true;
 }
 
-bool Block::vacant() const { return vacancy.load() != 0; }
+const char* Block::mapped(MagritteInBlockIndex i) const {
+    if (!mapping || get_offset_of(i + run_length(i)) > file_end.load())
+        return nullptr;
+    return mapping + (get_offset_of(i) - mapping_base);
+}
 
-bool Block::put(MagritteValue data, MagritteInBlockIndex& offset) {
-    if (pendingChanges.size() >= BLOCK_BUFFER_SIZE) {
-        flush_sync();
+void Block::init_shards() {
+    shards = std::make_unique<Shard[]>(BLOCK_ALLOC_SHARDS);
+    for (uint32_t i = 0; i < BLOCK_ALLOC_SHARDS; i++) {
+        shards[i].vacancy = bitmap.count_vacant(i * BLOCK_SHARD_CAP,
+                                                (i + 1) * BLOCK_SHARD_CAP);
     }
+}
 
-    if (vacancy.load() == 0 || !adjust_vacancy(-1)) {
-        return false;
+// threads get their home shard in the order they first put, the same one in
+// every block.
+static uint32_t home_shard() {
+    static std::atomic<uint32_t> next_shard(0);
+    thread_local uint32_t home = next_shard.fetch_add(1) % BLOCK_ALLOC_SHARDS;
+    return home;
+}
+
+// the slots following the first of an extent are marked continued once they
+// are claimed, before the extent can be read.
+int64_t Block::allocate_slots(uint32_t n) {
+    auto home = home_shard();
+    for (uint32_t i = 0; i < BLOCK_ALLOC_SHARDS; i++) {
+        auto shard = (home + i) % BLOCK_ALLOC_SHARDS;
+        auto& vacancy = shards[shard].vacancy;
+
+        // reserve the slots of the shard before looking for them.
+        auto left = vacancy.load();
+        do {
+            if (left < n)
+                break;
+        } while (!vacancy.compare_exchange_weak(left, left - n));
+        if (left < n)
+            continue;
+
+        auto first = shard * BLOCK_SHARD_CAP, last = first + BLOCK_SHARD_CAP;
+        auto slot = n == 1 ? bitmap.FindVacantAndSet(first, last)
+                           : bitmap.FindVacantRunAndSet(n, first, last);
+        if (slot != -1) {
+            for (uint32_t j = 1; j < n; j++)
+                continued->Set(slot + j, true);
+            return slot;
+        }
+        vacancy.fetch_add(n);
     }
+    return -1;
+}
 
-    offset = bitmap.FindVacantAndSet();
-    if (offset == -1) {
+bool Block::vacant() const {
+    for (uint32_t i = 0; i < BLOCK_ALLOC_SHARDS; i++) {
+        if (shards[i].vacancy.load() != 0)
+            return true;
+    }
+    return false;
+}
+
+bool Block::put(const MagritteValue& data, MagritteInBlockIndex& offset) {
+    return this->put(MagritteValue(data), offset);
+}
+
+// data is only moved from when the put succeeds.
+bool Block::put(MagritteValue&& data, MagritteInBlockIndex& offset) {
+    if (!fits(data.size()))
         return false;
+    if (pendingChanges.size() >= BLOCK_BUFFER_SIZE) {
+        flush_sync();
     }
 
-    bitmapDirty = true;
+    auto slot = allocate_slots(slots_for(data.size()));
+    if (slot == -1) {
+        return false;
+    }
+    offset = slot;
 
+    auto n_bytes = data.size();
     lock.lock();
     pendingChanges[offset] = std::move(data);
     lock.unlock();
+
+    mark_dirty(n_bytes);
     return true;
 }
 
-bool Block::update(MagritteValue data, MagritteInBlockIndex offset) {
+bool Block::update(MagritteValue&& data, MagritteInBlockIndex offset) {
+    if (!same_slots(offset, data.size()))
+        return false;
     if (pendingChanges.size() >= BLOCK_BUFFER_SIZE) {
         flush_sync();
     }
 
+    auto n_bytes = data.size();
     lock.lock();
     pendingChanges[offset] = std::move(data);
     lock.unlock();
 
+    mark_dirty(n_bytes);
     return true;
 }
 
 MagritteValue Block::get(MagritteInBlockIndex inBlockIndex) {
+    MagritteValue buffer(run_length(inBlockIndex) * slot_size_ -
+                         BLOCK_SLOT_HEADER_SIZE);
+    auto n = this->get_into(inBlockIndex, buffer);
+    buffer.resize(n);
+    return buffer;
+}
+
+size_t Block::get_into(MagritteInBlockIndex inBlockIndex,
+                       std::span<char> out) {
     lock.lock_shared();
 
     auto it = pendingChanges.find(inBlockIndex);
     if (it != pendingChanges.end()) {
+        // copy before unlocking, flush_worker may swap the map out.
+        auto n = it->second.size();
+        if (n <= out.size())
+            memcpy(out.data(), it->second.data(), n);
         lock.unlock_shared();
-        return it->second;
+        return n;
+    }
+
+    // the whole run of slots is read at once, the length is only known once
+    // it is.
+    auto n_slots = run_length(inBlockIndex);
+    size_t len = n_slots * slot_size_;
+    char stack_buffer[BLOCK_MAX_SLOT_SIZE];
+    std::vector<char> heap_buffer;
+    auto buffer = stack_buffer;
+    if (len > sizeof(stack_buffer)) {
+        heap_buffer.resize(len);
+        buffer = heap_buffer.data();
     }
-    MagritteValue buffer(1024);
-    auto n_bytes = pread(this->file_no, buffer.data(), 1024,
-                         this->get_offset_of(inBlockIndex));
-    if (n_bytes < 0) {
+
+    auto slot = mapped(inBlockIndex);
+    if (!slot) {
+        int64_t n_bytes;
+        if (ring && len <= IO_RING_MAX_READ) {
+            // a single read is not worth waiting for the ring, pread when
+            // another thread holds it.
+            IoRingRead read = {.buffer = buffer,
+                               .len = uint32_t(len),
+                               .offset = this->get_offset_of(inBlockIndex),
+                               .result = 0};
+            ring->read(&read, 1, false);
+            n_bytes = read.result;
+        } else {
+            n_bytes = pread(this->file_no, buffer, len,
+                            this->get_offset_of(inBlockIndex));
+        }
+        if (n_bytes < 0) {
+            lock.unlock_shared();
+            throw std::runtime_error("Failed to read block");
+        }
+        // past the end of the file reads as an empty slot.
+        memset(buffer + n_bytes, 0, len - n_bytes);
+        slot = buffer;
+    }
+
+    auto n = slot_length(slot, n_slots);
+    if (n <= out.size())
+        memcpy(out.data(), slot + BLOCK_SLOT_HEADER_SIZE, n);
+    lock.unlock_shared();
+    return n;
+}
+
+void Block::get_view(MagritteInBlockIndex inBlockIndex, BlockView& view) {
+    view.release();
+    lock.lock_shared();
+
+    // the pending value and the mapping stay put while the lock is held.
+    auto it = pendingChanges.find(inBlockIndex);
+    if (it != pendingChanges.end()) {
+        view.view = std::span<const char>(it->second);
+        view.lock = &lock;
+        return;
+    }
+    if (auto data = mapped(inBlockIndex)) {
+        view.view = std::span<const char>(
+            data + BLOCK_SLOT_HEADER_SIZE,
+            slot_length(data, run_length(inBlockIndex)));
+        view.lock = &lock;
+        return;
+    }
+
+    lock.unlock_shared();
+    view.owned = this->get(inBlockIndex);
+    view.view = std::span<const char>(view.owned);
+}
+
+// slots not waiting in pendingChanges are read in file order, adjacent ones
+// with a single pread.
+void Block::get_batch(const std::vector<MagritteInBlockIndex>& slots,
+                      std::vector<MagritteValue>& values) {
+    values.resize(slots.size());
+    std::vector<char> buffer;
+    uint32_t run_slots[BLOCK_MAX_READ_RUN];
+
+    lock.lock_shared();
+
+    if (ring) {
+        auto ok = get_batch_ring(slots, values);
         lock.unlock_shared();
-        throw std::runtime_error("Failed to read block");
+        if (!ok)
+            throw std::runtime_error("Failed to read block");
+        return;
+    }
+
+    size_t i = 0;
+    while (i < slots.size()) {
+        auto it = pendingChanges.find(slots[i]);
+        if (it != pendingChanges.end()) {
+            values[i++] = it->second;
+            continue;
+        }
+        if (auto data = mapped(slots[i])) {
+            auto payload = data + BLOCK_SLOT_HEADER_SIZE;
+            auto len = slot_length(data, run_length(slots[i]));
+            values[i++].assign(payload, payload + len);
+            continue;
+        }
+
+        // a run goes on while the next value starts where this one ends.
+        size_t run = 0;
+        uint32_t n_slots = 0;
+        run_slots[0] = run_length(slots[i]);
+        do {
+            n_slots += run_slots[run++];
+            if (i + run < slots.size() && run < BLOCK_MAX_READ_RUN)
+                run_slots[run] = run_length(slots[i + run]);
+        } while (i + run < slots.size() && run < BLOCK_MAX_READ_RUN &&
+                 slots[i + run] == slots[i] + n_slots &&
+                 !pendingChanges.contains(slots[i + run]));
+
+        buffer.assign(size_t(n_slots) * slot_size_, 0);
+        auto n_bytes = pread(this->file_no, buffer.data(), buffer.size(),
+                             this->get_offset_of(slots[i]));
+        if (n_bytes < 0) {
+            lock.unlock_shared();
+            throw std::runtime_error("Failed to read block");
+        }
+        auto data = buffer.data();
+        for (size_t j = 0; j < run; j++) {
+            auto payload = data + BLOCK_SLOT_HEADER_SIZE;
+            values[i + j].assign(payload,
+                                 payload + slot_length(data, run_slots[j]));
+            data += run_slots[j] * slot_size_;
+        }
+        i += run;
     }
 
     lock.unlock_shared();
-    return buffer;
+}
+
+// every slot gets its own read, all of them are submitted to the ring and
+// reaped together. extents larger than the ring reads are read with pread.
+// caller holds the lock.
+bool Block::get_batch_ring(const std::vector<MagritteInBlockIndex>& slots,
+                           std::vector<MagritteValue>& values) {
+    std::vector<IoRingRead> reads;
+    std::vector<size_t> read_values;
+    reads.reserve(slots.size());
+    std::vector<char> buffer(slots.size() * slot_size_, 0);
+    for (size_t i = 0; i < slots.size(); i++) {
+        auto it = pendingChanges.find(slots[i]);
+        if (it != pendingChanges.end()) {
+            values[i] = it->second;
+            continue;
+        }
+        auto n_slots = run_length(slots[i]);
+        if (n_slots * slot_size_ > IO_RING_MAX_READ) {
+            std::vector<char> extent(n_slots * slot_size_, 0);
+            if (pread(this->file_no, extent.data(), extent.size(),
+                      this->get_offset_of(slots[i])) < 0)
+                return false;
+            auto payload = extent.data() + BLOCK_SLOT_HEADER_SIZE;
+            values[i].assign(payload,
+                             payload + slot_length(extent.data(), n_slots));
+            continue;
+        }
+
+        reads.push_back({.buffer = buffer.data() + reads.size() * slot_size_,
+                         .len = slot_size_,
+                         .offset = this->get_offset_of(slots[i]),
+                         .result = 0});
+        read_values.push_back(i);
+    }
+
+    ring->read(reads.data(), reads.size());
+    for (size_t j = 0; j < reads.size(); j++) {
+        if (reads[j].result < 0)
+            return false;
+        auto payload = reads[j].buffer + BLOCK_SLOT_HEADER_SIZE;
+        values[read_values[j]].assign(payload,
+                                      payload + slot_length(reads[j].buffer));
+    }
+    return true;
+}
+
+// puts values[first..] until the block is full, all under one lock. returns
+// the number of values put, their slots are appended to `slots`.
+size_t Block::put_batch(std::vector<MagritteValue>& values, size_t first,
+                        std::vector<MagritteInBlockIndex>& slots) {
+    if (pendingChanges.size() >= BLOCK_BUFFER_SIZE) {
+        flush_sync();
+    }
+
+    lock.lock();
+
+    size_t n = 0, n_bytes = 0;
+    for (auto i = first; i < values.size(); i++, n++) {
+        auto slot = allocate_slots(slots_for(values[i].size()));
+        if (slot == -1)
+            break;
+
+        n_bytes += values[i].size();
+        pendingChanges[slot] = std::move(values[i]);
+        slots.push_back(slot);
+    }
+
+    lock.unlock();
+
+    if (n)
+        mark_dirty(n_bytes);
+    return n;
+}
+
+void Block::update_batch(std::vector<MagritteValue>& values,
+                         const std::vector<MagritteInBlockIndex>& slots) {
+    if (pendingChanges.size() >= BLOCK_BUFFER_SIZE) {
+        flush_sync();
+    }
+
+    size_t n_bytes = 0;
+    lock.lock();
+    for (size_t i = 0; i < slots.size(); i++) {
+        n_bytes += values[i].size();
+        pendingChanges[slots[i]] = std::move(values[i]);
+    }
+    lock.unlock();
+
+    mark_dirty(n_bytes);
+}
+
+void Block::restore(MagritteInBlockIndex slot, MagritteValue&& data) {
+    if (!fits(data.size()))
+        return;
+    if (pendingChanges.size() >= BLOCK_BUFFER_SIZE) {
+        flush_sync();
+    }
+
+    auto n_slots = slots_for(data.size());
+    auto n_bytes = data.size();
+    lock.lock();
+
+    for (uint32_t i = 0; i < n_slots; i++) {
+        if (bitmap.Get(slot + i))
+            continue;
+        bitmap.Set(slot + i, true);
+        shards[(slot + i) / BLOCK_SHARD_CAP].vacancy.fetch_sub(1);
+    }
+    for (uint32_t i = 1; i < n_slots; i++)
+        continued->Set(slot + i, true);
+    pendingChanges[slot] = std::move(data);
+
+    lock.unlock();
+    mark_dirty(n_bytes);
+}
+
+void Block::reserve(MagritteInBlockIndex slot) {
+    lock.lock();
+    if (bitmap.Get(slot)) {
+        lock.unlock();
+        return;
+    }
+    bitmap.Set(slot, true);
+    shards[slot / BLOCK_SHARD_CAP].vacancy.fetch_sub(1);
+    lock.unlock();
+    mark_dirty(0);
 }
 
 void Block::remove(MagritteInBlockIndex inBlockIndex) {
-    lock.lock_shared();
+    lock.lock();
+    if (!bitmap.Get(inBlockIndex)) {
+        lock.unlock();
+        return;
+    }
 
+    // the rest of an extent is no longer continued before its slots can be
+    // claimed again.
+    auto n_slots = run_length(inBlockIndex);
     pendingChanges.erase(inBlockIndex);
-    bitmap.Set(inBlockIndex, false);
-    bitmapDirty = true;
-    adjust_vacancy(1);
+    for (uint32_t i = 1; i < n_slots; i++)
+        continued->Set(inBlockIndex + i, false);
+    for (uint32_t i = 0; i < n_slots; i++)
+        bitmap.Set(inBlockIndex + i, false);
+    shards[inBlockIndex / BLOCK_SHARD_CAP].vacancy.fetch_add(n_slots);
 
-    lock.lock_shared();
+    lock.unlock();
+
+    mark_dirty(0);
+}
+
+// the first write after a flush hands the block to the scheduler.
+void Block::mark_dirty(size_t n_bytes) {
+    dirty_bytes_.fetch_add(n_bytes, std::memory_order_relaxed);
+    if (dirty.load(std::memory_order_relaxed) || dirty.exchange(true))
+        return;
+    if (scheduler)
+        scheduler->enqueue(this, false);
 }
 
+size_t Block::dirty_bytes() const { return dirty_bytes_.load(); }
+
 void Block::flush() {
-    this->flushSignal << static_cast<std::binary_semaphore*>(nullptr);
+    if (scheduler)
+        scheduler->enqueue(this, true);
+    else
+        flush_now();
+}
+
+void Block::flush_sync() { flush_now(); }
+
+BitMap&& Block::take_bitmap() {
+    detach();
+    return std::move(bitmap);
 }
 
-void Block::flush_sync() {
-    std::binary_semaphore wait(0);
-    this->flushSignal << &wait;
-    wait.acquire();
+// stops scheduled flushes and writes out what is pending.
+void Block::detach() {
+    if (shutdown_.exchange(true))
+        return;
+    if (scheduler)
+        scheduler->remove(this);
+    flush_now();
 }
 
 void Block::shutdown() {
-    if (flush_thread.joinable()) {
-        flush_sync();
-        shutdown_ = true;
-        flush_thread.join();
-    }
+    detach();
 
+    unmap_region();
     if (this->file_no >= 0) {
         close(this->file_no);
         this->file_no = -1;
     }
 }
 
-void Block::flush_worker() {
-    while (!shutdown_) {
-        auto [semaphore, _] = this->flushSignal.pop_timeout(500);
+// only the pages of the bitmap that changed, written in place.
+static void write_dirty_pages(BitMap& bitmap, int file, int64_t offset,
+                              BlockFlushStats& stats) {
+    for (auto [page, n_pages] : bitmap.TakeDirtyPages()) {
+        auto first = page * BITMAP_PAGE_SIZE;
+        auto len = std::min(n_pages * BITMAP_PAGE_SIZE, BITMAP_SIZE - first);
+        auto n_bytes =
+            pwrite(file, bitmap.UnderlayData() + first, len, offset + first);
+        if (n_bytes > 0)
+            stats.n_bytes += n_bytes;
+        stats.n_syscalls++;
+    }
+}
 
-        if (this->pendingChanges.size() == 0) {
-            if (semaphore)
-                semaphore->release();
-            continue;
-        }
+BlockFlushStats Block::flush_now() {
+    std::lock_guard<std::mutex> guard(flush_mutex);
+    BlockFlushStats stats = {};
+    if (this->file_no < 0)
+        return stats;
 
-        lock.lock();
-        std::unordered_map<MagritteInBlockIndex, MagritteValue> changes;
-        changes.swap(pendingChanges);
+    // writes from here on mark the block dirty again.
+    dirty = false;
 
-        for (const auto& entry : changes) {
-            pwrite(file_no, entry.second.data(), entry.second.size(),
-                   this->get_offset_of(entry.first));
+    lock.lock();
+    std::unordered_map<MagritteInBlockIndex, MagritteValue> changes;
+    changes.swap(pendingChanges);
+    dirty_bytes_ = 0;
+
+    // slots are mostly handed out in order, sorted they form runs that are
+    // written with one pwritev each.
+    std::vector<std::pair<MagritteInBlockIndex, const MagritteValue*>> sorted;
+    sorted.reserve(changes.size());
+    for (const auto& entry : changes)
+        sorted.emplace_back(entry.first, &entry.second);
+    std::sort(sorted.begin(), sorted.end());
+
+    // a value is written with its slots whole, its length, the value and
+    // zeros up to the next slot.
+    static const char zeros[BLOCK_MAX_SLOT_SIZE] = {};
+    struct iovec iov[BLOCK_MAX_WRITE_RUN * 3];
+    uint32_t lengths[BLOCK_MAX_WRITE_RUN];
+    int64_t end = file_end.load();
+    for (size_t i = 0; i < sorted.size();) {
+        size_t run = 0;
+        uint32_t n_slots = 0;
+        do {
+            auto value = sorted[i + run].second;
+            auto value_slots = slots_for(value->size());
+            lengths[run] = value->size();
+            iov[run * 3] = {.iov_base = &lengths[run],
+                            .iov_len = BLOCK_SLOT_HEADER_SIZE};
+            iov[run * 3 + 1] = {.iov_base = const_cast<char*>(value->data()),
+                                .iov_len = value->size()};
+            iov[run * 3 + 2] = {.iov_base = const_cast<char*>(zeros),
+                                .iov_len = value_slots * slot_size_ -
+                                           BLOCK_SLOT_HEADER_SIZE -
+                                           value->size()};
+            n_slots += value_slots;
+            run++;
+        } while (i + run < sorted.size() && run < BLOCK_MAX_WRITE_RUN &&
+                 sorted[i + run].first == sorted[i].first + n_slots);
+
+        auto run_offset = this->get_offset_of(sorted[i].first);
+        auto n_bytes = pwritev(file_no, iov, run * 3, run_offset);
+        if (n_bytes > 0) {
+            end = std::max(end, run_offset + n_bytes);
+            stats.n_bytes += n_bytes;
         }
-        lock.unlock();
+        stats.n_slots += run;
+        stats.n_syscalls++;
+        i += run;
+    }
+    file_end = end;
+    lock.unlock();
 
-        if (bitmapDirty) {
-            pwrite(file_no, bitmap.GetUnderlayBytes().data(), BITMAP_SIZE,
-                   offset);
-            bitmapDirty = false;
+    if (header_dirty) {
+        BlockHeader header = {};
+        header.slot_size = slot_size_;
+        memcpy(header.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC));
+        auto n_bytes = pwrite(file_no, &header, sizeof(header), offset);
+        if (n_bytes == sizeof(header)) {
+            header_dirty = false;
+            stats.n_bytes += n_bytes;
         }
+        stats.n_syscalls++;
+    }
 
-        if (semaphore) {
-            semaphore->release();
-        }
+    auto bitmap_offset = offset + BLOCK_HEADER_SIZE;
+    write_dirty_pages(bitmap, file_no, bitmap_offset, stats);
+    if (continued)
+        write_dirty_pages(*continued, file_no, bitmap_offset + BITMAP_SIZE,
+                          stats);
+
+    if (stats.n_syscalls) {
+        total_stats.n_flushes++;
+        total_stats.n_slots += stats.n_slots;
+        total_stats.n_bytes += stats.n_bytes;
+        total_stats.n_syscalls += stats.n_syscalls;
+        stats.n_flushes = 1;
+    }
+    return stats;
+}
+
+BlockFlushStats Block::flush_stats() {
+    std::lock_guard<std::mutex> guard(flush_mutex);
+    return total_stats;
+}
+
+BlockView::BlockView() : lock(nullptr) {}
+
+BlockView::BlockView(BlockView&& other) : lock(nullptr) {
+    *this = std::move(other);
+}
+
+BlockView& BlockView::operator=(BlockView&& other) {
+    release();
+    owned = std::move(other.owned);
+    view = other.lock ? other.view : std::span<const char>(owned);
+    lock = other.lock;
+    other.view = {};
+    other.lock = nullptr;
+    return *this;
+}
+
+BlockView::~BlockView() { release(); }
+
+void BlockView::release() {
+    if (lock) {
+        lock->unlock_shared();
+        lock = nullptr;
     }
+    view = {};
 }
@@ -0,0 +1,232 @@
+#include "direct_index.h"
+#include "magritte_typedefs.h"
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+DirectIndex::DirectIndex(int file, int64_t offset, uint32_t n_pages)
+    : directory_base(0), offset(offset), file(file) {
+    auto buffer = std::vector<MagritteIndex>(DIRECT_INDEX_PAGE_CAP);
+
+    for (uint32_t i = 0; i < n_pages; i++) {
+        uint32_t no;
+        auto page_offset = offset + i * DIRECT_INDEX_PAGE_SIZE;
+
+        auto n_bytes = pread(file, &no, sizeof(uint32_t), page_offset);
+        if (n_bytes != sizeof(uint32_t)) {
+            std::string message =
+                "direct-index: failed load number of page " +
+                std::to_string(i) + " from file: ";
+            message += std::strerror(errno);
+            throw std::runtime_error(message);
+        }
+
+        n_bytes = pread(file, buffer.data(),
+                        DIRECT_INDEX_PAGE_CAP * sizeof(MagritteIndex),
+                        page_offset + sizeof(uint32_t));
+        if (n_bytes != DIRECT_INDEX_PAGE_CAP * sizeof(MagritteIndex)) {
+            std::string message = "direct-index: failed load entries of page " +
+                                  std::to_string(i) + " from file: ";
+            message += std::strerror(errno);
+            throw std::runtime_error(message);
+        }
+
+        auto page = this->allocate_page(no);
+        for (int j = 0; j < DIRECT_INDEX_PAGE_CAP; j++)
+            page->entries[j].store(buffer[j], std::memory_order_relaxed);
+        page->dirty = false;
+    }
+}
+
+DirectIndex::~DirectIndex() { this->flush(FlushReason::Manually); }
+
+uint32_t DirectIndex::page_of(MagritteKey key) {
+    return (static_cast<uint32_t>(key) ^ 0x80000000u) >>
+           DIRECT_INDEX_PAGE_SHIFT;
+}
+
+uint32_t DirectIndex::slot_of(MagritteKey key) {
+    return static_cast<uint32_t>(key) & (DIRECT_INDEX_PAGE_CAP - 1);
+}
+
+DirectIndexPage* DirectIndex::find_page(uint32_t no) {
+    // unsigned wrap-around turns pages below the base into a miss as well.
+    auto i = no - this->directory_base;
+    if (i >= this->directory.size())
+        return nullptr;
+    return this->directory[i];
+}
+
+// must be called with the lock held exclusively.
+DirectIndexPage* DirectIndex::allocate_page(uint32_t no) {
+    if (this->directory.empty()) {
+        this->directory_base = no;
+        this->directory.resize(1, nullptr);
+    } else if (no < this->directory_base) {
+        this->directory.insert(this->directory.begin(),
+                               this->directory_base - no, nullptr);
+        this->directory_base = no;
+    } else if (no - this->directory_base >= this->directory.size()) {
+        this->directory.resize(no - this->directory_base + 1, nullptr);
+    }
+
+    auto& page = this->pages.emplace_back();
+    page.no = no;
+    page.slot = this->pages.size() - 1;
+    page.dirty = true;
+    for (auto& entry : page.entries)
+        entry.store(DIRECT_INDEX_EMPTY, std::memory_order_relaxed);
+
+    this->directory[no - this->directory_base] = &page;
+    return &page;
+}
+
+bool DirectIndex::get(MagritteKey key, MagritteIndex& index) {
+    lock.lock_shared();
+
+    auto page = this->find_page(page_of(key));
+    if (!page) {
+        lock.unlock_shared();
+        return false;
+    }
+
+    auto value = page->entries[slot_of(key)].load(std::memory_order_acquire);
+    lock.unlock_shared();
+
+    if (value == DIRECT_INDEX_EMPTY)
+        return false;
+
+    index = value;
+    return true;
+}
+
+bool DirectIndex::put(MagritteKey key, MagritteIndex index) {
+    if (index == DIRECT_INDEX_EMPTY)
+        throw std::invalid_argument("direct-index: index " +
+                                    std::to_string(index) + " is reserved");
+
+    auto no = page_of(key);
+
+    lock.lock_shared();
+    auto page = this->find_page(no);
+    if (page) {
+        page->entries[slot_of(key)].store(index, std::memory_order_release);
+        page->dirty = true;
+        lock.unlock_shared();
+        return true;
+    }
+    lock.unlock_shared();
+
+    // the page is missing, allocate it unless another writer did meanwhile.
+    lock.lock();
+    page = this->find_page(no);
+    if (!page)
+        page = this->allocate_page(no);
+    page->entries[slot_of(key)].store(index, std::memory_order_release);
+    page->dirty = true;
+    lock.unlock();
+    return true;
+}
+
+size_t DirectIndex::range(MagritteKey from, MagritteKey to, size_t limit,
+                          std::vector<MagritteKeyIndexPair>& out) {
+    if (from > to)
+        return 0;
+
+    lock.lock_shared();
+
+    size_t n = 0;
+    // walk keys as unsigned offsets from INT_MIN, so they grow with the key.
+    auto first = static_cast<uint32_t>(from) ^ 0x80000000u;
+    auto last = static_cast<uint32_t>(to) ^ 0x80000000u;
+    auto no = first >> DIRECT_INDEX_PAGE_SHIFT;
+    if (no < this->directory_base)
+        no = this->directory_base;
+
+    for (; n < limit && no <= (last >> DIRECT_INDEX_PAGE_SHIFT); no++) {
+        auto page = this->find_page(no);
+        if (!page) {
+            if (no - this->directory_base >= this->directory.size())
+                break;
+            continue;
+        }
+
+        uint64_t begin = uint64_t(no) << DIRECT_INDEX_PAGE_SHIFT;
+        for (int i = 0; i < DIRECT_INDEX_PAGE_CAP && n < limit; i++) {
+            if (begin + i < first || begin + i > last)
+                continue;
+            auto value = page->entries[i].load(std::memory_order_acquire);
+            if (value == DIRECT_INDEX_EMPTY)
+                continue;
+
+            auto key = static_cast<MagritteKey>(uint32_t(begin + i) ^
+                                                0x80000000u);
+            out.push_back({key, value});
+            n++;
+        }
+    }
+
+    lock.unlock_shared();
+    return n;
+}
+
+bool DirectIndex::remove(MagritteKey key, MagritteIndex& index) {
+    lock.lock_shared();
+
+    auto page = this->find_page(page_of(key));
+    if (!page) {
+        lock.unlock_shared();
+        return false;
+    }
+
+    auto value = page->entries[slot_of(key)].exchange(
+        DIRECT_INDEX_EMPTY, std::memory_order_acq_rel);
+    if (value != DIRECT_INDEX_EMPTY)
+        page->dirty = true;
+    lock.unlock_shared();
+
+    if (value == DIRECT_INDEX_EMPTY)
+        return false;
+
+    index = value;
+    return true;
+}
+
+// pages are written under the lock of the whole index, too long to hold on a
+// timeout.
+bool DirectIndex::flush(FlushReason reason) {
+    if (reason == FlushReason::Timeout)
+        return false;
+
+    lock.lock();
+
+    auto buffer = std::vector<MagritteIndex>(DIRECT_INDEX_PAGE_CAP);
+    auto success = true;
+
+    for (auto& page : this->pages) {
+        if (!page.dirty)
+            continue;
+        page.dirty = false;
+
+        for (int j = 0; j < DIRECT_INDEX_PAGE_CAP; j++)
+            buffer[j] = page.entries[j].load(std::memory_order_relaxed);
+
+        auto page_offset = this->offset + page.slot * DIRECT_INDEX_PAGE_SIZE;
+        success &= pwrite(this->file, &page.no, sizeof(uint32_t),
+                          page_offset) == sizeof(uint32_t);
+        success &= pwrite(this->file, buffer.data(),
+                          DIRECT_INDEX_PAGE_CAP * sizeof(MagritteIndex),
+                          page_offset + sizeof(uint32_t)) ==
+                   DIRECT_INDEX_PAGE_CAP * sizeof(MagritteIndex);
+    }
+
+    lock.unlock();
+    return success;
+}
+
+size_t DirectIndex::size() { return this->pages.size(); }
@@ -0,0 +1,111 @@
+#include "flush_scheduler.h"
+#include "Block.h"
+
+#include <algorithm>
+
+FlushScheduler::FlushScheduler(uint32_t millisec_flush_timeout, int n_workers)
+    : timeout(millisec_flush_timeout),
+      requests(FLUSH_SCHEDULER_QUEUE_SIZE), shutdown_(false) {
+    for (int i = 0; i < n_workers; i++)
+        workers.emplace_back(&FlushScheduler::worker, this);
+}
+
+FlushScheduler::~FlushScheduler() { shutdown(); }
+
+void FlushScheduler::add(Block* block) {
+    std::lock_guard<std::mutex> guard(mutex);
+    registered.insert(block);
+}
+
+void FlushScheduler::remove(Block* block) {
+    std::unique_lock<std::mutex> guard(mutex);
+    // requests still in the channel are dropped once unregistered.
+    registered.erase(block);
+    queued.erase(block);
+    flushed.wait(guard, [&] { return !flushing.contains(block); });
+}
+
+void FlushScheduler::enqueue(Block* block, bool urgent) {
+    // nobody drains the channel any more, blocks flush themselves on
+    // shutdown.
+    if (shutdown_)
+        return;
+    requests << FlushRequest{.block = block, .urgent = urgent};
+}
+
+void FlushScheduler::shutdown() {
+    if (shutdown_.exchange(true))
+        return;
+
+    // wake every worker up.
+    for (size_t i = 0; i < workers.size(); i++)
+        requests << FlushRequest{.block = nullptr, .urgent = false};
+    for (auto& worker : workers)
+        worker.join();
+}
+
+Block* FlushScheduler::pick(time_point now, time_point& next_due) {
+    Block* best = nullptr;
+    bool best_urgent = false;
+    uint64_t best_score = 0;
+    next_due = time_point::max();
+
+    for (const auto& [block, entry] : queued) {
+        auto due = entry.since + timeout;
+        if (!entry.urgent && due > now) {
+            next_due = std::min(next_due, due);
+            continue;
+        }
+
+        auto age = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       now - entry.since)
+                       .count();
+        uint64_t score = block->dirty_bytes() * uint64_t(age + 1);
+        if (!best || std::make_pair(entry.urgent, score) >
+                         std::make_pair(best_urgent, best_score)) {
+            best = block;
+            best_urgent = entry.urgent;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+void FlushScheduler::worker() {
+    uint32_t idle_ms = std::max<int64_t>(timeout.count(), 1);
+    uint32_t wait_ms = idle_ms;
+
+    while (!shutdown_) {
+        auto [request, ok] = requests.pop_timeout(wait_ms);
+
+        std::unique_lock<std::mutex> guard(mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (ok && request.block && registered.contains(request.block)) {
+            auto it = queued.try_emplace(request.block, Entry{now, false});
+            it.first->second.urgent |= request.urgent;
+        }
+
+        time_point next_due;
+        while (auto block = pick(now, next_due)) {
+            queued.erase(block);
+            flushing.insert(block);
+            guard.unlock();
+
+            block->flush_now();
+
+            guard.lock();
+            flushing.erase(flushing.find(block));
+            flushed.notify_all();
+            now = std::chrono::steady_clock::now();
+        }
+
+        if (next_due == time_point::max()) {
+            wait_ms = idle_ms;
+        } else {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                next_due - now);
+            wait_ms = std::max<int64_t>(left.count(), 1);
+        }
+    }
+}
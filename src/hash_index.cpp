@@ -0,0 +1,407 @@
+#include "hash_index.h"
+#include "magritte_typedefs.h"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// bit i of the result is set if ctrl[i] == b, for the 16 bytes of a group.
+static uint32_t match_byte(const uint8_t* ctrl, uint8_t b) {
+#if defined(__SSE2__)
+    auto group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    auto eq = _mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(b)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(eq));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_INDEX_GROUP_WIDTH; i++)
+        mask |= static_cast<uint32_t>(ctrl[i] == b) << i;
+    return mask;
+#endif
+}
+
+// empty and deleted slots are the only ones with the high bit set.
+static uint32_t match_free(const uint8_t* ctrl) {
+#if defined(__SSE2__)
+    auto group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return static_cast<uint32_t>(_mm_movemask_epi8(group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_INDEX_GROUP_WIDTH; i++)
+        mask |= static_cast<uint32_t>(ctrl[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+static uint8_t tag_of(uint32_t hash) { return hash & 0x7F; }
+
+static std::vector<MagritteKeyIndexPair>
+collect(const HashIndexTable& table, MagritteKey from, MagritteKey to) {
+    std::vector<MagritteKeyIndexPair> pairs;
+    for (size_t i = 0; i < table.slots.size(); i++) {
+        if (table.ctrl[i] >= HASH_INDEX_CTRL_EMPTY)
+            continue;
+        if (table.slots[i].key >= from && table.slots[i].key <= to)
+            pairs.push_back(table.slots[i]);
+    }
+    return pairs;
+}
+
+HashIndexTable::HashIndexTable(uint32_t n_groups)
+    : n_groups(n_groups), n_items(0), n_deleted(0),
+      ctrl(n_groups * HASH_INDEX_GROUP_WIDTH, HASH_INDEX_CTRL_EMPTY),
+      slots(n_groups * HASH_INDEX_GROUP_WIDTH),
+      dirty_mark(n_groups / HASH_INDEX_PAGE_GROUPS, true) {}
+
+// groups are probed triangularly, which visits every group of a power of two
+// sized table. probing stops at the first group with an empty slot.
+int64_t HashIndexTable::find(MagritteKey key, uint32_t hash) const {
+    auto mask = this->n_groups - 1;
+    auto group = (hash >> 7) & mask;
+    auto tag = tag_of(hash);
+
+    for (uint32_t step = 1; step <= this->n_groups; step++) {
+        auto base = group * HASH_INDEX_GROUP_WIDTH;
+        auto candidates = match_byte(&this->ctrl[base], tag);
+        while (candidates) {
+            auto i = base + std::countr_zero(candidates);
+            if (this->slots[i].key == key)
+                return i;
+            candidates &= candidates - 1;
+        }
+
+        if (match_byte(&this->ctrl[base], HASH_INDEX_CTRL_EMPTY))
+            return -1;
+        group = (group + step) & mask;
+    }
+
+    return -1;
+}
+
+void HashIndexTable::insert(MagritteKey key, MagritteIndex index,
+                            uint32_t hash) {
+    auto mask = this->n_groups - 1;
+    auto group = (hash >> 7) & mask;
+
+    for (uint32_t step = 1; step <= this->n_groups; step++) {
+        auto base = group * HASH_INDEX_GROUP_WIDTH;
+        auto free = match_free(&this->ctrl[base]);
+        if (free) {
+            auto i = base + std::countr_zero(free);
+            if (this->ctrl[i] == HASH_INDEX_CTRL_DELETED)
+                this->n_deleted--;
+            this->ctrl[i] = tag_of(hash);
+            this->slots[i] = {key, index};
+            this->n_items++;
+            this->dirty_mark[i / HASH_INDEX_PAGE_SLOTS] = true;
+            return;
+        }
+        group = (group + step) & mask;
+    }
+
+    throw std::runtime_error("hash-index: table is full");
+}
+
+void HashIndexTable::erase(int64_t slot) {
+    // a slot in a group without empty slots may be on the probe path of other
+    // keys, it has to stay occupied as a tombstone.
+    auto base = slot / HASH_INDEX_GROUP_WIDTH * HASH_INDEX_GROUP_WIDTH;
+    auto reachable = match_byte(&this->ctrl[base], HASH_INDEX_CTRL_EMPTY);
+    if (reachable) {
+        this->ctrl[slot] = HASH_INDEX_CTRL_EMPTY;
+    } else {
+        this->ctrl[slot] = HASH_INDEX_CTRL_DELETED;
+        this->n_deleted++;
+    }
+    this->n_items--;
+    this->dirty_mark[slot / HASH_INDEX_PAGE_SLOTS] = true;
+}
+
+// keep at most 7/8 of the slots in use, tombstones included.
+bool HashIndexTable::overloaded() const {
+    return (uint64_t(this->n_items) + this->n_deleted) * 8 >
+           uint64_t(this->n_groups) * HASH_INDEX_GROUP_WIDTH * 7;
+}
+
+uint32_t HashIndexTable::n_pages() const {
+    return this->n_groups / HASH_INDEX_PAGE_GROUPS;
+}
+
+HashIndex::HashIndex(int file, int64_t offset, uint32_t n_pages)
+    : migrated(0), offset(offset), file(file) {
+    HashIndexPageHeader header;
+    auto data_size = HASH_INDEX_PAGE_SIZE - sizeof(HashIndexPageHeader);
+    auto buffer = std::vector<char>(data_size);
+
+    for (uint32_t i = 0; i < n_pages; i++) {
+        auto page_offset = offset + i * HASH_INDEX_PAGE_SIZE;
+
+        auto n_bytes =
+            pread(file, &header, sizeof(HashIndexPageHeader), page_offset);
+        if (n_bytes != sizeof(HashIndexPageHeader)) {
+            std::string message = "hash-index: failed load header of page " +
+                                  std::to_string(i) + " from file: ";
+            message += std::strerror(errno);
+            throw std::runtime_error(message);
+        }
+
+        n_bytes = pread(file, buffer.data(), data_size,
+                        page_offset + sizeof(HashIndexPageHeader));
+        if (n_bytes != ssize_t(data_size)) {
+            std::string message = "hash-index: failed load data of page " +
+                                  std::to_string(i) + " from file: ";
+            message += std::strerror(errno);
+            throw std::runtime_error(message);
+        }
+
+        auto& target = header.old ? this->old_table : this->table;
+        if (!target)
+            target = std::make_unique<HashIndexTable>(header.n_groups);
+        if (target->n_groups != header.n_groups ||
+            header.page_no >= target->n_pages())
+            throw std::runtime_error("hash-index: page " + std::to_string(i) +
+                                     " does not match its table");
+
+        auto first = header.page_no * HASH_INDEX_PAGE_SLOTS;
+        memcpy(&target->ctrl[first], buffer.data(), HASH_INDEX_PAGE_SLOTS);
+        memcpy(&target->slots[first], buffer.data() + HASH_INDEX_PAGE_SLOTS,
+               HASH_INDEX_PAGE_SLOTS * sizeof(MagritteKeyIndexPair));
+        target->dirty_mark[header.page_no] = false;
+
+        for (int j = 0; j < HASH_INDEX_PAGE_SLOTS; j++) {
+            auto ctrl = target->ctrl[first + j];
+            target->n_items += ctrl < HASH_INDEX_CTRL_EMPTY;
+            target->n_deleted += ctrl == HASH_INDEX_CTRL_DELETED;
+        }
+    }
+
+    if (!this->table)
+        this->table = std::make_unique<HashIndexTable>(HASH_INDEX_PAGE_GROUPS);
+}
+
+HashIndex::~HashIndex() { this->flush(FlushReason::Manually); }
+
+// murmur3 finalizer, keys are often sequential so they need mixing.
+uint32_t HashIndex::hash_of(MagritteKey key) {
+    auto h = static_cast<uint32_t>(key);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+void HashIndex::start_resize() {
+    // tables full of tombstones are rebuilt at the same size.
+    auto n_groups = this->table->n_groups;
+    if (uint64_t(this->table->n_items) * 2 >
+        uint64_t(n_groups) * HASH_INDEX_GROUP_WIDTH)
+        n_groups *= 2;
+
+    this->old_table = std::move(this->table);
+    this->table = std::make_unique<HashIndexTable>(n_groups);
+    this->migrated = 0;
+
+    // pages of the old table move behind the new ones in the index region.
+    this->old_table->dirty_mark.assign(this->old_table->n_pages(), true);
+}
+
+// moves the next few groups of old_table, keys already in `table` were put
+// after the resize started and are newer.
+void HashIndex::migrate_step() {
+    if (!this->old_table)
+        return;
+
+    auto& old = *this->old_table;
+    auto end = std::min(this->migrated + HASH_INDEX_MIGRATE_GROUPS,
+                        old.n_groups);
+    for (auto i = this->migrated * HASH_INDEX_GROUP_WIDTH;
+         i < end * HASH_INDEX_GROUP_WIDTH; i++) {
+        if (old.ctrl[i] >= HASH_INDEX_CTRL_EMPTY)
+            continue;
+
+        auto& pair = old.slots[i];
+        auto hash = hash_of(pair.key);
+        if (this->table->find(pair.key, hash) < 0)
+            this->table->insert(pair.key, pair.index, hash);
+    }
+    this->migrated = end;
+
+    if (this->migrated == old.n_groups)
+        this->old_table.reset();
+}
+
+bool HashIndex::get(MagritteKey key, MagritteIndex& index) {
+    auto hash = hash_of(key);
+    lock.lock_shared();
+
+    auto slot = this->table->find(key, hash);
+    if (slot >= 0) {
+        index = this->table->slots[slot].index;
+        lock.unlock_shared();
+        return true;
+    }
+
+    if (this->old_table) {
+        slot = this->old_table->find(key, hash);
+        if (slot >= 0) {
+            index = this->old_table->slots[slot].index;
+            lock.unlock_shared();
+            return true;
+        }
+    }
+
+    lock.unlock_shared();
+    return false;
+}
+
+// hashing gives up key order, every call sweeps both tables. only the
+// `limit` smallest keys of the range are sorted and kept.
+size_t HashIndex::range(MagritteKey from, MagritteKey to, size_t limit,
+                        std::vector<MagritteKeyIndexPair>& out) {
+    lock.lock_shared();
+
+    auto pairs = collect(*this->table, from, to);
+    if (this->old_table) {
+        // keys updated during the resize are in both tables, skip old copies.
+        for (auto& pair : collect(*this->old_table, from, to)) {
+            if (this->table->find(pair.key, hash_of(pair.key)) < 0)
+                pairs.push_back(pair);
+        }
+    }
+
+    lock.unlock_shared();
+
+    auto n = std::min(limit, pairs.size());
+    std::partial_sort(
+        pairs.begin(), pairs.begin() + n, pairs.end(),
+        [](const MagritteKeyIndexPair& a, const MagritteKeyIndexPair& b) {
+            return a.key < b.key;
+        });
+    out.insert(out.end(), pairs.begin(), pairs.begin() + n);
+    return n;
+}
+
+bool HashIndex::put(MagritteKey key, MagritteIndex index) {
+    auto hash = hash_of(key);
+    lock.lock();
+
+    this->migrate_step();
+
+    auto slot = this->table->find(key, hash);
+    if (slot >= 0) {
+        this->table->slots[slot].index = index;
+        this->table->dirty_mark[slot / HASH_INDEX_PAGE_SLOTS] = true;
+        lock.unlock();
+        return true;
+    }
+
+    if (this->table->overloaded()) {
+        // drain whatever is left before starting another resize.
+        while (this->old_table)
+            this->migrate_step();
+        this->start_resize();
+    }
+
+    this->table->insert(key, index, hash);
+
+    lock.unlock();
+    return true;
+}
+
+bool HashIndex::remove(MagritteKey key, MagritteIndex& index) {
+    auto hash = hash_of(key);
+    lock.lock();
+
+    this->migrate_step();
+
+    // the key may be in both tables when it was updated during a resize, the
+    // copy in `table` is the newer one.
+    auto found = false;
+    if (this->old_table) {
+        auto slot = this->old_table->find(key, hash);
+        if (slot >= 0) {
+            index = this->old_table->slots[slot].index;
+            this->old_table->erase(slot);
+            found = true;
+        }
+    }
+
+    auto slot = this->table->find(key, hash);
+    if (slot >= 0) {
+        index = this->table->slots[slot].index;
+        this->table->erase(slot);
+        found = true;
+    }
+
+    lock.unlock();
+    return found;
+}
+
+// pages of `table` are written from slot 0 of the index region, pages of
+// old_table follow them. as they move while the table grows, they are not
+// written on a timeout.
+bool HashIndex::flush(FlushReason reason) {
+    if (reason == FlushReason::Timeout)
+        return false;
+
+    lock.lock();
+
+    auto success = this->flush_table(*this->table, false, 0);
+    if (this->old_table)
+        success &= this->flush_table(*this->old_table, true,
+                                     this->table->n_pages());
+
+    lock.unlock();
+    return success;
+}
+
+bool HashIndex::flush_table(HashIndexTable& source, bool old,
+                            uint32_t first_slot) {
+    auto success = true;
+
+    for (uint32_t i = 0; i < source.n_pages(); i++) {
+        if (!source.dirty_mark[i])
+            continue;
+        source.dirty_mark[i] = false;
+
+        HashIndexPageHeader header = {
+            .n_groups = source.n_groups,
+            .page_no = i,
+            .old = old,
+            .reserved = 0,
+        };
+        auto page_offset =
+            this->offset + (first_slot + i) * HASH_INDEX_PAGE_SIZE;
+        auto first = i * HASH_INDEX_PAGE_SLOTS;
+        auto slots_size = HASH_INDEX_PAGE_SLOTS * sizeof(MagritteKeyIndexPair);
+
+        success &= pwrite(this->file, &header, sizeof(HashIndexPageHeader),
+                          page_offset) == sizeof(HashIndexPageHeader);
+        page_offset += sizeof(HashIndexPageHeader);
+        success &= pwrite(this->file, &source.ctrl[first],
+                          HASH_INDEX_PAGE_SLOTS,
+                          page_offset) == HASH_INDEX_PAGE_SLOTS;
+        page_offset += HASH_INDEX_PAGE_SLOTS;
+        success &= pwrite(this->file, &source.slots[first], slots_size,
+                          page_offset) == ssize_t(slots_size);
+    }
+
+    return success;
+}
+
+size_t HashIndex::size() {
+    auto n_pages = this->table->n_pages();
+    if (this->old_table)
+        n_pages += this->old_table->n_pages();
+    return n_pages;
+}
@@ -0,0 +1,32 @@
+#include "index.h"
+#include "direct_index.h"
+#include "hash_index.h"
+#include "index_cluster.h"
+#include <memory>
+#include <vector>
+
+void Index::multi_get(const std::vector<MagritteKey>& keys,
+                      std::vector<MagritteIndex>& indices,
+                      std::vector<bool>& found) {
+    indices.resize(keys.size());
+    found.assign(keys.size(), false);
+    for (size_t i = 0; i < keys.size(); i++)
+        found[i] = this->get(keys[i], indices[i]);
+}
+
+void Index::multi_put(const std::vector<MagritteKeyIndexPair>& pairs) {
+    for (auto& pair : pairs)
+        this->put(pair.key, pair.index);
+}
+
+std::unique_ptr<Index> load_index(MagritteIndexType type, int file,
+                                  int64_t offset, uint32_t n_blocks) {
+    switch (type) {
+    case MagritteIndexType::Direct:
+        return std::make_unique<DirectIndex>(file, offset, n_blocks);
+    case MagritteIndexType::Hash:
+        return std::make_unique<HashIndex>(file, offset, n_blocks);
+    default:
+        return std::make_unique<IndexCluster>(file, offset, n_blocks);
+    }
+}
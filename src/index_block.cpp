@@ -1,11 +1,52 @@
 #include "index_block.h"
 #include "magritte_typedefs.h"
+#include <algorithm>
+#include <bit>
 #include <climits>
+#include <cstring>
 #include <cstdint>
 #include <ctime>
 #include <string>
 #include <utility>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// count pairs in [base, base + n) whose key is less than `key`. pairs are
+// interleaved {key, index}, so only the even 32-bit lanes are compared.
+static size_t count_less(const MagritteKeyIndexPair* base, size_t n,
+                         MagritteKey key) {
+    size_t count = 0;
+    size_t i = 0;
+    auto ints = reinterpret_cast<const int32_t*>(base);
+
+#if defined(__AVX2__)
+    auto needle = _mm256_set1_epi32(key);
+    for (; i + 4 <= n; i += 4) {
+        auto keys = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(ints + i * 2));
+        auto lt = _mm256_cmpgt_epi32(needle, keys);
+        auto mask = _mm256_movemask_ps(_mm256_castsi256_ps(lt)) & 0x55;
+        count += std::popcount(static_cast<unsigned>(mask));
+    }
+#elif defined(__SSE2__)
+    auto needle = _mm_set1_epi32(key);
+    for (; i + 2 <= n; i += 2) {
+        auto keys =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(ints + i * 2));
+        auto lt = _mm_cmpgt_epi32(needle, keys);
+        auto mask = _mm_movemask_ps(_mm_castsi128_ps(lt)) & 0x5;
+        count += std::popcount(static_cast<unsigned>(mask));
+    }
+#endif
+
+    for (; i < n; i++)
+        count += base[i].key < key;
+
+    return count;
+}
+
 IndexBlock::IndexBlock(MagritteKey lower_bound, MagritteKey upper_bound)
     : _lower_bound(lower_bound), _upper_bound(upper_bound) {
     if (lower_bound >= upper_bound)
@@ -22,6 +63,25 @@ IndexBlock::IndexBlock(MagritteKey lower_bound, MagritteKey upper_bound,
     if (lower_bound >= upper_bound)
         throw std::invalid_argument(
             "lower_bound should be less than upper_bound");
+
+    // data loaded from older files is not ordered, and may repeat keys in the
+    // unused tail of the data segment. keep the first occurrence of each key.
+    this->store.erase(std::remove_if(this->store.begin(), this->store.end(),
+                                     [](const MagritteKeyIndexPair& pair) {
+                                         return pair.index ==
+                                                INDEX_BLOCK_NO_INDEX;
+                                     }),
+                      this->store.end());
+    auto by_key = [](const MagritteKeyIndexPair& a,
+                     const MagritteKeyIndexPair& b) { return a.key < b.key; };
+    if (!std::is_sorted(this->store.begin(), this->store.end(), by_key))
+        std::stable_sort(this->store.begin(), this->store.end(), by_key);
+    auto last = std::unique(this->store.begin(), this->store.end(),
+                            [](const MagritteKeyIndexPair& a,
+                               const MagritteKeyIndexPair& b) {
+                                return a.key == b.key;
+                            });
+    this->store.erase(last, this->store.end());
 }
 
 IndexBlock::IndexBlock(IndexBlock& ib)
@@ -43,14 +103,10 @@ bool IndexBlock::put(MagritteKey key, MagritteIndex index) {
 
     lock.lock();
 
-    bool found = false;
-    for (auto it = this->store.begin(); it < this->store.end(); it++) {
-        if (it->key == key) {
-            it->index = index;
-            found = true;
-            break;
-        }
-    }
+    auto pos = this->lower_bound_of(key);
+    bool found = pos < this->store.size() && this->store[pos].key == key;
+    if (found)
+        this->store[pos].index = index;
 
     if (!found && this->store.size() == INDEX_BLOCK_MAX_CAP) {
         lock.unlock();
@@ -58,14 +114,19 @@ bool IndexBlock::put(MagritteKey key, MagritteIndex index) {
     }
 
     if (!found)
-        this->store.push_back({key, index});
+        this->store.insert(this->store.begin() + pos, {key, index});
 
     lock.unlock();
     return true;
 }
 
 void IndexBlock::put_lockfree(MagritteKey key, MagritteIndex index) {
-    this->store.push_back({key, index});
+    auto pos = this->lower_bound_of(key);
+    if (pos < this->store.size() && this->store[pos].key == key) {
+        this->store[pos].index = index;
+        return;
+    }
+    this->store.insert(this->store.begin() + pos, {key, index});
 }
 
 std::pair<bool, IndexBlock>
@@ -78,17 +139,23 @@ IndexBlock::put_or_split_put(MagritteKey key, MagritteIndex index) {
 
     lock.lock();
 
-    bool found = false;
-    for (auto it = this->store.begin(); it < this->store.end(); it++) {
-        if (it->key == key) {
-            it->index = index;
-            found = true;
-            break;
-        }
-    }
+    auto pos = this->lower_bound_of(key);
+    bool found = pos < this->store.size() && this->store[pos].key == key;
+    if (found)
+        this->store[pos].index = index;
 
     if (!found && this->store.size() == INDEX_BLOCK_MAX_CAP) {
-        auto higher = this->split_lockfree();
+        // splitting at the middle of the range may leave the half that
+        // receives `key` full when keys are clustered, e.g. sequential keys.
+        // split at the median key then, so both halves get room.
+        auto mid = this->midpoint();
+        auto n_lower = this->lower_bound_of(mid);
+        auto n_target = key >= mid ? this->store.size() - n_lower : n_lower;
+        auto target_full = n_target == INDEX_BLOCK_MAX_CAP;
+        if (target_full)
+            mid = this->store[INDEX_BLOCK_MAX_CAP / 2].key;
+
+        auto higher = this->split_lockfree(mid);
         if (key >= higher.lower_bound())
             higher.put_lockfree(key, index);
         else
@@ -97,7 +164,7 @@ IndexBlock::put_or_split_put(MagritteKey key, MagritteIndex index) {
         lock.unlock();
         return std::make_pair(true, higher);
     } else if (!found) {
-        this->store.push_back({key, index});
+        this->store.insert(this->store.begin() + pos, {key, index});
     }
 
     lock.unlock();
@@ -113,19 +180,70 @@ bool IndexBlock::get(MagritteKey key, MagritteIndex& index) {
 
     this->lock.lock_shared();
 
-    for (auto pair : this->store) {
-        if (pair.key == key) {
-            index = pair.index;
+    auto pos = this->lower_bound_of(key);
+    if (pos < this->store.size() && this->store[pos].key == key) {
+        index = this->store[pos].index;
 
-            lock.unlock_shared();
-            return true;
-        }
+        lock.unlock_shared();
+        return true;
     }
 
     lock.unlock_shared();
     return false;
 }
 
+void IndexBlock::get_many(const MagritteKeyIndexPair* keys, size_t n,
+                          std::vector<MagritteIndex>& indices,
+                          std::vector<bool>& found) {
+    this->lock.lock_shared();
+
+    for (size_t i = 0; i < n; i++) {
+        auto pos = this->lower_bound_of(keys[i].key);
+        if (pos < this->store.size() && this->store[pos].key == keys[i].key) {
+            indices[keys[i].index] = this->store[pos].index;
+            found[keys[i].index] = true;
+        }
+    }
+
+    lock.unlock_shared();
+}
+
+size_t IndexBlock::put_many(const MagritteKeyIndexPair* pairs, size_t n) {
+    lock.lock();
+
+    size_t i = 0;
+    for (; i < n; i++) {
+        if (!this->fit_in(pairs[i].key))
+            break;
+
+        auto pos = this->lower_bound_of(pairs[i].key);
+        if (pos < this->store.size() && this->store[pos].key == pairs[i].key) {
+            this->store[pos].index = pairs[i].index;
+            continue;
+        }
+        if (this->store.size() == INDEX_BLOCK_MAX_CAP)
+            break;
+        this->store.insert(this->store.begin() + pos, pairs[i]);
+    }
+
+    lock.unlock();
+    return i;
+}
+
+size_t IndexBlock::range(MagritteKey from, MagritteKey to, size_t limit,
+                         std::vector<MagritteKeyIndexPair>& out) {
+    this->lock.lock_shared();
+
+    size_t n = 0;
+    for (auto i = this->lower_bound_of(from);
+         i < this->store.size() && n < limit && this->store[i].key <= to;
+         i++, n++)
+        out.push_back(this->store[i]);
+
+    lock.unlock_shared();
+    return n;
+}
+
 bool IndexBlock::remove(MagritteKey key, MagritteIndex& index) {
     if (!this->fit_in(key))
         throw std::invalid_argument("key " + std::to_string(key) +
@@ -135,14 +253,13 @@ bool IndexBlock::remove(MagritteKey key, MagritteIndex& index) {
 
     lock.lock();
 
-    for (auto it = this->store.begin(); it < this->store.end(); it++) {
-        if (it->key == key) {
-            index = it->index;
-            this->store.erase(it);
+    auto pos = this->lower_bound_of(key);
+    if (pos < this->store.size() && this->store[pos].key == key) {
+        index = this->store[pos].index;
+        this->store.erase(this->store.begin() + pos);
 
-            lock.unlock();
-            return true;
-        }
+        lock.unlock();
+        return true;
     }
 
     lock.unlock();
@@ -166,11 +283,10 @@ bool IndexBlock::full_wrt(MagritteKey key) {
 
     lock.lock_shared();
 
-    for (auto& pair : this->store) {
-        if (pair.key == key) {
-            lock.unlock_shared();
-            return false;
-        }
+    auto pos = this->lower_bound_of(key);
+    if (pos < this->store.size() && this->store[pos].key == key) {
+        lock.unlock_shared();
+        return false;
     }
 
     lock.unlock_shared();
@@ -186,12 +302,18 @@ IndexBlock IndexBlock::split() {
     return block;
 }
 
-IndexBlock IndexBlock::split_lockfree() {
+MagritteKey IndexBlock::midpoint() {
     int64_t correction = this->_upper_bound == INT_MAX ? 1 : 0;
-    MagritteKey mid = ((int64_t)(this->_lower_bound) +
-                       (int64_t)(this->_upper_bound) + correction) /
-                      2;
+    return ((int64_t)(this->_lower_bound) + (int64_t)(this->_upper_bound) +
+            correction) /
+           2;
+}
+
+IndexBlock IndexBlock::split_lockfree() {
+    return this->split_lockfree(this->midpoint());
+}
 
+IndexBlock IndexBlock::split_lockfree(MagritteKey mid) {
     auto previous_upper_bound = this->_upper_bound;
     this->_upper_bound = mid;
 
@@ -199,22 +321,34 @@ IndexBlock IndexBlock::split_lockfree() {
         return IndexBlock(mid, previous_upper_bound);
     }
 
+    // store is sorted, everything from the first key >= mid moves out.
+    auto split_at = this->store.begin() + this->lower_bound_of(mid);
     auto indicies_in_higher_range = std::vector<MagritteKeyIndexPair>();
     indicies_in_higher_range.reserve(INDEX_BLOCK_MAX_CAP);
-
-    for (auto it = this->store.begin(); it != this->store.end();) {
-        if (it->key >= mid) {
-            indicies_in_higher_range.push_back({it->key, it->index});
-            it = this->store.erase(it);
-        } else {
-            ++it;
-        }
-    }
+    indicies_in_higher_range.assign(split_at, this->store.end());
+    this->store.erase(split_at, this->store.end());
 
     return IndexBlock(mid, previous_upper_bound,
                       std::move(indicies_in_higher_range));
 }
 
+// position of the first pair whose key is not less than `key`. the range is
+// halved with a conditional move instead of a branch until at most
+// INDEX_BLOCK_SEARCH_WINDOW candidates are left, which are counted at once.
+size_t IndexBlock::lower_bound_of(MagritteKey key) const {
+    auto begin = this->store.data();
+    auto base = begin;
+    size_t n = this->store.size();
+
+    while (n > INDEX_BLOCK_SEARCH_WINDOW) {
+        size_t half = n / 2;
+        base = (base[half].key < key) ? base + half : base;
+        n -= half;
+    }
+
+    return (base - begin) + count_less(base, n, key);
+}
+
 MagritteKey IndexBlock::lower_bound() { return this->_lower_bound; }
 MagritteKey IndexBlock::upper_bound() { return this->_upper_bound; }
 
@@ -224,3 +358,24 @@ std::pair<char*, size_t> IndexBlock::data() {
     return std::make_pair(data,
                           this->store.size() * sizeof(MagritteKeyIndexPair));
 }
+
+// the tail is filled, so pairs of an earlier, larger version of the block
+// are not loaded again.
+void IndexBlock::snapshot(std::vector<char>& out) {
+    out.resize(INDEX_BLOCK_SIZE);
+    auto pairs = reinterpret_cast<MagritteKeyIndexPair*>(
+        out.data() + 2 * sizeof(MagritteKey));
+
+    this->lock.lock_shared();
+
+    memcpy(out.data(), &this->_lower_bound, sizeof(MagritteKey));
+    memcpy(out.data() + sizeof(MagritteKey), &this->_upper_bound,
+           sizeof(MagritteKey));
+    std::copy(this->store.begin(), this->store.end(), pairs);
+    auto n = this->store.size();
+
+    this->lock.unlock_shared();
+
+    std::fill(pairs + n, pairs + INDEX_BLOCK_MAX_CAP,
+              MagritteKeyIndexPair{0, INDEX_BLOCK_NO_INDEX});
+}
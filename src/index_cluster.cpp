@@ -1,6 +1,7 @@
 #include "index_cluster.h"
 #include "index_block.h"
 #include "magritte_typedefs.h"
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <cstdint>
@@ -12,7 +13,7 @@
 
 // if n_blocks_in_file == 0, then a index block with INT_MIN and INT_MAX will be
 // created.
-IndexCluster::IndexCluster(int file, uint32_t offset, uint32_t n_blocks_in_file)
+IndexCluster::IndexCluster(int file, int64_t offset, uint32_t n_blocks_in_file)
     : file(file), offset(offset), dirty_mark(n_blocks_in_file) {
     for (auto i = 0; i < n_blocks_in_file; i++) {
         MagritteKey upperbound, lowerbound;
@@ -37,10 +38,14 @@ IndexCluster::IndexCluster(int file, uint32_t offset, uint32_t n_blocks_in_file)
             throw std::runtime_error(message);
         }
 
+        // the last block may be written partially, the rest of its data
+        // segment is past the end of file.
         auto indicies = std::vector<MagritteKeyIndexPair>(INDEX_BLOCK_MAX_CAP);
         n_bytes = pread(file, indicies.data(), INDEX_BLOCK_DATA_SEG_SIZE,
                         offset + i * INDEX_BLOCK_SIZE + 8);
-        if (n_bytes != INDEX_BLOCK_DATA_SEG_SIZE) {
+        if (n_bytes >= 0 && n_bytes < INDEX_BLOCK_DATA_SEG_SIZE)
+            indicies.resize(n_bytes / sizeof(MagritteKeyIndexPair));
+        if (n_bytes < 0) {
             std::string message =
                 "index-cluster: failed load data segment of block " +
                 std::to_string(i) + " to from file: ";
@@ -55,6 +60,8 @@ IndexCluster::IndexCluster(int file, uint32_t offset, uint32_t n_blocks_in_file)
         this->index_blocks.emplace_back(INT_MIN, INT_MAX);
         this->dirty_mark.emplace_back(true);
     }
+
+    this->rebuild_fences();
 }
 
 IndexCluster::~IndexCluster() { this->flush(FlushReason::Manually); }
@@ -63,6 +70,9 @@ IndexCluster& IndexCluster::operator=(IndexCluster&& other) {
     lock.lock();
 
     this->index_blocks = std::move(other.index_blocks);
+    this->dirty_mark = std::move(other.dirty_mark);
+    this->fences = std::move(other.fences);
+    this->fence_slots = std::move(other.fence_slots);
     this->offset = other.offset;
     this->file = other.file;
 
@@ -70,39 +80,180 @@ IndexCluster& IndexCluster::operator=(IndexCluster&& other) {
     return *this;
 }
 
-bool IndexCluster::set_offset(uint32_t offset) {
-    this->offset = offset;
-    return this->flush(FlushReason::OffsetChange);
+// position in `fences` of the block covering `key`, that is the last fence
+// not greater than `key`. fences[0] is always INT_MIN so such fence exists.
+size_t IndexCluster::route(MagritteKey key) const {
+    auto begin = this->fences.data();
+    auto base = begin;
+    size_t n = this->fences.size();
+
+    while (n > 1) {
+        size_t half = n / 2;
+        base = (base[half] <= key) ? base + half : base;
+        n -= half;
+    }
+
+    return base - begin;
+}
+
+void IndexCluster::rebuild_fences() {
+    this->fence_slots.resize(this->index_blocks.size());
+    for (uint32_t i = 0; i < this->fence_slots.size(); i++)
+        this->fence_slots[i] = i;
+
+    std::sort(this->fence_slots.begin(), this->fence_slots.end(),
+              [this](uint32_t a, uint32_t b) {
+                  return this->index_blocks[a].lower_bound() <
+                         this->index_blocks[b].lower_bound();
+              });
+
+    this->fences.resize(this->fence_slots.size());
+    for (size_t i = 0; i < this->fences.size(); i++)
+        this->fences[i] = this->index_blocks[this->fence_slots[i]].lower_bound();
 }
 
 bool IndexCluster::get(MagritteKey key, MagritteIndex& index) {
     lock.lock_shared();
 
-    for (auto& block : this->index_blocks) {
-        if (block.fit_in(key)) {
-            lock.unlock_shared();
-            return block.get(key, index);
-        }
+    if (this->fences.empty()) {
+        lock.unlock_shared();
+        return false;
+    }
+
+    auto& block = this->index_blocks[this->fence_slots[this->route(key)]];
+    auto found = block.get(key, index);
+
+    lock.unlock_shared();
+    return found;
+}
+
+size_t IndexCluster::range(MagritteKey from, MagritteKey to, size_t limit,
+                           std::vector<MagritteKeyIndexPair>& out) {
+    lock.lock_shared();
+
+    size_t n = 0;
+    for (auto pos = this->fences.empty() ? 0 : this->route(from);
+         pos < this->fences.size() && n < limit && this->fences[pos] <= to;
+         pos++) {
+        auto& block = this->index_blocks[this->fence_slots[pos]];
+        n += block.range(from, to, limit - n, out);
+    }
+
+    lock.unlock_shared();
+    return n;
+}
+
+// end of the run of `sorted` starting at `first` that falls into the block
+// at fence `pos`.
+size_t IndexCluster::group_end(const std::vector<MagritteKeyIndexPair>& sorted,
+                               size_t first, size_t pos) const {
+    if (pos + 1 == this->fences.size())
+        return sorted.size();
+
+    auto end = first;
+    while (end < sorted.size() && sorted[end].key < this->fences[pos + 1])
+        end++;
+    return end;
+}
+
+// keys are sorted so each block is routed to and locked once per batch.
+void IndexCluster::multi_get(const std::vector<MagritteKey>& keys,
+                             std::vector<MagritteIndex>& indices,
+                             std::vector<bool>& found) {
+    indices.resize(keys.size());
+    found.assign(keys.size(), false);
+
+    std::vector<MagritteKeyIndexPair> sorted(keys.size());
+    for (uint32_t i = 0; i < keys.size(); i++)
+        sorted[i] = {keys[i], i};
+    std::sort(sorted.begin(), sorted.end(),
+              [](const MagritteKeyIndexPair& a, const MagritteKeyIndexPair& b) {
+                  return a.key < b.key;
+              });
+
+    lock.lock_shared();
+
+    for (size_t i = 0; i < sorted.size() && !this->fences.empty();) {
+        auto pos = this->route(sorted[i].key);
+        auto end = this->group_end(sorted, i, pos);
+        this->index_blocks[this->fence_slots[pos]].get_many(
+            &sorted[i], end - i, indices, found);
+        i = end;
+    }
+
+    lock.unlock_shared();
+}
+
+void IndexCluster::multi_put(const std::vector<MagritteKeyIndexPair>& pairs) {
+    // stable, so the last of repeated keys is put last and wins.
+    std::vector<MagritteKeyIndexPair> sorted(pairs);
+    std::stable_sort(
+        sorted.begin(), sorted.end(),
+        [](const MagritteKeyIndexPair& a, const MagritteKeyIndexPair& b) {
+            return a.key < b.key;
+        });
+
+    // pairs meeting a full block are put one by one afterwards, as splitting
+    // needs the cluster lock exclusively.
+    std::vector<MagritteKeyIndexPair> rest;
+
+    lock.lock_shared();
+
+    for (size_t i = 0; i < sorted.size();) {
+        auto pos = this->route(sorted[i].key);
+        auto slot = this->fence_slots[pos];
+        auto end = this->group_end(sorted, i, pos);
+
+        auto n = this->index_blocks[slot].put_many(&sorted[i], end - i);
+        if (n > 0)
+            this->dirty_mark[slot] = true;
+        rest.insert(rest.end(), sorted.begin() + i + n, sorted.begin() + end);
+        i = end;
     }
 
     lock.unlock_shared();
-    return false;
+
+    for (auto& pair : rest)
+        this->put(pair.key, pair.index);
 }
 
+// cluster lock is held shared while routing and writing into a block, blocks
+// have their own locks so writers to different ranges don't wait for each
+// other. only a full block falls back to split_put, which needs the cluster
+// exclusively.
 bool IndexCluster::put(MagritteKey key, MagritteIndex index) {
-    lock.lock();
+    lock.lock_shared();
 
-    size_t i = 0;
-    for (i = 0; i < this->index_blocks.size(); i++) {
-        if (this->index_blocks[i].fit_in(key))
-            break;
+    auto i = this->fence_slots[this->route(key)];
+    if (this->index_blocks[i].put(key, index)) {
+        this->dirty_mark[i] = true;
+        lock.unlock_shared();
+        return true;
     }
 
+    lock.unlock_shared();
+    return this->split_put(key, index);
+}
+
+bool IndexCluster::split_put(MagritteKey key, MagritteIndex index) {
+    lock.lock();
+
+    // route again, the block may have been split by another writer after the
+    // shared lock was released.
+    auto pos = this->route(key);
+    auto i = this->fence_slots[pos];
+
     auto& block = this->index_blocks[i];
     auto [splited, higher] = block.put_or_split_put(key, index);
 
     this->dirty_mark[i] = true;
     if (splited) {
+        // the new block covers the upper half of the old range, so its fence
+        // goes right after the one of the block it was split from.
+        this->fences.insert(this->fences.begin() + pos + 1,
+                            higher.lower_bound());
+        this->fence_slots.insert(this->fence_slots.begin() + pos + 1,
+                                 this->index_blocks.size());
         this->index_blocks.emplace_back(higher);
         this->dirty_mark.emplace_back(true);
     }
@@ -112,40 +263,64 @@ bool IndexCluster::put(MagritteKey key, MagritteIndex index) {
 }
 
 bool IndexCluster::remove(MagritteKey key, MagritteIndex& index) {
-    auto is_highest_key = key == INT32_MAX;
-
-    size_t i = 0;
-    for (auto& block : this->index_blocks) {
-        if (block.fit_in(key)) {
-            auto success = block.remove(key, index);
-            this->dirty_mark[i] = true;
-            return success;
-        }
+    lock.lock_shared();
+
+    if (this->fences.empty()) {
+        lock.unlock_shared();
+        return false;
     }
 
-    return false;
+    auto i = this->fence_slots[this->route(key)];
+    auto success = this->index_blocks[i].remove(key, index);
+    if (success)
+        this->dirty_mark[i] = true;
+
+    lock.unlock_shared();
+    return success;
 }
 
+// blocks are copied one at a time under shared locks, so writers wait for at
+// most one copy, and written once the locks are released. the mark of a block
+// is cleared before it is copied, a change made after that marks it again for
+// the next flush.
 bool IndexCluster::flush(FlushReason reason) {
-    lock.lock();
+    auto success = true;
+    std::vector<uint32_t> slots;
+    std::vector<std::vector<char>> snapshots(INDEX_CLUSTER_FLUSH_BATCH);
 
-    for (auto i = 0; i < this->index_blocks.size(); i++) {
-        if (reason != FlushReason::OffsetChange && !dirty_mark[i])
+    uint32_t i = 0;
+    auto done = false;
+    while (!done) {
+        slots.clear();
+        for (; slots.size() < INDEX_CLUSTER_FLUSH_BATCH && !done; i++) {
+            lock.lock_shared();
+            done = i >= this->index_blocks.size();
+            if (!done && this->dirty_mark[i].exchange(false)) {
+                this->index_blocks[i].snapshot(snapshots[slots.size()]);
+                slots.push_back(i);
+            }
+            lock.unlock_shared();
+        }
+        if (slots.empty())
             continue;
 
-        auto& block = this->index_blocks[i];
-        auto upperbound = block.upper_bound();
-        auto lowerbound = block.lower_bound();
-        auto data = block.data();
-        pwrite(this->file, &lowerbound, 4, this->offset + i * INDEX_BLOCK_SIZE);
-        pwrite(this->file, &upperbound, 4,
-               this->offset + i * INDEX_BLOCK_SIZE + sizeof(MagritteKey));
-        pwrite(this->file, data.first, data.second,
-               this->offset + i * INDEX_BLOCK_SIZE + 2 * sizeof(MagritteKey));
+        auto ready = reason != FlushReason::Timeout || !this->flush_barrier ||
+                     this->flush_barrier();
+        for (size_t j = 0; j < slots.size(); j++) {
+            if (ready && pwrite(this->file, snapshots[j].data(),
+                                INDEX_BLOCK_SIZE,
+                                this->offset + slots[j] * INDEX_BLOCK_SIZE) ==
+                             INDEX_BLOCK_SIZE)
+                continue;
+
+            success = false;
+            lock.lock_shared();
+            this->dirty_mark[slots[j]] = true;
+            lock.unlock_shared();
+        }
     }
 
-    lock.unlock();
-    return true;
+    return success;
 }
 
 size_t IndexCluster::size() { return this->index_blocks.size(); }
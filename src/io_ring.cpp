@@ -0,0 +1,218 @@
+#include "io_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IoRing::IoRing(int file, unsigned depth)
+    : file(file), depth(depth), ring_fd(-1), sq_ptr(MAP_FAILED),
+      cq_ptr(MAP_FAILED), sqes_ptr(MAP_FAILED), staging(nullptr),
+      n_ring_reads(0), n_pread_reads(0) {
+    if (!setup())
+        teardown();
+}
+
+IoRing::~IoRing() { teardown(); }
+
+bool IoRing::available() const { return ring_fd >= 0; }
+
+IoRingStats IoRing::stats() const {
+    return {.n_ring_reads = n_ring_reads.load(),
+            .n_pread_reads = n_pread_reads.load()};
+}
+
+bool IoRing::setup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = io_uring_setup(depth, &p);
+    if (ring_fd < 0)
+        return false;
+    depth = p.sq_entries;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = std::max(sq_size, cq_size);
+
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return false;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return false;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED)
+        return false;
+
+    auto sq = static_cast<char*>(sq_ptr);
+    sq_tail = reinterpret_cast<uint32_t*>(sq + p.sq_off.tail);
+    sq_mask = *reinterpret_cast<uint32_t*>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<uint32_t*>(sq + p.sq_off.array);
+    auto cq = static_cast<char*>(cq_ptr);
+    cq_head = reinterpret_cast<uint32_t*>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<uint32_t*>(cq + p.cq_off.tail);
+    cq_mask = *reinterpret_cast<uint32_t*>(cq + p.cq_off.ring_mask);
+    cqes = cq + p.cq_off.cqes;
+
+    // the file and the staging buffer are registered once, so the kernel
+    // does not have to look them up and pin pages on every read.
+    if (io_uring_register(ring_fd, IORING_REGISTER_FILES, &file, 1) < 0)
+        return false;
+
+    auto staging_size = size_t(depth) * IO_RING_MAX_READ;
+    staging = static_cast<char*>(aligned_alloc(4096, staging_size));
+    if (!staging)
+        return false;
+    struct iovec iov = {.iov_base = staging, .iov_len = staging_size};
+    if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+        return false;
+
+    return true;
+}
+
+void IoRing::teardown() {
+    if (sqes_ptr != MAP_FAILED)
+        munmap(sqes_ptr, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+    sq_ptr = cq_ptr = sqes_ptr = MAP_FAILED;
+
+    // closing the ring also drops the registered file and buffer.
+    if (ring_fd >= 0)
+        close(ring_fd);
+    ring_fd = -1;
+
+    free(staging);
+    staging = nullptr;
+}
+
+void IoRing::read(IoRingRead* reads, size_t n, bool wait) {
+    if (!available()) {
+        read_pread(reads, n);
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(mutex, std::defer_lock);
+    if (wait) {
+        guard.lock();
+    } else if (!guard.try_lock()) {
+        read_pread(reads, n);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i += depth) {
+        auto batch = std::min<size_t>(depth, n - i);
+        if (!submit_and_wait(reads + i, batch))
+            read_pread(reads + i, batch);
+    }
+}
+
+void IoRing::read_pread(IoRingRead* reads, size_t n) {
+    n_pread_reads += n;
+    for (size_t i = 0; i < n; i++) {
+        auto n_bytes =
+            pread(file, reads[i].buffer, reads[i].len, reads[i].offset);
+        reads[i].result = n_bytes < 0 ? -errno : n_bytes;
+    }
+}
+
+bool IoRing::submit_and_wait(IoRingRead* reads, size_t n) {
+    auto sqes = static_cast<struct io_uring_sqe*>(sqes_ptr);
+
+    // only this thread produces submissions, the tail is ours.
+    auto tail = std::atomic_ref<uint32_t>(*sq_tail).load(
+        std::memory_order_relaxed);
+    for (size_t i = 0; i < n; i++) {
+        if (reads[i].len > IO_RING_MAX_READ)
+            return false;
+
+        auto index = (tail + i) & sq_mask;
+        auto sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE;
+        // index into the registered files.
+        sqe->fd = 0;
+        sqe->off = reads[i].offset;
+        sqe->addr = reinterpret_cast<uint64_t>(staging + i * IO_RING_MAX_READ);
+        sqe->len = reads[i].len;
+        sqe->buf_index = 0;
+        sqe->user_data = i;
+        sq_array[index] = index;
+    }
+    std::atomic_ref<uint32_t>(*sq_tail).store(tail + n,
+                                              std::memory_order_release);
+
+    size_t to_submit = n, completed = 0;
+    while (completed < n) {
+        auto ret = io_uring_enter(ring_fd, to_submit, n - completed,
+                                  IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            // nothing was submitted, the entries are taken back.
+            if (to_submit == n && completed == 0) {
+                std::atomic_ref<uint32_t>(*sq_tail).store(
+                    tail, std::memory_order_release);
+                return false;
+            }
+            // some reads are in flight and their buffers are still in use,
+            // there is no way to recover the ring.
+            throw std::runtime_error("io_uring_enter failed");
+        }
+        to_submit -= std::min<size_t>(ret, to_submit);
+
+        auto head = std::atomic_ref<uint32_t>(*cq_head).load(
+            std::memory_order_relaxed);
+        auto ctail = std::atomic_ref<uint32_t>(*cq_tail).load(
+            std::memory_order_acquire);
+        for (; head != ctail; head++) {
+            auto cqe =
+                static_cast<struct io_uring_cqe*>(cqes) + (head & cq_mask);
+            auto i = cqe->user_data;
+            reads[i].result = cqe->res;
+            if (cqe->res > 0)
+                memcpy(reads[i].buffer, staging + i * IO_RING_MAX_READ,
+                       cqe->res);
+            completed++;
+        }
+        std::atomic_ref<uint32_t>(*cq_head).store(head,
+                                                  std::memory_order_release);
+    }
+
+    n_ring_reads += n;
+    return true;
+}
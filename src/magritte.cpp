@@ -1,13 +1,31 @@
 #include "magritte.h"
 #include "magritte_impl.h"
+#include <algorithm>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <utility>
 
+typedef struct {
+    int m_no;
+    MagritteScanCursor cursor;
+    std::vector<std::pair<MagritteKey, MagritteValue>> batch;
+    size_t pos;
+    // held while the batch is read or refilled.
+    std::mutex mutex;
+} MagritteIter;
+
 std::unordered_map<uint, Magritte> instances;
 std::atomic<uint> couter;
 std::string last_error_str;
 
+// an iterator closed while another thread reads it is freed once that thread
+// lets go of it.
+std::unordered_map<int, std::shared_ptr<MagritteIter>> iters;
+std::mutex iters_mutex;
+std::atomic<int> iter_couter;
+
 int magritte_init(const char* filepath) {
     auto index = couter.fetch_add(1);
     instances.emplace(std::make_pair(index, Magritte(filepath, nullptr)));
@@ -15,33 +33,91 @@ int magritte_init(const char* filepath) {
 }
 
 bool magritte_put(int m_no, int32_t key, char* value, int len) {
-    if (len > 1024) {
+    if (len < 0) {
+        last_error_str = "Invalid value length";
+        return false;
+    }
+    if (uint32_t(len) > BLOCK_MAX_VALUE_SIZE) {
         last_error_str = "Value too long";
         return false;
     }
 
-    std::vector<char> v;
-    v.reserve(len);
-    memcpy(v.data(), value, len);
-
-    return instances.at(m_no).put(key, v);
+    return instances.at(m_no).put(key, std::span<const char>(value, len));
 }
 
 bool magritte_get(int m_no, int32_t key, char* value, int* len) {
-    std::vector<char> v;
-    if (!instances.at(m_no).get(key, v)) {
+    if (*len < 0) {
+        last_error_str = "Invalid buffer length";
+        return false;
+    }
+
+    auto n = instances.at(m_no).get_into(key, std::span<char>(value, *len));
+    if (n < 0) {
         last_error_str = "Key not found";
         return false;
     }
-    if (v.size() > *len) {
+    if (n > *len) {
         last_error_str = "Buffer too small";
         return false;
     }
-    memcpy(value, v.data(), v.size());
-    *len = v.size();
+    *len = n;
     return true;
 }
 
+// values[i] is a buffer of lens[i] bytes, on return lens[i] is the length of
+// the value of keys[i], or -1 if the key is not found. returns the number of
+// keys found, or -1 if a length is negative or a buffer is too small.
+int magritte_mget(int m_no, int n, int32_t* keys, char** values, int* lens) {
+    if (n < 0 || std::any_of(lens, lens + n, [](int len) { return len < 0; })) {
+        last_error_str = "Invalid buffer length";
+        return -1;
+    }
+
+    std::vector<MagritteKey> k(keys, keys + n);
+    std::vector<MagritteValue> v;
+    std::vector<bool> found;
+    instances.at(m_no).multi_get(k, v, found);
+
+    auto n_found = 0;
+    for (int i = 0; i < n; i++) {
+        if (!found[i]) {
+            lens[i] = -1;
+            continue;
+        }
+        if (int64_t(v[i].size()) > lens[i]) {
+            last_error_str = "Buffer too small";
+            return -1;
+        }
+        memcpy(values[i], v[i].data(), v[i].size());
+        lens[i] = v[i].size();
+        n_found++;
+    }
+    return n_found;
+}
+
+bool magritte_mput(int m_no, int n, int32_t* keys, char** values, int* lens) {
+    if (n < 0) {
+        last_error_str = "Invalid batch size";
+        return false;
+    }
+
+    std::vector<MagritteKey> k(keys, keys + n);
+    std::vector<MagritteValue> v(n);
+    for (int i = 0; i < n; i++) {
+        if (lens[i] < 0) {
+            last_error_str = "Invalid value length";
+            return false;
+        }
+        if (uint32_t(lens[i]) > BLOCK_MAX_VALUE_SIZE) {
+            last_error_str = "Value too long";
+            return false;
+        }
+        v[i].assign(values[i], values[i] + lens[i]);
+    }
+
+    return instances.at(m_no).multi_put(k, std::move(v));
+}
+
 bool magritte_probe(int m_no, int32_t key) {
     return instances.at(m_no).probe(key);
 }
@@ -52,7 +128,7 @@ bool magritte_remove(int m_no, int32_t key, char* value, int* len) {
         last_error_str = "Key not found";
         return false;
     }
-    if (v.size() > *len) {
+    if (int64_t(v.size()) > *len) {
         last_error_str = "Buffer too small";
         return false;
     }
@@ -61,12 +137,98 @@ bool magritte_remove(int m_no, int32_t key, char* value, int* len) {
     return true;
 }
 
+bool magritte_cache_stats(int m_no, uint64_t* hits, uint64_t* misses,
+                          uint64_t* admitted, uint64_t* rejected) {
+    if (!instances.contains(m_no)) {
+        last_error_str = "Instance not found";
+        return false;
+    }
+
+    auto stats = instances.at(m_no).cache_stats();
+    *hits = stats.hits;
+    *misses = stats.misses;
+    *admitted = stats.admitted;
+    *rejected = stats.rejected;
+    return true;
+}
+
+// memory the read and write caches may take in bytes, 0 turns a cache off.
+bool magritte_set_cache_budget(int m_no, uint64_t read_bytes,
+                               uint64_t write_bytes) {
+    if (!instances.contains(m_no)) {
+        last_error_str = "Instance not found";
+        return false;
+    }
+
+    instances.at(m_no).set_cache_budget(read_bytes, write_bytes);
+    return true;
+}
+
 bool magritte_shutdown(int m_no) {
     instances.at(m_no).shutdown();
     instances.erase(m_no);
     return true;
 }
 
+int magritte_iter_open(int m_no, int32_t from, int32_t to) {
+    if (!instances.contains(m_no)) {
+        last_error_str = "Instance not found";
+        return -1;
+    }
+
+    auto iter = iter_couter.fetch_add(1);
+    MagritteScanCursor cursor = {.next = from, .to = to, .done = from > to};
+
+    auto it = std::make_shared<MagritteIter>();
+    it->m_no = m_no;
+    it->cursor = cursor;
+    it->pos = 0;
+
+    std::scoped_lock<std::mutex> lock(iters_mutex);
+    iters.emplace(iter, std::move(it));
+    return iter;
+}
+
+bool magritte_iter_next(int iter, int32_t* key, char* value, int* len) {
+    std::shared_ptr<MagritteIter> it;
+    {
+        std::scoped_lock<std::mutex> lock(iters_mutex);
+        auto found = iters.find(iter);
+        if (found == iters.end()) {
+            last_error_str = "Iterator not found";
+            return false;
+        }
+        it = found->second;
+    }
+    std::scoped_lock<std::mutex> lock(it->mutex);
+
+    if (it->pos == it->batch.size()) {
+        it->batch.clear();
+        it->pos = 0;
+        if (!instances.at(it->m_no).scan_batch(it->cursor, MAGRITTE_SCAN_BATCH,
+                                               it->batch)) {
+            last_error_str = "End of iteration";
+            return false;
+        }
+    }
+
+    auto& [k, v] = it->batch[it->pos];
+    if (int64_t(v.size()) > *len) {
+        last_error_str = "Buffer too small";
+        return false;
+    }
+    *key = k;
+    memcpy(value, v.data(), v.size());
+    *len = v.size();
+    it->pos++;
+    return true;
+}
+
+bool magritte_iter_close(int iter) {
+    std::scoped_lock<std::mutex> lock(iters_mutex);
+    return iters.erase(iter) == 1;
+}
+
 bool last_error(char* error) {
     if (last_error_str.size() == 0) {
         return false;
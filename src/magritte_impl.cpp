@@ -2,7 +2,9 @@
 #include "Block.h"
 #include "job_conter.h"
 #include "magritte_typedefs.h"
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
@@ -10,17 +12,44 @@
 #include <stdexcept>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 
+static uint64_t or_default(uint64_t bytes, uint64_t default_bytes) {
+    return bytes ? bytes : default_bytes;
+}
+
 Magritte::Magritte(std::string filepath, MagritteConfig* config)
-    : filepath(filepath), indicies(0, 0, 0), r_cache(1024 * 3),
-      w_cache(1024 * 1) {
+    : filepath(filepath),
+      r_cache(or_default(config ? config->read_cache_bytes : 0,
+                         MAGRITTE_READ_CACHE_BYTES),
+              config && config->cache_policy == TinyLfu),
+      w_cache(or_default(config ? config->write_cache_bytes : 0,
+                         MAGRITTE_WRITE_CACHE_BYTES)) {
     if (filepath.empty()) {
         throw std::runtime_error("expect filepath, got empty string");
     }
 
+    // record config, n_read_cache and n_write_buffer_per_block take no
+    // effect.
+    if (config) {
+        this->config = *config;
+    } else {
+        this->config = MagritteConfig{
+            .n_read_cache = 1024,
+            .n_write_buffer_per_block = 32,
+            .millisec_flush_timeout = 500,
+            .index_type = MagritteIndexType::Cluster,
+            .io_backend = MagritteIoBackend::Pread,
+            .cache_policy = MagritteCachePolicy::Clock,
+            .read_cache_bytes = MAGRITTE_READ_CACHE_BYTES,
+            .write_cache_bytes = MAGRITTE_WRITE_CACHE_BYTES,
+            .durability = MagritteDurability::NoLog,
+        };
+    }
+
     // probe file exists and record its size.
-    uint32_t fsize;
+    int64_t fsize;
     if (access(filepath.c_str(), F_OK) == 0) {
         struct stat st;
         if (stat(filepath.c_str(), &st) != 0) {
@@ -41,20 +70,48 @@ Magritte::Magritte(std::string filepath, MagritteConfig* config)
         throw std::runtime_error(message);
     }
 
+    // the index lives in `<file>.idx`, at offsets that do not move when
+    // blocks are added. an index or log left by an earlier store of a new
+    // file does not belong to it.
+    auto new_store = fsize <= int64_t(sizeof(MagritteMeta));
+    auto index_path = filepath + ".idx";
+    auto wal_path = filepath + ".wal";
+    if (new_store)
+        unlink(wal_path.c_str());
+    this->index_file = open(index_path.c_str(),
+                            O_CREAT | O_RDWR | (new_store ? O_TRUNC : 0),
+                            S_IRUSR | S_IWUSR);
+    if (this->index_file < 0) {
+        std::string message = "Failed to open index at " + index_path + ": ";
+        message += std::strerror(errno);
+        throw std::runtime_error(message);
+    }
+
     // read metadata or create new one.
-    if (fsize > sizeof(MagritteMeta)) {
+    if (!new_store) {
         if (read(this->file, &this->meta, sizeof(MagritteMeta)) !=
             sizeof(MagritteMeta)) {
             std::string message = "Failed to read metadata from " + filepath;
             message += std::strerror(errno);
             throw std::runtime_error(message);
         }
+        if (this->meta.version_major != MAGRITTE_VERSION_MAJOR ||
+            this->meta.version_minor != MAGRITTE_VERSION_MINOR)
+            throw std::runtime_error(
+                "Unsupported file format version " +
+                std::to_string(this->meta.version_major) + "." +
+                std::to_string(this->meta.version_minor) + " in " + filepath +
+                ", expected " + std::to_string(MAGRITTE_VERSION_MAJOR) + "." +
+                std::to_string(MAGRITTE_VERSION_MINOR) +
+                ", the store has to be rebuilt");
     } else {
         this->meta = {
-            .version_major = 0,
-            .version_minor = 1,
-            .version_patch = 0,
+            .version_major = MAGRITTE_VERSION_MAJOR,
+            .version_minor = MAGRITTE_VERSION_MINOR,
+            .version_patch = MAGRITTE_VERSION_PATCH,
+            .index_type = this->config.index_type,
             .n_blocks = 0,
+            .n_index_blocks = 0,
             .n_stored_items = 0,
             .extras = 0,
         };
@@ -65,63 +122,96 @@ Magritte::Magritte(std::string filepath, MagritteConfig* config)
         }
     }
 
-    // prepare n_blocks recorded in metadata, load bitmap accordingly.
-    for (uint32_t i = 0; i < this->meta.n_blocks; ++i) {
-        auto offset = sizeof(MagritteMeta) + i * BLOCK_SIZE;
-        auto file_for_block = open(filepath.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
-
-        std::vector<unsigned char> buffer(BITMAP_SIZE);
-        auto read_size =
-            pread(file_for_block, buffer.data(), BITMAP_SIZE, offset);
-        if (read_size != BITMAP_SIZE)
-            throw std::runtime_error("Failed to read bitmap from file");
+    this->flush_scheduler = std::make_unique<FlushScheduler>(
+        this->config.millisec_flush_timeout);
 
-        auto bmp = BitMap::LoadExisting(std::move(buffer));
-        this->blocks.emplace_back(file_for_block, offset, std::move(bmp));
+    if (this->config.io_backend == IoUring) {
+        for (size_t i = 0; i < MAGRITTE_IO_RINGS; i++)
+            this->rings.push_back(std::make_unique<IoRing>(this->file));
+        if (!this->rings[0]->available())
+            std::cerr << "io_uring is unavailable, " << filepath
+                      << " is read with pread" << std::endl;
     }
 
-    // create the first block
-    if (this->meta.n_blocks == 0) {
-        auto file = open(this->filepath.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
-        auto offset = sizeof(MagritteMeta) + BLOCK_SIZE;
-        this->indicies.set_offset(sizeof(MagritteMeta) +
-                                  (this->blocks.size() + 1) * BLOCK_SIZE);
-        auto& block = this->blocks.emplace_back(file, offset);
+    if (this->meta.n_blocks > MAGRITTE_MAX_BLOCKS)
+        throw std::runtime_error("Too many blocks in " + filepath);
+    this->blocks.reserve(MAGRITTE_MAX_BLOCKS);
 
-        this->meta.n_blocks = 1;
+    // prepare n_blocks recorded in metadata, each starts with its slot size,
+    // which tells where the next one is.
+    this->blocks_end = sizeof(MagritteMeta);
+    for (uint32_t i = 0; i < this->meta.n_blocks; ++i) {
+        auto file_for_block = open(filepath.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+        auto offset = this->blocks_end;
+        auto slot_size = Block::read_slot_size(file_for_block, offset);
+
+        auto& block = this->blocks.emplace_back(
+            file_for_block, offset, slot_size,
+            Block::read_bitmap(file_for_block, offset),
+            this->config.io_backend, this->flush_scheduler.get(),
+            this->ring_for(i));
+        if (i == MAGRITTE_MAX_BLOCKS - 1)
+            block.reserve(MAGRITTE_RESERVED_SLOT);
+        if (block.vacant())
+            this->directories[slot_class_for(slot_size -
+                                             BLOCK_SLOT_HEADER_SIZE)]
+                .mark_free(i);
+        this->blocks_end += block_size(slot_size);
     }
 
-    // load indicies
-    this->indicies = std::move(IndexCluster(
-        this->file, sizeof(MagritteMeta) + this->meta.n_blocks * BLOCK_SIZE,
-        this->meta.n_index_blocks));
-
-    // record config, for now it doesn't take any effect :)
-    if (config) {
-        this->config = *config;
-    } else {
-        this->config = MagritteConfig{
-            .n_read_cache = 1024,
-            .n_write_buffer_per_block = 32,
-            .millisec_flush_timeout = 500,
-        };
+    this->indicies = load_index(this->meta.index_type, this->index_file, 0,
+                                this->meta.n_index_blocks);
+
+    // changes logged since the last checkpoint are redone before the log is
+    // set, so they are not logged again. a log left by a run with
+    // durability is still replayed without it.
+    if (this->config.durability != NoLog ||
+        access(wal_path.c_str(), F_OK) == 0) {
+        auto wal = std::make_unique<WriteAheadLog>(wal_path,
+                                                   this->config.durability);
+        auto n_records = wal->replay(
+            [this](const WalRecordHeader& header, std::span<const char> value) {
+                this->redo(header, value);
+            });
+        if (n_records > 0)
+            this->persist();
+        wal->reset();
+
+        if (this->config.durability == NoLog) {
+            wal.reset();
+            unlink(wal_path.c_str());
+        } else {
+            this->wal = std::move(wal);
+        }
     }
+
+    this->start_index_checkpointer();
 }
 
 Magritte::Magritte(Magritte&& other)
-    : counter(), w_cache(1024), r_cache(1024 * 3), indicies(0, 0, 0) {
+    : counter(), r_cache(0, false), w_cache(0) {
     other.shutdown_ = true;
     other.counter.wait_zero();
+    other.stop_index_checkpointer();
 
     file = other.file;
+    other.file = -1;
+    index_file = other.index_file;
+    other.index_file = -1;
     config = std::move(other.config);
     filepath = std::move(other.filepath);
     meta = std::move(other.meta);
+    flush_scheduler = std::move(other.flush_scheduler);
+    rings = std::move(other.rings);
     blocks = std::move(other.blocks);
+    blocks_end = other.blocks_end;
+    directories = other.directories;
     w_cache = std::move(other.w_cache);
     r_cache = std::move(other.r_cache);
     indicies = std::move(other.indicies);
+    wal = std::move(other.wal);
     shutdown_ = false;
+    this->start_index_checkpointer();
 }
 
 bool Magritte::get(MagritteKey key, std::vector<char>& value) {
@@ -135,7 +225,7 @@ bool Magritte::get(MagritteKey key, std::vector<char>& value) {
         return true;
 
     MagritteIndex index = 0;
-    if (!this->indicies.get(key, index)) {
+    if (!this->indicies->get(key, index)) {
         std::cerr << "get(" << key << ") failed: index record not found"
                   << std::endl;
         return false;
@@ -156,48 +246,377 @@ bool Magritte::get(MagritteKey key, std::vector<char>& value) {
     return true;
 }
 
+// copies the value straight from the cache or block into `out`, the read
+// cache is filled from `out` on a miss.
+int64_t Magritte::get_into(MagritteKey key, std::span<char> out) {
+    if (this->shutdown_)
+        return -1;
+    scoped_couter cntr(this->counter);
+
+    int64_t n = -1;
+    auto copy_out = [&n, out](const MagritteValue& value) {
+        n = value.size();
+        if (value.size() <= out.size())
+            memcpy(out.data(), value.data(), value.size());
+    };
+    if (this->r_cache.get_with(key, copy_out))
+        return n;
+    if (this->w_cache.get_with(key, copy_out))
+        return n;
+
+    MagritteIndex index = 0;
+    if (!this->indicies->get(key, index)) {
+        std::cerr << "get(" << key << ") failed: index record not found"
+                  << std::endl;
+        return -1;
+    }
+
+    auto [block_index, in_block_index] = get_block_index(index);
+    if (block_index >= this->blocks.size()) {
+        std::cerr << "get() failed: block not found" << std::endl;
+        return -1;
+    }
+
+    n = this->blocks[block_index].get_into(in_block_index, out);
+    if (size_t(n) <= out.size())
+        this->r_cache.put(key, MagritteValue(out.begin(), out.begin() + n));
+
+    return n;
+}
+
+bool Magritte::get_view(MagritteKey key, BlockView& view) {
+    if (this->shutdown_)
+        return false;
+    scoped_couter cntr(this->counter);
+
+    MagritteIndex index = 0;
+    if (!this->indicies->get(key, index))
+        return false;
+
+    auto [block_index, in_block_index] = get_block_index(index);
+    if (block_index >= this->blocks.size())
+        return false;
+
+    this->blocks[block_index].get_view(in_block_index, view);
+    return true;
+}
+
 bool Magritte::probe(MagritteKey key) {
     if (this->shutdown_)
         return false;
     scoped_couter cntr(this->counter);
 
     MagritteIndex index;
-    return this->indicies.get(key, index);
+    return this->indicies->get(key, index);
 }
 
-bool Magritte::flush_meta() {
+bool Magritte::scan(MagritteKey from, MagritteKey to,
+                    std::function<bool(MagritteKey, MagritteValue&)> callback) {
+    MagritteScanCursor cursor = {.next = from, .to = to, .done = from > to};
+    std::vector<std::pair<MagritteKey, MagritteValue>> batch;
+
+    while (this->scan_batch(cursor, MAGRITTE_SCAN_BATCH, batch)) {
+        for (auto& [key, value] : batch) {
+            if (!callback(key, value))
+                return true;
+        }
+        batch.clear();
+    }
+
+    return !this->shutdown_;
+}
+
+bool Magritte::scan_batch(
+    MagritteScanCursor& cursor, size_t limit,
+    std::vector<std::pair<MagritteKey, MagritteValue>>& out) {
+    if (this->shutdown_ || cursor.done)
+        return false;
     scoped_couter cntr(this->counter);
 
-    return pwrite(this->file, &this->meta, sizeof(MagritteMeta), 0) ==
-           sizeof(MagritteMeta);
+    std::vector<MagritteKeyIndexPair> pairs;
+    this->indicies->range(cursor.next, cursor.to, limit, pairs);
+
+    if (pairs.empty() || pairs.size() < limit || pairs.back().key >= cursor.to)
+        cursor.done = true;
+    else
+        cursor.next = pairs.back().key + 1;
+
+    std::vector<MagritteIndex> indices(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++)
+        indices[i] = pairs[i].index;
+
+    std::vector<MagritteValue> values;
+    this->read_indices(indices, std::vector<bool>(pairs.size(), true), values);
+
+    auto first = out.size();
+    for (size_t i = 0; i < pairs.size(); i++)
+        out.emplace_back(pairs[i].key, std::move(values[i]));
+
+    return out.size() > first;
 }
 
-std::pair<Block*, int> Magritte::allocate_block(int expect_size) {
+// reads the values at indices[i] where found[i] is set, in the order of their
+// position in the file, one batch per block.
+void Magritte::read_indices(const std::vector<MagritteIndex>& indices,
+                            const std::vector<bool>& found,
+                            std::vector<MagritteValue>& values) {
+    values.resize(indices.size());
+
+    std::vector<size_t> order;
+    order.reserve(indices.size());
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (found[i])
+            order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&indices](size_t a, size_t b) {
+        return indices[a] < indices[b];
+    });
+
+    std::vector<MagritteInBlockIndex> slots;
+    std::vector<MagritteValue> block_values;
+    for (size_t i = 0; i < order.size();) {
+        auto block_index = get_block_index(indices[order[i]]).first;
+
+        size_t j = i;
+        slots.clear();
+        for (; j < order.size() &&
+               get_block_index(indices[order[j]]).first == block_index;
+             j++)
+            slots.push_back(get_block_index(indices[order[j]]).second);
+
+        if (block_index < this->blocks.size()) {
+            this->blocks[block_index].get_batch(slots, block_values);
+            for (size_t k = i; k < j; k++)
+                values[order[k]] = std::move(block_values[k - i]);
+        }
+        i = j;
+    }
+}
+
+// batched reads skip the caches, blocks overlay their pending writes so the
+// values read are always current.
+void Magritte::multi_get(const std::vector<MagritteKey>& keys,
+                         std::vector<MagritteValue>& values,
+                         std::vector<bool>& found) {
+    values.clear();
+    found.assign(keys.size(), false);
+    if (this->shutdown_)
+        return;
     scoped_couter cntr(this->counter);
 
-    allocation_lock.lock();
+    std::vector<MagritteIndex> indices;
+    this->indicies->multi_get(keys, indices, found);
+    this->read_indices(indices, found, values);
+}
+
+bool Magritte::multi_put(const std::vector<MagritteKey>& keys,
+                         std::vector<MagritteValue> values) {
+    if (this->shutdown_ || keys.size() != values.size())
+        return false;
+    scoped_couter cntr(this->counter);
+
+    // the locks of the batch are taken in address order, so batches sharing
+    // some of them never wait for each other in a cycle.
+    std::vector<rw_spin_lock*> locks;
+    for (auto key : keys)
+        locks.push_back(&this->key_lock(key));
+    std::sort(locks.begin(), locks.end());
+    locks.erase(std::unique(locks.begin(), locks.end()), locks.end());
+
+    uint64_t position = 0;
+    this->checkpoint_lock.lock_shared();
+    for (auto lock : locks)
+        lock->lock();
+    auto success = this->multi_put_locked(keys, values, position);
+    for (auto lock : locks)
+        lock->unlock();
+    this->checkpoint_lock.unlock_shared();
+    return success && this->commit(position);
+}
 
-    if (expect_size < blocks.size()) {
-        // already allocated at another thread
-        auto block = &(*this->blocks.end());
-        auto i = this->blocks.size() - 1;
+// logged like put(), the whole batch shares a commit.
+bool Magritte::multi_put_locked(const std::vector<MagritteKey>& keys,
+                                std::vector<MagritteValue>& values,
+                                uint64_t& position) {
+    // only the last value of a repeated key is kept.
+    std::unordered_map<MagritteKey, size_t> last;
+    for (size_t i = 0; i < keys.size(); i++) {
+        last[keys[i]] = i;
+        if (slot_class_for(values[i].size()) == -1) {
+            std::cerr << "multi_put() failed: value of " << keys[i]
+                      << " too large" << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<MagritteIndex> indices;
+    std::vector<bool> found;
+    this->indicies->multi_get(keys, indices, found);
+
+    // existing keys of the same size class are updated in place, grouped by
+    // block. new keys and those changing class are grouped by class.
+    struct Inserts {
+        std::vector<MagritteKey> keys;
+        std::vector<MagritteValue> values;
+        std::vector<MagritteIndex> old_indices;
+        std::vector<std::vector<char>> records;
+    };
+    std::unordered_map<uint16_t, std::pair<std::vector<MagritteInBlockIndex>,
+                                           std::vector<MagritteValue>>>
+        updates;
+    std::vector<std::pair<std::vector<char>, MagritteIndex>> update_records;
+    std::array<Inserts, BLOCK_N_SLOT_SIZES> inserts;
+    std::vector<MagritteIndex> moved;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (last[keys[i]] != i)
+            continue;
+
+        std::vector<char> record;
+        if (this->wal)
+            record = WriteAheadLog::encode(WalPut, keys[i], values[i]);
+
+        auto size_class = slot_class_for(values[i].size());
+        auto old_index = WAL_NO_INDEX;
+        if (found[i]) {
+            auto [block_index, in_block_index] = get_block_index(indices[i]);
+            this->r_cache.remove(keys[i]);
+            this->w_cache.put(keys[i], values[i]);
+            auto& block = this->blocks[block_index];
+            if (block.slot_size() == BLOCK_SLOT_SIZES[size_class] &&
+                block.same_slots(in_block_index, values[i].size())) {
+                updates[block_index].first.push_back(in_block_index);
+                updates[block_index].second.push_back(std::move(values[i]));
+                if (this->wal)
+                    update_records.emplace_back(std::move(record), indices[i]);
+                continue;
+            }
+            moved.push_back(indices[i]);
+            old_index = indices[i];
+        }
+
+        auto& insert = inserts[size_class];
+        insert.keys.push_back(keys[i]);
+        insert.values.push_back(std::move(values[i]));
+        insert.old_indices.push_back(old_index);
+        if (this->wal)
+            insert.records.push_back(std::move(record));
+    }
+
+    for (auto& [block_index, update] : updates)
+        this->blocks[block_index].update_batch(update.second, update.first);
+    for (auto& [record, index] : update_records)
+        position = this->wal->append(record, index);
+
+    // new keys go to the fill block of their class, like put.
+    std::vector<MagritteKeyIndexPair> pairs;
+    std::vector<MagritteInBlockIndex> slots;
+    for (size_t size_class = 0; size_class < inserts.size(); size_class++) {
+        auto& insert = inserts[size_class];
+        size_t placed = 0;
+        Block* failed = nullptr;
+        while (placed < insert.values.size()) {
+            auto [block, i] = this->vacant_block(size_class, failed);
+            if (!block) {
+                std::cerr << "multi_put() failed: no block left" << std::endl;
+                return false;
+            }
+
+            slots.clear();
+            auto n = block->put_batch(insert.values, placed, slots);
+            for (size_t j = 0; j < n; j++) {
+                MagritteIndex index = slots[j] + (MagritteIndex(i) << 20);
+                pairs.push_back({insert.keys[placed + j], index});
+                if (this->wal)
+                    position =
+                        this->wal->append(insert.records[placed + j], index,
+                                          insert.old_indices[placed + j]);
+            }
+            placed += n;
+            failed = n == 0 ? block : nullptr;
+        }
+    }
+
+    this->indicies->multi_put(pairs);
+    // the old slots of moved keys are only freed once nothing points there.
+    for (auto index : moved)
+        this->free_slot(index);
+    return true;
+}
+
+// the meta counts only the index blocks on disk, it is updated once they are
+// written.
+bool Magritte::flush_index() {
+    scoped_couter cntr(this->counter);
+
+    auto n_blocks = this->indicies->size();
+    auto success = this->indicies->flush(FlushReason::Manually);
+    this->meta.n_index_blocks = n_blocks;
+    return success;
+}
+
+bool Magritte::flush_meta() {
+    scoped_couter cntr(this->counter);
+
+    return pwrite(this->file, &this->meta, sizeof(MagritteMeta), 0) ==
+           sizeof(MagritteMeta);
+}
+
+// moves on once the fill block of the class is full, to the lowest block of
+// the class that regained slots or else a new one.
+std::pair<Block*, int> Magritte::vacant_block(int size_class,
+                                              const Block* failed) {
+    auto& directory = this->directories[size_class];
+    auto usable = [this, failed](uint32_t n) {
+        return &this->blocks[n] != failed && this->blocks[n].vacant();
+    };
+    for (;;) {
+        // a fill block is set only once the block is in place.
+        auto i = directory.fill();
+        if (i != MAGRITTE_MAX_BLOCKS && usable(i))
+            return std::make_pair(&this->blocks[i], i);
+
+        allocation_lock.lock();
+        if (directory.fill() == i) {
+            auto next = directory.take_free([this, &usable](uint32_t n) {
+                return n < this->blocks.size() && usable(n);
+            });
+            if (next == -1)
+                next = this->allocate_block(size_class).second;
+            if (next == -1) {
+                allocation_lock.unlock();
+                return std::make_pair(nullptr, -1);
+            }
+            directory.set_fill(next);
+        }
         allocation_lock.unlock();
-        return std::make_pair(block, i);
     }
+}
+
+std::pair<Block*, int> Magritte::allocate_block(int size_class) {
+    scoped_couter cntr(this->counter);
+
+    if (this->blocks.size() >= MAGRITTE_MAX_BLOCKS)
+        return std::make_pair(nullptr, -1);
 
     auto file = open(this->filepath.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
-    auto offset = sizeof(MagritteMeta) + this->blocks.size() * BLOCK_SIZE;
-    this->indicies.set_offset(sizeof(MagritteMeta) +
-                              (this->blocks.size() + 1) * BLOCK_SIZE);
-    auto block = &this->blocks.emplace_back(file, offset);
-    auto i = this->blocks.size() - 1;
+    auto slot_size = BLOCK_SLOT_SIZES[size_class];
+    auto offset = this->blocks_end;
+    this->blocks_end += block_size(slot_size);
+    auto i = this->blocks.size();
+    auto block = &this->blocks.emplace_back(
+        file, offset, slot_size, this->config.io_backend,
+        this->flush_scheduler.get(), this->ring_for(i));
+    if (i == MAGRITTE_MAX_BLOCKS - 1)
+        block->reserve(MAGRITTE_RESERVED_SLOT);
 
     this->meta.n_blocks++;
     this->flush_meta();
+    if (this->wal) {
+        auto record = WriteAheadLog::encode(WalBlock, 0);
+        this->wal->append(record, i, slot_size);
+    }
 
     block->flush_sync();
-
-    allocation_lock.unlock();
     return std::make_pair(block, i);
 }
 
@@ -206,63 +625,104 @@ bool Magritte::put(MagritteKey key, std::vector<char> value) {
         return false;
     scoped_couter cntr(this->counter);
 
+    uint64_t position = 0;
+    auto& lock = this->key_lock(key);
+    this->checkpoint_lock.lock_shared();
+    lock.lock();
+    auto success = this->put_locked(key, std::move(value), position);
+    lock.unlock();
+    this->checkpoint_lock.unlock_shared();
+    return success && this->commit(position);
+}
+
+// a change is logged once its slots are claimed and before the slots it
+// frees are, so replaying the log claims and frees them in the same order.
+bool Magritte::put_locked(MagritteKey key, MagritteValue&& value,
+                          uint64_t& position) {
+    auto size_class = slot_class_for(value.size());
+    if (size_class == -1) {
+        std::cerr << "put(" << key << ") failed: value too large"
+                  << std::endl;
+        return false;
+    }
+
+    std::vector<char> record;
+    if (this->wal)
+        record = WriteAheadLog::encode(WalPut, key, value);
+
     MagritteIndex index = 0;
-    Block* block = nullptr;
 
     // update exsiting value
     auto update = false;
-    update = this->indicies.get(key, index);
+    update = this->indicies->get(key, index);
 
+    auto old_index = index;
     if (update) {
         auto [block_index, in_block_index] = get_block_index(index);
-        block = &this->blocks[block_index];
+        auto block = &this->blocks[block_index];
         this->r_cache.remove(key);
         this->w_cache.put(key, value);
-        auto success = block->update(value, in_block_index);
-        if (!success)
-            std::cerr << "put(" << key << ") failed: updating exsiting value"
-                      << std::endl;
-        return success;
-    }
-
-    // insert new value
-    auto i = 0;
-    auto curr_n_blocks = this->blocks.size();
-    for (; i < curr_n_blocks; i++) {
-        if (blocks[i].vacant()) {
-            block = &blocks[i];
-            break;
+
+        // a value of another size class moves to a block of that class, an
+        // extent of another length to a run of its length.
+        if (block->slot_size() == BLOCK_SLOT_SIZES[size_class] &&
+            block->same_slots(in_block_index, value.size())) {
+            auto success = block->update(std::move(value), in_block_index);
+            if (!success)
+                std::cerr << "put(" << key
+                          << ") failed: updating exsiting value" << std::endl;
+            else if (this->wal)
+                position = this->wal->append(record, index);
+            return success;
         }
     }
 
-    if (!block) {
-        std::cerr << "Allocating new block with i: " << i << std::endl;
-        auto allocation_result = this->allocate_block(curr_n_blocks);
-        block = allocation_result.first;
-        i = allocation_result.second;
+    if (!this->insert(std::move(value), size_class, index)) {
+        std::cerr << "put() failed: no block left" << std::endl;
+        return false;
     }
+    if (this->wal)
+        position = this->wal->append(record, index,
+                                     update ? old_index : WAL_NO_INDEX);
 
-    MagritteInBlockIndex in_block_index;
-    auto success = block->put(value, in_block_index);
-
-    if (!success) {
-        // allocate block and try again
-        auto allocation_result = this->allocate_block(curr_n_blocks);
-        block = allocation_result.first;
-        i = allocation_result.second;
+    auto success = this->indicies->put(key, index);
+    if (!success)
+        std::cerr << "put() failed: indicies put failed" << std::endl;
+    else if (update)
+        this->free_slot(old_index);
+    return success;
+}
 
-        success = block->put(value, in_block_index);
-        if (!success) {
-            std::cerr << "put() failed: block put failed" << std::endl;
+// put only fails if the block filled up meanwhile, or has no run left for
+// an extent, the block is passed over then.
+bool Magritte::insert(MagritteValue&& value, int size_class,
+                      MagritteIndex& index) {
+    MagritteInBlockIndex in_block_index;
+    Block* failed = nullptr;
+    for (;;) {
+        auto [block, i] = this->vacant_block(size_class, failed);
+        if (!block)
             return false;
+        if (block->put(std::move(value), in_block_index)) {
+            index = in_block_index + (MagritteIndex(i) << 20);
+            return true;
         }
+        failed = block;
     }
+}
 
-    index = in_block_index + (i << 20);
-    success = this->indicies.put(key, index);
-    if (!success)
-        std::cerr << "put() failed: indicies put failed" << std::endl;
-    return success;
+void Magritte::free_slot(MagritteIndex index) {
+    auto [block_index, in_block_index] = get_block_index(index);
+    auto& block = this->blocks[block_index];
+    block.remove(in_block_index);
+    auto size_class = slot_class_for(block.slot_size() -
+                                     BLOCK_SLOT_HEADER_SIZE);
+    this->directories[size_class].mark_free(block_index);
+}
+
+// the value is copied once into the vector that ends up in the block.
+bool Magritte::put(MagritteKey key, std::span<const char> value) {
+    return this->put(key, MagritteValue(value.begin(), value.end()));
 }
 
 bool Magritte::remove(MagritteKey key, std::vector<char>& value) {
@@ -270,28 +730,216 @@ bool Magritte::remove(MagritteKey key, std::vector<char>& value) {
         return false;
     scoped_couter cntr(this->counter);
 
+    uint64_t position = 0;
+    auto& lock = this->key_lock(key);
+    this->checkpoint_lock.lock_shared();
+    lock.lock();
+    auto success = this->remove_locked(key, value, position);
+    lock.unlock();
+    this->checkpoint_lock.unlock_shared();
+    return success && this->commit(position);
+}
+
+bool Magritte::remove_locked(MagritteKey key, std::vector<char>& value,
+                             uint64_t& position) {
     MagritteIndex index;
-    if (!this->indicies.remove(key, index))
+    if (!this->indicies->remove(key, index))
         return false;
 
     auto [block_index, in_block_index] = get_block_index(index);
-
-    auto& block = this->blocks[block_index];
-    value = block.get(in_block_index);
+    value = this->blocks[block_index].get(in_block_index);
+    if (this->wal) {
+        auto record = WriteAheadLog::encode(WalRemove, key);
+        position = this->wal->append(record, index);
+    }
 
     this->r_cache.remove(key);
     this->w_cache.remove(key);
 
-    block.remove(in_block_index);
+    this->free_slot(index);
 
     return true;
 }
 
+BlockFlushStats Magritte::flush_stats() {
+    BlockFlushStats total = {};
+    for (auto& block : this->blocks) {
+        auto stats = block.flush_stats();
+        total.n_flushes += stats.n_flushes;
+        total.n_slots += stats.n_slots;
+        total.n_bytes += stats.n_bytes;
+        total.n_syscalls += stats.n_syscalls;
+    }
+    return total;
+}
+
+IoRingStats Magritte::io_stats() {
+    IoRingStats total = {};
+    for (auto& ring : this->rings) {
+        auto stats = ring->stats();
+        total.n_ring_reads += stats.n_ring_reads;
+        total.n_pread_reads += stats.n_pread_reads;
+    }
+    return total;
+}
+
+CacheStats Magritte::cache_stats() {
+    auto stats = this->r_cache.stats();
+    auto w_stats = this->w_cache.stats();
+    // only lookups that missed the read cache go on to the write cache.
+    stats.hits += w_stats.hits;
+    stats.misses = w_stats.misses;
+    return stats;
+}
+
+void Magritte::set_cache_budget(uint64_t read_bytes, uint64_t write_bytes) {
+    this->config.read_cache_bytes = read_bytes;
+    this->config.write_cache_bytes = write_bytes;
+    this->r_cache.set_capacity(read_bytes);
+    this->w_cache.set_capacity(write_bytes);
+}
+
 void Magritte::shutdown() {
     this->shutdown_ = true;
-    this->flush_meta();
     this->counter.wait_zero();
+    this->stop_index_checkpointer();
+    if (this->file < 0)
+        return;
+
+    for (auto& block : this->blocks)
+        block.flush_sync();
+    this->flush_scheduler->shutdown();
+
+    // index uses the index file, release it before closing.
+    this->flush_index();
+    this->flush_meta();
+    // the store holds every change now, the log is not needed.
+    if (this->wal) {
+        fdatasync(this->index_file);
+        fdatasync(this->file);
+        this->wal->reset();
+        this->wal->shutdown();
+    }
+    this->indicies.reset();
+    close(this->index_file);
+    this->index_file = -1;
     close(this->file);
+    this->file = -1;
+}
+
+// records are redone in the order they were logged, so a slot freed by one
+// record and claimed by a later one ends up claimed. redoing a change the
+// store already has changes nothing.
+void Magritte::redo(const WalRecordHeader& header,
+                    std::span<const char> value) {
+    if (header.type == WalBlock) {
+        auto slot_class = slot_class_for(header.old_index -
+                                         BLOCK_SLOT_HEADER_SIZE);
+        if (header.index != this->blocks.size() || slot_class == -1)
+            return;
+        auto [block, i] = this->allocate_block(slot_class);
+        if (block)
+            this->directories[slot_class].mark_free(i);
+        return;
+    }
+
+    auto [block_index, in_block_index] = get_block_index(header.index);
+    if (block_index >= this->blocks.size())
+        return;
+
+    if (header.type == WalPut) {
+        this->blocks[block_index].restore(in_block_index,
+                                          MagritteValue(value.begin(),
+                                                        value.end()));
+        this->indicies->put(header.key, header.index);
+        if (header.old_index != WAL_NO_INDEX &&
+            get_block_index(header.old_index).first < this->blocks.size())
+            this->free_slot(header.old_index);
+    } else if (header.type == WalRemove) {
+        MagritteIndex index;
+        this->indicies->remove(header.key, index);
+        this->free_slot(header.index);
+    }
+}
+
+void Magritte::persist() {
+    for (auto& block : this->blocks)
+        block.flush_sync();
+    this->flush_index();
+    this->flush_meta();
+    fdatasync(this->index_file);
+    fdatasync(this->file);
+}
+
+void Magritte::checkpoint() {
+    scoped_couter cntr(this->counter);
+
+    this->checkpoint_lock.lock();
+    this->persist();
+    if (this->wal)
+        this->wal->reset();
+    this->checkpoint_lock.unlock();
+}
+
+bool Magritte::commit(uint64_t position) {
+    if (!this->wal)
+        return true;
+    if (!this->wal->commit(position)) {
+        std::cerr << "commit() failed: writing the log" << std::endl;
+        return false;
+    }
+    if (this->wal->size() >= WAL_CHECKPOINT_BYTES)
+        this->checkpoint();
+    return true;
+}
+
+// the log is synced before index blocks are written, so the index on disk
+// never points to a slot whose claim a crash could lose.
+void Magritte::start_index_checkpointer() {
+    if (this->shutdown_ || !this->indicies)
+        return;
+    this->indicies->set_flush_barrier(
+        [this] { return !this->wal || this->wal->flush(); });
+    this->index_checkpointer = std::thread(&Magritte::checkpoint_index, this);
+}
+
+void Magritte::stop_index_checkpointer() {
+    {
+        std::lock_guard<std::mutex> guard(this->checkpointer_mutex);
+    }
+    this->checkpointer_wake.notify_all();
+    if (this->index_checkpointer.joinable())
+        this->index_checkpointer.join();
+}
+
+// a checkpoint writes the whole index, a round holds checkpoint_lock shared
+// so an older copy of a block is never written after it. blocks counted
+// before the round are all on disk once it succeeds, and recorded in the
+// meta.
+void Magritte::checkpoint_index() {
+    auto interval = std::chrono::milliseconds(
+        std::max<uint32_t>(this->config.millisec_flush_timeout, 1));
+    std::unique_lock<std::mutex> guard(this->checkpointer_mutex);
+    while (!this->shutdown_) {
+        this->checkpointer_wake.wait_for(guard, interval);
+        if (this->shutdown_)
+            break;
+
+        this->checkpoint_lock.lock_shared();
+        auto n_blocks = this->indicies->size();
+        if (this->indicies->flush(FlushReason::Timeout) &&
+            fdatasync(this->index_file) == 0) {
+            this->allocation_lock.lock();
+            this->meta.n_index_blocks = n_blocks;
+            this->flush_meta();
+            this->allocation_lock.unlock();
+        }
+        this->checkpoint_lock.unlock_shared();
+    }
+}
+
+WalStats Magritte::wal_stats() {
+    return this->wal ? this->wal->stats() : WalStats{};
 }
 
 Magritte::~Magritte() { this->shutdown(); }
@@ -0,0 +1,233 @@
+#include "wal.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FNV-1a.
+static uint32_t checksum_of(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const size_t CHECKSUM_SIZE = sizeof(uint32_t);
+
+static bool write_all(int file, const char* data, size_t len) {
+    while (len > 0) {
+        auto n = write(file, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& path,
+                             MagritteDurability durability)
+    : durability(durability), appended(0), durable(0), base(0),
+      syncing(false), failed(false), total_stats(), shutdown_(false) {
+    file = open(path.c_str(), O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+    if (file < 0) {
+        std::string message = "Failed to open log at " + path + ": ";
+        message += std::strerror(errno);
+        throw std::runtime_error(message);
+    }
+
+    struct stat st;
+    if (fstat(file, &st) == 0)
+        appended = durable = st.st_size;
+
+    if (durability == Batched)
+        sync_thread = std::thread(&WriteAheadLog::syncer, this);
+}
+
+WriteAheadLog::~WriteAheadLog() { shutdown(); }
+
+std::vector<char> WriteAheadLog::encode(WalRecordType type, MagritteKey key,
+                                        std::span<const char> value) {
+    WalRecordHeader header = {.checksum = 0,
+                              .length = uint32_t(value.size()),
+                              .type = type,
+                              .key = key,
+                              .index = WAL_NO_INDEX,
+                              .old_index = WAL_NO_INDEX};
+    std::vector<char> record(sizeof(header) + value.size());
+    memcpy(record.data(), &header, sizeof(header));
+    if (!value.empty())
+        memcpy(record.data() + sizeof(header), value.data(), value.size());
+    return record;
+}
+
+uint64_t WriteAheadLog::append(std::vector<char>& record, MagritteIndex index,
+                               MagritteIndex old_index) {
+    WalRecordHeader header;
+    memcpy(&header, record.data(), sizeof(header));
+    header.index = index;
+    header.old_index = old_index;
+    memcpy(record.data(), &header, sizeof(header));
+    header.checksum = checksum_of(record.data() + CHECKSUM_SIZE,
+                                  record.size() - CHECKSUM_SIZE);
+    memcpy(record.data(), &header.checksum, CHECKSUM_SIZE);
+
+    std::lock_guard<std::mutex> guard(mutex);
+    buffer.insert(buffer.end(), record.begin(), record.end());
+    appended += record.size();
+    total_stats.n_records++;
+    return appended;
+}
+
+// the thread that finds no sync going on writes out everything appended so
+// far, and syncs it for everyone waiting.
+bool WriteAheadLog::sync(std::unique_lock<std::mutex>& guard) {
+    if (syncing) {
+        synced.wait(guard);
+        return !failed;
+    }
+
+    syncing = true;
+    std::vector<char> out;
+    out.swap(buffer);
+    auto target = appended;
+    guard.unlock();
+
+    auto ok = write_all(file, out.data(), out.size()) && fdatasync(file) == 0;
+
+    guard.lock();
+    syncing = false;
+    if (ok) {
+        durable = std::max(durable, target);
+        total_stats.n_syncs++;
+    } else {
+        failed = true;
+    }
+    synced.notify_all();
+    return ok;
+}
+
+bool WriteAheadLog::sync_to(uint64_t position) {
+    std::unique_lock<std::mutex> guard(mutex);
+    while (durable < position) {
+        if (failed || !sync(guard))
+            return false;
+    }
+    return true;
+}
+
+bool WriteAheadLog::commit(uint64_t position) {
+    return durability != PerOp || sync_to(position);
+}
+
+bool WriteAheadLog::flush() {
+    uint64_t position;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        position = appended;
+    }
+    return sync_to(position);
+}
+
+void WriteAheadLog::syncer() {
+    std::unique_lock<std::mutex> guard(mutex);
+    while (!shutdown_) {
+        synced.wait_for(guard, std::chrono::milliseconds(WAL_SYNC_INTERVAL_MS));
+        if (!shutdown_ && !syncing && durable < appended)
+            sync(guard);
+    }
+}
+
+// the log is read whole, a torn record at its end is cut off so appends
+// follow the last intact one.
+size_t WriteAheadLog::replay(
+    std::function<void(const WalRecordHeader&, std::span<const char>)>
+        apply) {
+    struct stat st;
+    if (fstat(file, &st) != 0)
+        throw std::runtime_error("Failed to get size of log");
+
+    std::vector<char> data(st.st_size);
+    size_t read_size = 0;
+    while (read_size < data.size()) {
+        auto n = pread(file, data.data() + read_size, data.size() - read_size,
+                       read_size);
+        if (n <= 0)
+            throw std::runtime_error("Failed to read log");
+        read_size += n;
+    }
+
+    size_t pos = 0, n_records = 0;
+    WalRecordHeader header;
+    while (data.size() - pos >= sizeof(header)) {
+        memcpy(&header, data.data() + pos, sizeof(header));
+        auto len = sizeof(header) + header.length;
+        if (data.size() - pos < len ||
+            checksum_of(data.data() + pos + CHECKSUM_SIZE,
+                        len - CHECKSUM_SIZE) != header.checksum)
+            break;
+
+        apply(header, std::span<const char>(data.data() + pos + sizeof(header),
+                                            header.length));
+        pos += len;
+        n_records++;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+    if (pos < data.size() && ftruncate(file, pos) != 0)
+        throw std::runtime_error("Failed to cut off torn log record");
+    appended = durable = pos;
+    base = 0;
+    return n_records;
+}
+
+uint64_t WriteAheadLog::size() {
+    std::lock_guard<std::mutex> guard(mutex);
+    return appended - base;
+}
+
+void WriteAheadLog::reset() {
+    std::unique_lock<std::mutex> guard(mutex);
+    synced.wait(guard, [this] { return !syncing; });
+
+    buffer.clear();
+    if (ftruncate(file, 0) != 0 || fdatasync(file) != 0)
+        failed = true;
+    durable = appended;
+    base = appended;
+    synced.notify_all();
+}
+
+WalStats WriteAheadLog::stats() {
+    std::lock_guard<std::mutex> guard(mutex);
+    return total_stats;
+}
+
+// what is left in the buffer is written out and synced before the log is
+// closed.
+void WriteAheadLog::shutdown() {
+    std::unique_lock<std::mutex> guard(mutex);
+    if (shutdown_)
+        return;
+    shutdown_ = true;
+    synced.notify_all();
+    guard.unlock();
+    if (sync_thread.joinable())
+        sync_thread.join();
+
+    guard.lock();
+    while (!failed && durable < appended)
+        sync(guard);
+    guard.unlock();
+
+    close(file);
+    file = -1;
+}
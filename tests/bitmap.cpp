@@ -1,7 +1,14 @@
 #include "BitMap.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <gtest/gtest.h>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
 
 TEST(BitMapTest, FindVacantAndSetUntilFull) {
     int size = 1 << 5;
@@ -29,3 +36,154 @@ TEST(BitMapTest, FindVacantAndSetUntilFull) {
 
     EXPECT_EQ(bitmap.count_vacant(), 0);
 }
+
+TEST(BitMapTest, DirtyPages) {
+    // four pages worth of bits.
+    BitMap bitmap(BITMAP_PAGE_SIZE * 8 * 4);
+
+    // a new bitmap has never been written.
+    auto runs = bitmap.TakeDirtyPages();
+    ASSERT_EQ(runs.size(), 1);
+    EXPECT_EQ(runs[0], std::make_pair(size_t(0), size_t(4)));
+    EXPECT_TRUE(bitmap.TakeDirtyPages().empty());
+
+    ASSERT_EQ(bitmap.FindVacantAndSet(), 0);
+    bitmap.Set(BITMAP_PAGE_SIZE * 8 * 2 + 9, true);
+    bitmap.Set(BITMAP_PAGE_SIZE * 8 * 3 + 17, true);
+    runs = bitmap.TakeDirtyPages();
+    ASSERT_EQ(runs.size(), 2);
+    EXPECT_EQ(runs[0], std::make_pair(size_t(0), size_t(1)));
+    EXPECT_EQ(runs[1], std::make_pair(size_t(2), size_t(2)));
+
+    // every bit of a byte can be cleared again.
+    for (int i = 8; i < 16; i++)
+        bitmap.Set(i, true);
+    for (int i = 8; i < 16; i++) {
+        bitmap.Set(i, false);
+        EXPECT_FALSE(bitmap.Get(i)) << "bit: " << i;
+    }
+
+    std::vector<unsigned char> bytes = bitmap.GetUnderlayBytes();
+    auto loaded = BitMap::LoadExisting(std::move(bytes));
+    EXPECT_TRUE(loaded.TakeDirtyPages().empty());
+    EXPECT_TRUE(loaded.Get(BITMAP_PAGE_SIZE * 8 * 3 + 17));
+}
+
+TEST(BitMapTest, ConcurrentClaims) {
+    const int size = 1 << 16;
+    const int n_threads = 8;
+    BitMap bitmap(size);
+
+    std::vector<std::vector<int>> claimed(n_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            for (;;) {
+                auto i = bitmap.FindVacantAndSet();
+                if (i == -1)
+                    break;
+                claimed[t].push_back(i);
+                // give some back to churn the summaries.
+                if (rng() % 4 == 0) {
+                    bitmap.Set(claimed[t].back(), false);
+                    claimed[t].pop_back();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    std::vector<int> all;
+    for (auto& c : claimed)
+        all.insert(all.end(), c.begin(), c.end());
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.size(), size);
+    for (int i = 0; i < size; i++)
+        ASSERT_EQ(all[i], i);
+    ASSERT_EQ(bitmap.count_vacant(), 0);
+}
+
+TEST(BitMapTest, RangeClaims) {
+    const int size = 1 << 14;
+    BitMap bitmap(size);
+
+    // ranges need not line up with summary words.
+    for (int i = 0; i < 64 * 3; i++)
+        ASSERT_EQ(bitmap.FindVacantAndSet(64 * 70, 64 * 73), 64 * 70 + i);
+    ASSERT_EQ(bitmap.FindVacantAndSet(64 * 70, 64 * 73), -1);
+    ASSERT_EQ(bitmap.count_vacant(64 * 70, 64 * 73), 0);
+    ASSERT_EQ(bitmap.count_vacant(), size - 64 * 3);
+
+    bitmap.Set(64 * 71 + 5, false);
+    ASSERT_EQ(bitmap.FindVacantAndSet(64 * 70, 64 * 73), 64 * 71 + 5);
+
+    // the unranged search still finds the lowest bit.
+    ASSERT_EQ(bitmap.FindVacantAndSet(), 0);
+    ASSERT_EQ(bitmap.FindVacantAndSet(64 * 64, size), 64 * 64);
+}
+
+TEST(BitMapTest, RunClaims) {
+    const int size = 1 << 12;
+    BitMap bitmap(size);
+
+    // runs stay within a word, the third of 24 starts the next one.
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(24, 0, size), 0);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(24, 0, size), 24);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(24, 0, size), 64);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(16, 0, size), 48);
+    ASSERT_EQ(bitmap.count_vacant(0, 128), 128 - 88);
+
+    // a hole of 3 takes a run of 3, not one of 4.
+    for (int i = 10; i < 13; i++)
+        bitmap.Set(i, false);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(4, 0, size), 88);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(3, 0, size), 10);
+
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(64, 0, size), 128);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(64, 64 * 3, 64 * 4), 64 * 3);
+    ASSERT_EQ(bitmap.FindVacantRunAndSet(64, 64 * 3, 64 * 4), -1);
+    ASSERT_EQ(bitmap.FindVacantAndSet(), 92);
+}
+
+static uint64_t nanosecs_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// fill: claim every slot of an empty block. churn: free a random slot and
+// claim one back. fragmented: claim back 1% of slots freed at random.
+TEST(BitMapTest, Benchmark) {
+    const int size = 1 << 20;
+    BitMap bitmap(size);
+    std::mt19937 rng(1);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < size; i++)
+        bitmap.FindVacantAndSet();
+    auto fill = nanosecs_since(start) / size;
+
+    const int n_churn = 1 << 18;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_churn; i++) {
+        bitmap.Set(rng() % size, false);
+        ASSERT_NE(bitmap.FindVacantAndSet(), -1);
+    }
+    auto churn = nanosecs_since(start) / n_churn;
+
+    const int n_holes = size / 100;
+    for (int i = 0; i < n_holes; i++)
+        bitmap.Set(rng() % size, false);
+    auto n_vacant = bitmap.count_vacant();
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < n_vacant; i++)
+        ASSERT_NE(bitmap.FindVacantAndSet(), -1);
+    auto fragmented = nanosecs_since(start) / n_vacant;
+    ASSERT_EQ(bitmap.FindVacantAndSet(), -1);
+
+    std::cout << "fill: " << fill << " ns / churn: " << churn
+              << " ns / fragmented: " << fragmented << " ns per claim"
+              << std::endl;
+}
@@ -1,4 +1,5 @@
 #include "Block.h"
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <fcntl.h>
@@ -9,6 +10,9 @@
 #include <thread>
 #include <vector>
 
+// the size class 1024-byte values go to.
+const uint32_t SLOT_SIZE = 2048;
+
 MagritteValue generateData() {
     MagritteValue buffer(1024);
     std::ifstream randomFile("/dev/urandom", std::ios::in | std::ios::binary);
@@ -36,7 +40,7 @@ TEST(BlockTest, BasicOperations) {
         FAIL() << "Failed to truncate file at " << fn;
     }
 
-    Block block(file, 0);
+    Block block(file, 0, SLOT_SIZE);
     auto data = generateData();
 
     MagritteInBlockIndex idx;
@@ -96,3 +100,214 @@ TEST(BlockTest, BasicOperations) {
               << std::endl;
 
 }
+
+TEST(BlockTest, CoalescedFlush) {
+    auto fn = "/tmp/libmgrt-block-flush-test-file";
+    remove(fn);
+    int file = open(fn, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, SLOT_SIZE);
+
+    std::vector<MagritteValue> values;
+    for (int i = 0; i < 300; i++) {
+        MagritteInBlockIndex idx;
+        values.push_back(generateData());
+        ASSERT_TRUE(block.put(values.back(), idx));
+        ASSERT_EQ(idx, i);
+    }
+
+    // two runs, BLOCK_MAX_WRITE_RUN caps the first, the header and the
+    // bitmap. slots are written whole.
+    auto stats = block.flush_now();
+    EXPECT_EQ(stats.n_slots, 300);
+    EXPECT_EQ(stats.n_syscalls, 4);
+    EXPECT_EQ(stats.n_bytes,
+              300 * SLOT_SIZE + sizeof(BlockHeader) + BITMAP_SIZE);
+
+    // [5, 7], [10, 11] and [100], the short value at 10 is padded.
+    for (auto i : {7, 100, 6, 5, 11}) {
+        values[i] = generateData();
+        ASSERT_TRUE(block.update(MagritteValue(values[i]), i));
+    }
+    values[10].resize(100);
+    ASSERT_TRUE(block.update(MagritteValue(values[10]), 10));
+    stats = block.flush_now();
+    EXPECT_EQ(stats.n_slots, 6);
+    EXPECT_EQ(stats.n_syscalls, 3);
+
+    for (int i = 0; i < 300; i++) {
+        auto read = block.get(i);
+        EXPECT_EQ(read, values[i]) << "slot: " << i;
+    }
+
+    stats = block.flush_stats();
+    EXPECT_EQ(stats.n_flushes, 2);
+    EXPECT_EQ(stats.n_slots, 306);
+}
+
+TEST(BlockTest, ShardedAllocation) {
+    auto fn = "/tmp/libmgrt-block-shard-test-file";
+    remove(fn);
+
+    // every slot taken but one, in the last shard.
+    std::vector<unsigned char> bytes(BITMAP_SIZE, 0xff);
+    auto last = BLOCK_MAX_CAP - 3;
+    bytes[last / 8] &= ~(1 << (last % 8));
+
+    int file = open(fn, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block full(file, 0, SLOT_SIZE,
+               BitMap::LoadExisting(std::move(bytes)));
+    ASSERT_TRUE(full.vacant());
+
+    // found from whichever shard the thread starts at.
+    MagritteInBlockIndex idx;
+    ASSERT_TRUE(full.put(MagritteValue(1024, 'a'), idx));
+    ASSERT_EQ(idx, last);
+    ASSERT_FALSE(full.vacant());
+    ASSERT_FALSE(full.put(MagritteValue(1024, 'b'), idx));
+
+    full.remove(idx);
+    ASSERT_TRUE(full.vacant());
+    ASSERT_TRUE(full.put(MagritteValue(1024, 'c'), idx));
+    ASSERT_EQ(idx, last);
+    full.shutdown();
+
+    // threads putting together take slots from shards of their own.
+    remove(fn);
+    file = open(fn, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, SLOT_SIZE);
+    const int n_threads = 4, n_puts = 1000;
+    std::vector<std::vector<MagritteInBlockIndex>> slots(n_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < n_puts; i++) {
+                MagritteInBlockIndex idx;
+                ASSERT_TRUE(block.put(MagritteValue(1024, 'd'), idx));
+                slots[t].push_back(idx);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    std::vector<uint32_t> shards;
+    for (auto& s : slots) {
+        auto shard = s.front() / BLOCK_SHARD_CAP;
+        for (auto idx : s)
+            ASSERT_EQ(idx / BLOCK_SHARD_CAP, shard);
+        // each thread fills its shard in order.
+        ASSERT_TRUE(std::is_sorted(s.begin(), s.end()));
+        shards.push_back(shard);
+    }
+    std::sort(shards.begin(), shards.end());
+    ASSERT_EQ(std::unique(shards.begin(), shards.end()), shards.end());
+}
+
+TEST(BlockTest, ReservedSlot) {
+    auto fn = "/tmp/libmgrt-block-reserve-test-file";
+    remove(fn);
+
+    // every slot taken but the last one.
+    std::vector<unsigned char> bytes(BITMAP_SIZE, 0xff);
+    auto last = BLOCK_MAX_CAP - 1;
+    bytes[last / 8] &= ~(1 << (last % 8));
+
+    int file = open(fn, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, SLOT_SIZE, BitMap::LoadExisting(std::move(bytes)));
+    ASSERT_TRUE(block.vacant());
+
+    block.reserve(last);
+    ASSERT_FALSE(block.vacant());
+    MagritteInBlockIndex idx;
+    ASSERT_FALSE(block.put(MagritteValue(1024, 'a'), idx));
+    // reserving twice changes nothing.
+    block.reserve(last);
+    ASSERT_FALSE(block.vacant());
+}
+
+TEST(BlockTest, SlotSizes) {
+    auto fn = "/tmp/libmgrt-block-slot-size-test-file";
+    remove(fn);
+    int file = open(fn, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, 64);
+
+    MagritteInBlockIndex idx;
+    ASSERT_FALSE(block.put(MagritteValue(61, 'x'), idx));
+
+    // every length that fits, read back as it was put.
+    std::vector<MagritteValue> values;
+    std::vector<MagritteInBlockIndex> slots;
+    for (int len = 0; len <= 60; len++) {
+        values.push_back(MagritteValue(len, 'a' + len % 26));
+        ASSERT_TRUE(block.put(values.back(), idx));
+        slots.push_back(idx);
+    }
+    ASSERT_FALSE(block.update(MagritteValue(61, 'x'), slots[0]));
+    block.flush_now();
+
+    for (size_t i = 0; i < values.size(); i++)
+        EXPECT_EQ(block.get(slots[i]), values[i]) << "slot: " << slots[i];
+    std::vector<MagritteValue> read;
+    block.get_batch(slots, read);
+    EXPECT_EQ(read, values);
+
+    // the header tells the slot size of the block when it is loaded.
+    block.shutdown();
+    file = open(fn, O_RDWR);
+    EXPECT_EQ(Block::read_slot_size(file, 0), 64);
+    Block loaded(file, 0, 64, Block::read_bitmap(file, 0));
+    for (size_t i = 0; i < values.size(); i++)
+        EXPECT_EQ(loaded.get(slots[i]), values[i]) << "slot: " << slots[i];
+    EXPECT_THROW(Block::read_slot_size(file, block_size(64)),
+                 std::runtime_error);
+}
+
+TEST(BlockTest, Extents) {
+    auto fn = "/tmp/libmgrt-block-extent-test-file";
+    remove(fn);
+    int file = open(fn, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, BLOCK_EXTENT_SLOT_SIZE);
+
+    // 3 slots, 1, 17 and a whole word of the bitmap.
+    std::vector<MagritteValue> values;
+    std::vector<MagritteInBlockIndex> slots;
+    for (size_t len : {10000u, 100u, 64u << 10, BLOCK_MAX_VALUE_SIZE}) {
+        MagritteInBlockIndex idx;
+        values.push_back(MagritteValue(len));
+        for (size_t i = 0; i < len; i++)
+            values.back()[i] = i * 7 + len;
+        ASSERT_TRUE(block.put(values.back(), idx));
+        slots.push_back(idx);
+    }
+    MagritteInBlockIndex idx;
+    ASSERT_FALSE(block.put(MagritteValue(BLOCK_MAX_VALUE_SIZE + 1), idx));
+    EXPECT_EQ(slots[1], slots[0] + 3);
+    EXPECT_EQ(slots[2], slots[1] + 1);
+    EXPECT_EQ(slots[3] % 64, 0);
+
+    block.flush_now();
+    for (size_t i = 0; i < values.size(); i++)
+        EXPECT_EQ(block.get(slots[i]), values[i]) << "slot: " << slots[i];
+    std::vector<MagritteValue> read;
+    block.get_batch(slots, read);
+    EXPECT_EQ(read, values);
+
+    // only a value taking as many slots is updated in place.
+    EXPECT_TRUE(block.same_slots(slots[0], 9000));
+    EXPECT_FALSE(block.same_slots(slots[0], 20000));
+    values[0].assign(9000, 'u');
+    ASSERT_TRUE(block.update(MagritteValue(values[0]), slots[0]));
+    ASSERT_FALSE(block.update(MagritteValue(20000), slots[0]));
+
+    // a removed extent frees its whole run.
+    block.remove(slots[2]);
+    ASSERT_TRUE(block.put(values[2], idx));
+    EXPECT_EQ(idx, slots[2]);
+
+    // the runs are known again from the bitmaps when loaded.
+    block.shutdown();
+    file = open(fn, O_RDWR);
+    Block loaded(file, 0, BLOCK_EXTENT_SLOT_SIZE, Block::read_bitmap(file, 0));
+    for (size_t i = 0; i < values.size(); i++)
+        EXPECT_EQ(loaded.get(slots[i]), values[i]) << "slot: " << slots[i];
+}
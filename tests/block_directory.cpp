@@ -0,0 +1,31 @@
+#include "block_directory.h"
+#include <gtest/gtest.h>
+#include <set>
+
+TEST(BlockDirectoryTest, TakesLowestVacant) {
+    BlockDirectory directory;
+    EXPECT_EQ(directory.fill(), MAGRITTE_MAX_BLOCKS);
+    EXPECT_EQ(directory.take_free([](uint32_t) { return true; }), -1);
+
+    std::set<uint32_t> vacant = {70, 4000};
+    for (auto block : {4000, 3, 70, 70})
+        directory.mark_free(block);
+
+    // 3 filled up again since it was marked, its mark is dropped.
+    auto is_vacant = [&vacant](uint32_t block) {
+        return vacant.contains(block);
+    };
+    EXPECT_EQ(directory.take_free(is_vacant), 70);
+    EXPECT_EQ(directory.take_free(is_vacant), 4000);
+    EXPECT_EQ(directory.take_free(is_vacant), -1);
+
+    vacant.insert(3);
+    EXPECT_EQ(directory.take_free(is_vacant), -1);
+    directory.mark_free(3);
+    EXPECT_EQ(directory.take_free(is_vacant), 3);
+
+    directory.set_fill(3);
+    BlockDirectory copy;
+    copy = directory;
+    EXPECT_EQ(copy.fill(), 3);
+}
@@ -0,0 +1,91 @@
+#include "channel.h"
+#include "pipe_channel.h"
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+TEST(Channel, ManyProducersAndConsumers) {
+    channel<uint64_t> ch(64);
+    const int n_threads = 4;
+    const uint64_t n_items = 50000;
+
+    std::atomic<uint64_t> sum = 0, n_popped = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([&, i] {
+            for (uint64_t v = i; v < n_items; v += n_threads)
+                ch << v + 1;
+        });
+        threads.emplace_back([&] {
+            for (uint64_t j = 0; j < n_items / n_threads; j++) {
+                uint64_t v;
+                ch >> v;
+                ASSERT_NE(v, 0);
+                sum += v;
+                n_popped++;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    ASSERT_EQ(n_popped, n_items);
+    ASSERT_EQ(sum, n_items * (n_items + 1) / 2);
+    ASSERT_EQ(ch.length(), 64);
+}
+
+TEST(Channel, PopTimeout) {
+    channel<int*> ch(1);
+
+    auto start = std::chrono::steady_clock::now();
+    auto [value, ok] = ch.pop_timeout(50);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    ASSERT_FALSE(ok);
+    ASSERT_EQ(value, nullptr);
+    ASSERT_GE(elapsed, std::chrono::milliseconds(50));
+
+    // a push while waiting wakes the consumer up.
+    int x;
+    std::thread producer([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ch << &x;
+    });
+    start = std::chrono::steady_clock::now();
+    auto [woken, ok2] = ch.pop_timeout(5000);
+    elapsed = std::chrono::steady_clock::now() - start;
+    producer.join();
+    ASSERT_TRUE(ok2);
+    ASSERT_EQ(woken, &x);
+    ASSERT_LT(elapsed, std::chrono::milliseconds(2000));
+}
+
+// one producer and one consumer passing pointers, like a block's flush
+// signal.
+template <typename C> uint64_t ping_pong_nanosecs(C& ch, int n) {
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&] {
+        for (int i = 0; i < n; i++)
+            ch.pop();
+    });
+    int x;
+    for (int i = 0; i < n; i++)
+        ch << &x;
+    consumer.join();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start)
+        .count();
+}
+
+TEST(Channel, Benchmark) {
+    const int n = 200000;
+    channel<int*> ch(256);
+    pipe_channel<int*> pipe_ch(256);
+
+    auto lock_free = ping_pong_nanosecs(ch, n);
+    auto piped = ping_pong_nanosecs(pipe_ch, n);
+    std::cout << "pipe channel: " << piped / n << " ns per item / channel: "
+              << lock_free / n << " ns per item" << std::endl;
+}
@@ -0,0 +1,231 @@
+#include "clock_cache.h"
+#include "lru.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(ClockCacheTest, BasicOperations) {
+    ClockCache<int, std::string> cache(2);
+
+    cache.put(1, "one");
+    cache.put(2, "two");
+
+    std::string value;
+    EXPECT_TRUE(cache.get(1, value));
+    EXPECT_EQ(value, "one");
+    EXPECT_TRUE(cache.get(2, value));
+    EXPECT_EQ(value, "two");
+
+    cache.put(2, "TWO");
+    EXPECT_TRUE(cache.get(2, value));
+    EXPECT_EQ(value, "TWO");
+
+    // both are referenced, the sweep clears them and evicts one.
+    cache.put(3, "three");
+    EXPECT_EQ(cache.size(), 2);
+    EXPECT_TRUE(cache.get(3, value));
+    auto kept = cache.get(1, value) ? 1 : 2;
+    EXPECT_NE(cache.get(1, value), cache.get(2, value));
+
+    cache.remove(3);
+    EXPECT_FALSE(cache.get(3, value));
+    EXPECT_TRUE(cache.get(kept, value));
+    EXPECT_EQ(cache.size(), 1);
+}
+
+TEST(ClockCacheTest, RemoveKeepsProbesIntact) {
+    const int n = 1000;
+    // room to spare, shards are not filled evenly.
+    ClockCache<int, int> cache(n * 2);
+
+    for (int i = 0; i < n; i++)
+        cache.put(i, i);
+    for (int i = 0; i < n; i += 3)
+        cache.remove(i);
+
+    int value;
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(cache.get(i, value), i % 3 != 0) << "key: " << i;
+        if (i % 3)
+            ASSERT_EQ(value, i);
+    }
+}
+
+TEST(ClockCacheTest, TablesGrow) {
+    const int n = 50000;
+    // room to spare, shards are not filled evenly.
+    ClockCache<int, int> cache(n * 2);
+
+    for (int i = 0; i < n; i++)
+        cache.put(i, i);
+    EXPECT_EQ(cache.size(), n);
+
+    int value;
+    for (int i = 0; i < n; i++) {
+        ASSERT_TRUE(cache.get(i, value)) << "key: " << i;
+        ASSERT_EQ(value, i);
+    }
+}
+
+TEST(ClockCacheTest, Resharding) {
+    // one shard to start with, sixteen once grown.
+    ClockCache<int, int> cache(CLOCK_CACHE_MIN_SHARD);
+    for (int i = 0; i < 32; i++)
+        cache.put(i, i);
+
+    const int n = CLOCK_CACHE_MIN_SHARD * CLOCK_CACHE_SHARDS * 4;
+    cache.set_capacity(n * 2);
+    int value;
+    for (int i = 0; i < 32; i++) {
+        ASSERT_TRUE(cache.get(i, value)) << "key: " << i;
+        ASSERT_EQ(value, i);
+    }
+    for (int i = 32; i < n; i++)
+        cache.put(i, i);
+    EXPECT_EQ(cache.size(), n);
+
+    cache.set_capacity(CLOCK_CACHE_MIN_SHARD);
+    EXPECT_EQ(cache.size(), CLOCK_CACHE_MIN_SHARD);
+    size_t found = 0;
+    for (int i = 0; i < n; i++) {
+        if (cache.get(i, value)) {
+            ASSERT_EQ(value, i);
+            found++;
+        }
+    }
+    EXPECT_EQ(found, CLOCK_CACHE_MIN_SHARD);
+
+    // readers and writers keep going while the shards change.
+    std::atomic<bool> done = false;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&cache, &done, t] {
+            for (int i = 0; !done; i++) {
+                auto key = (i * 4 + t) % n;
+                int value;
+                cache.put(key, key);
+                if (cache.get(key, value))
+                    ASSERT_EQ(value, key);
+            }
+        });
+    }
+    for (int round = 0; round < 100; round++)
+        cache.set_capacity(round % 2 ? CLOCK_CACHE_MIN_SHARD : n * 2);
+    done = true;
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_LE(cache.size(), n * 2);
+}
+
+TEST(ClockCacheTest, ByteBudget) {
+    typedef std::vector<char> Value;
+    auto entry = CacheByteWeigher::weigh(0, Value(1024));
+    ClockCache<int, Value, CacheByteWeigher> cache(64 << 10);
+
+    for (int i = 0; i < 1000; i++)
+        cache.put(i, Value(1024));
+    EXPECT_LE(cache.weight(), 64 << 10);
+    EXPECT_EQ(cache.weight(), cache.size() * entry);
+    EXPECT_GT(cache.size(), 0);
+
+    cache.set_capacity(16 << 10);
+    EXPECT_LE(cache.weight(), 16 << 10);
+
+    // an entry larger than the budget is not cached, nothing is with none.
+    Value value;
+    cache.put(1000, Value(32 << 10));
+    EXPECT_FALSE(cache.get(1000, value));
+    cache.set_capacity(0);
+    EXPECT_EQ(cache.size(), 0);
+    cache.put(1001, Value(1));
+    EXPECT_FALSE(cache.get(1001, value));
+}
+
+TEST(ClockCacheTest, ScanResistance) {
+    const int n = 1024;
+    ClockCache<int, int> cache(n);
+
+    // a hot half, read again after it was put.
+    int value;
+    for (int i = 0; i < n / 2; i++) {
+        cache.put(i, i);
+        cache.get(i, value);
+    }
+    // a scan of keys read once, twice the size of the cache.
+    for (int i = n; i < n * 3; i++)
+        cache.put(i, i);
+
+    int hot = 0;
+    for (int i = 0; i < n / 2; i++)
+        hot += cache.get(i, value);
+    EXPECT_GT(hot, n / 4);
+}
+
+// zipf distributed keys over 1 << 16 keys, a quarter of them fit in the
+// cache. every thread gets and puts the value on a miss.
+template <typename Cache>
+static void run_benchmark(const char* name, Cache& cache, int n_threads) {
+#ifdef NDEBUG
+    const int n_keys = 1 << 16, n_ops = 1 << 18;
+#else
+    // debug containers make every list splice of the lru linear.
+    const int n_keys = 1 << 16, n_ops = 1 << 12;
+#endif
+    std::vector<double> cdf(n_keys);
+    double sum = 0;
+    for (int i = 0; i < n_keys; i++)
+        cdf[i] = sum += 1 / std::pow(i + 1, 0.99);
+
+    std::atomic<uint64_t> hits = 0, nanosecs = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            std::uniform_real_distribution<double> dist(0, sum);
+            std::vector<int> keys(n_ops);
+            // searched as a plain array, debug iterators would check the
+            // whole cdf is sorted on every call.
+            auto first = cdf.data(), last = first + n_keys;
+            for (auto& key : keys)
+                key = std::lower_bound(first, last, dist(rng)) - first;
+
+            std::vector<char> value(64);
+            uint64_t n_hits = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (auto key : keys) {
+                if (cache.get(key, value))
+                    n_hits++;
+                else
+                    cache.put(key, value);
+            }
+            nanosecs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+            hits += n_hits;
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    uint64_t total = uint64_t(n_ops) * n_threads;
+    std::cout << name << " x" << n_threads
+              << ": hit rate: " << double(hits) / total
+              << " / time per op: " << nanosecs / total << " ns" << std::endl;
+}
+
+TEST(ClockCacheTest, Benchmark) {
+    const int capacity = 1 << 14;
+    for (int n_threads : {1, 4, 16}) {
+        LRUCache<int, std::vector<char>> lru(capacity);
+        run_benchmark("lru", lru, n_threads);
+        ClockCache<int, std::vector<char>> clock(capacity);
+        run_benchmark("clock", clock, n_threads);
+    }
+}
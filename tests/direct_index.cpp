@@ -0,0 +1,66 @@
+#include "direct_index.h"
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+const std::string tempFilePath = "/tmp/libmgrt-direct-index-test-file";
+
+TEST(DirectIndex, BasicOperations) {
+    if (access(tempFilePath.c_str(), F_OK) != -1) {
+        remove(tempFilePath.c_str());
+    }
+
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    size_t n_pages;
+
+    {
+        DirectIndex index(file, 0, 0);
+
+        for (MagritteKey key = -10000; key < 10000; key++) {
+            ASSERT_TRUE(index.put(key, abs(key)));
+        }
+        // sparse keys at both ends of the key space
+        ASSERT_TRUE(index.put(INT_MIN, 1));
+        ASSERT_TRUE(index.put(INT_MAX, 2));
+
+        // try overwrite and remove some
+        for (MagritteKey key = -5000; key < 5000; key += 2) {
+            ASSERT_TRUE(index.put(key, abs(key) * 3));
+        }
+        MagritteIndex removed;
+        for (MagritteKey key = 9000; key < 10000; key++) {
+            ASSERT_TRUE(index.remove(key, removed));
+            ASSERT_EQ(removed, key);
+        }
+        ASSERT_FALSE(index.remove(9000, removed));
+
+        n_pages = index.size();
+        ASSERT_LT(n_pages, 10);
+    }
+
+    {
+        DirectIndex index(file, 0, n_pages);
+        MagritteIndex value;
+
+        for (MagritteKey key = -10000; key < 10000; key++) {
+            if (key >= 9000) {
+                ASSERT_FALSE(index.get(key, value)) << "key: " << key;
+                continue;
+            }
+            ASSERT_TRUE(index.get(key, value)) << "key: " << key;
+            if (key < 5000 && key >= -5000 && (key + 5000) % 2 == 0)
+                ASSERT_EQ(value, abs(key) * 3) << "key: " << key;
+            else
+                ASSERT_EQ(value, abs(key)) << "key: " << key;
+        }
+
+        ASSERT_TRUE(index.get(INT_MIN, value));
+        ASSERT_EQ(value, 1);
+        ASSERT_TRUE(index.get(INT_MAX, value));
+        ASSERT_EQ(value, 2);
+        ASSERT_FALSE(index.get(1 << 20, value));
+    }
+
+    close(file);
+}
@@ -0,0 +1,111 @@
+#include "Block.h"
+#include "flush_scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// the size class 1024-byte values go to.
+const uint32_t SLOT_SIZE = 2048;
+
+const std::string tempFilePath = "/tmp/libmgrt-flush-scheduler-test-file";
+
+static int count_threads() {
+    int n = 0;
+    auto dir = opendir("/proc/self/task");
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] != '.')
+            n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+// whether the slot holds `value` in the file, read through another
+// descriptor so nothing pending in the block is seen.
+static bool on_disk(MagritteInBlockIndex slot, const MagritteValue& value) {
+    int file = open(tempFilePath.c_str(), O_RDONLY);
+    MagritteValue buffer(BLOCK_SLOT_HEADER_SIZE + value.size());
+    auto n_bytes =
+        pread(file, buffer.data(), buffer.size(),
+              BLOCK_HEADER_SIZE + BITMAP_SIZE + slot * SLOT_SIZE);
+    close(file);
+
+    uint32_t len;
+    memcpy(&len, buffer.data(), sizeof(len));
+    return n_bytes == buffer.size() && len == value.size() &&
+           std::equal(value.begin(), value.end(),
+                      buffer.begin() + BLOCK_SLOT_HEADER_SIZE);
+}
+
+TEST(FlushScheduler, FlushesAfterTimeout) {
+    remove(tempFilePath.c_str());
+    FlushScheduler scheduler(50);
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, SLOT_SIZE, Pread, &scheduler);
+
+    MagritteValue value(1024, 'a');
+    MagritteInBlockIndex slot;
+    ASSERT_TRUE(block.put(value, slot));
+    ASSERT_GT(block.dirty_bytes(), 0);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!on_disk(slot, value) && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_TRUE(on_disk(slot, value));
+    ASSERT_EQ(block.dirty_bytes(), 0);
+}
+
+TEST(FlushScheduler, UrgentFlushSkipsTimeout) {
+    remove(tempFilePath.c_str());
+    FlushScheduler scheduler(60 * 1000);
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    Block block(file, 0, SLOT_SIZE, Pread, &scheduler);
+
+    MagritteValue value(1024, 'b');
+    MagritteInBlockIndex slot;
+    ASSERT_TRUE(block.put(value, slot));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_FALSE(on_disk(slot, value));
+
+    block.flush();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!on_disk(slot, value) && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_TRUE(on_disk(slot, value));
+}
+
+TEST(FlushScheduler, ThreadCountIndependentOfBlocks) {
+    remove(tempFilePath.c_str());
+    auto before = count_threads();
+    {
+        FlushScheduler scheduler(50);
+        std::vector<std::unique_ptr<Block>> blocks;
+        for (int i = 0; i < 64; i++) {
+            int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR,
+                            S_IRUSR | S_IWUSR);
+            blocks.push_back(std::make_unique<Block>(
+                file, i * (BLOCK_HEADER_SIZE + BITMAP_SIZE + 1024 * 64),
+                SLOT_SIZE, Pread, &scheduler));
+            MagritteInBlockIndex slot;
+            ASSERT_TRUE(blocks.back()->put(MagritteValue(1024, 'c'), slot));
+        }
+
+        ASSERT_EQ(count_threads(), before + FLUSH_SCHEDULER_WORKERS);
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        for (auto& block : blocks) {
+            while (block->dirty_bytes() != 0 &&
+                   std::chrono::steady_clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            ASSERT_EQ(block->dirty_bytes(), 0);
+        }
+    }
+    ASSERT_EQ(count_threads(), before);
+}
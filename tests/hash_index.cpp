@@ -0,0 +1,98 @@
+#include "hash_index.h"
+#include <cstdlib>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <map>
+#include <random>
+
+const std::string tempFilePath = "/tmp/libmgrt-hash-index-test-file";
+
+TEST(HashIndex, BasicOperations) {
+    if (access(tempFilePath.c_str(), F_OK) != -1) {
+        remove(tempFilePath.c_str());
+    }
+
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    size_t n_pages;
+
+    {
+        HashIndex index(file, 0, 0);
+
+        // enough keys for several resizes
+        for (MagritteKey key = -50000; key < 50000; key++) {
+            ASSERT_TRUE(index.put(key, abs(key)));
+        }
+
+        // try overwrite and remove some
+        for (MagritteKey key = -5000; key < 5000; key += 2) {
+            ASSERT_TRUE(index.put(key, abs(key) * 3));
+        }
+        MagritteIndex removed;
+        for (MagritteKey key = 40000; key < 50000; key++) {
+            ASSERT_TRUE(index.remove(key, removed));
+            ASSERT_EQ(removed, key);
+        }
+        ASSERT_FALSE(index.remove(40000, removed));
+
+        n_pages = index.size();
+    }
+
+    {
+        HashIndex index(file, 0, n_pages);
+        MagritteIndex value;
+
+        for (MagritteKey key = -50000; key < 50000; key++) {
+            if (key >= 40000) {
+                ASSERT_FALSE(index.get(key, value)) << "key: " << key;
+                continue;
+            }
+            ASSERT_TRUE(index.get(key, value)) << "key: " << key;
+            if (key < 5000 && key >= -5000 && (key + 5000) % 2 == 0)
+                ASSERT_EQ(value, abs(key) * 3) << "key: " << key;
+            else
+                ASSERT_EQ(value, abs(key)) << "key: " << key;
+        }
+    }
+
+    close(file);
+}
+
+// flushes while the old table is still being drained, and checks both tables
+// are restored.
+TEST(HashIndex, FlushDuringResize) {
+    if (access(tempFilePath.c_str(), F_OK) != -1) {
+        remove(tempFilePath.c_str());
+    }
+
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    std::mt19937 rng(3);
+    std::map<MagritteKey, MagritteIndex> expected;
+    size_t n_pages;
+
+    {
+        HashIndex index(file, 0, 0);
+        auto resizing = false;
+        for (uint32_t i = 0; !resizing; i++) {
+            auto n_before = index.size();
+            auto key = static_cast<MagritteKey>(rng());
+            expected[key] = i;
+            index.put(key, i);
+            resizing = resizing || index.size() > 2 * n_before;
+        }
+
+        ASSERT_GT(index.size(), 2);
+        index.flush(FlushReason::Manually);
+        n_pages = index.size();
+    }
+
+    {
+        HashIndex index(file, 0, n_pages);
+        for (auto& [key, value] : expected) {
+            MagritteIndex index_value;
+            ASSERT_TRUE(index.get(key, index_value)) << "key: " << key;
+            ASSERT_EQ(index_value, value) << "key: " << key;
+        }
+    }
+
+    close(file);
+}
@@ -1,9 +1,13 @@
 #include "index_block.h"
 #include <cassert>
 
+#include <chrono>
 #include <climits>
 #include <cstdlib>
 #include <gtest/gtest.h>
+#include <iostream>
+#include <random>
+#include <vector>
 
 TEST(IndexBlockTest, BasicOperations) {
     IndexBlock block(INT_MIN, INT_MAX);
@@ -47,3 +51,57 @@ TEST(IndexBlockTest, BasicOperations) {
     block.remove(-50, index);
     ASSERT_FALSE(block.get(-50, index));
 }
+
+TEST(IndexBlockTest, SortedAfterRandomPuts) {
+    IndexBlock block(INT_MIN, INT_MAX);
+    std::mt19937 rng(42);
+    std::vector<MagritteKey> keys;
+    for (int i = 0; i < INDEX_BLOCK_MAX_CAP; i++) {
+        auto key = static_cast<MagritteKey>(rng());
+        if (block.put(key, i))
+            keys.push_back(key);
+    }
+
+    MagritteIndex index;
+    for (size_t i = 0; i < keys.size(); i++) {
+        ASSERT_TRUE(block.get(keys[i], index)) << "key: " << keys[i];
+    }
+
+    auto [data, len] = block.data();
+    auto pairs = reinterpret_cast<MagritteKeyIndexPair*>(data);
+    for (size_t i = 1; i < len / sizeof(MagritteKeyIndexPair); i++) {
+        ASSERT_LT(pairs[i - 1].key, pairs[i].key);
+    }
+}
+
+// lookup cost per fill level, hits and misses are interleaved.
+TEST(IndexBlockTest, LookupBenchmark) {
+    const int n_lookups = 1 << 20;
+    std::mt19937 rng(7);
+
+    for (int fill = 64; fill <= INDEX_BLOCK_MAX_CAP; fill *= 2) {
+        IndexBlock block(INT_MIN, INT_MAX);
+        std::vector<MagritteKey> keys;
+        while (block.size() < fill) {
+            auto key = static_cast<MagritteKey>(rng()) & ~1;
+            block.put(key, block.size());
+            keys.push_back(key);
+        }
+
+        MagritteIndex index;
+        size_t found = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < n_lookups; i++) {
+            auto key = keys[i % keys.size()] | (i & 1);
+            found += block.get(key, index);
+        }
+        auto finish = std::chrono::high_resolution_clock::now();
+        auto nanoseconds =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start)
+                .count();
+
+        EXPECT_EQ(found, n_lookups / 2);
+        std::cout << "fill " << fill << ": " << double(nanoseconds) / n_lookups
+                  << " ns per lookup" << std::endl;
+    }
+}
@@ -2,6 +2,8 @@
 #include <cstdlib>
 #include <fcntl.h>
 #include <gtest/gtest.h>
+#include <map>
+#include <random>
 
 const std::string tempFilePath = "/tmp/libmgrt-index-cluster-test-file";
 
@@ -52,3 +54,92 @@ TEST(IndexCluster, BasicOperations) {
         }
     }
 }
+
+TEST(IndexCluster, RoutingAcrossManySplits) {
+    if (access(tempFilePath.c_str(), F_OK) != -1) {
+        remove(tempFilePath.c_str());
+    }
+
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+    std::mt19937 rng(1);
+    std::map<MagritteKey, MagritteIndex> expected;
+    size_t n_blocks;
+
+    {
+        IndexCluster cluster(file, 0, 0);
+        for (int i = 0; i < 64 * INDEX_BLOCK_MAX_CAP; i++) {
+            auto key = static_cast<MagritteKey>(rng());
+            expected[key] = i;
+            cluster.put(key, i);
+        }
+
+        n_blocks = cluster.size();
+        ASSERT_GT(n_blocks, 64);
+
+        for (auto& [key, value] : expected) {
+            MagritteIndex index;
+            ASSERT_TRUE(cluster.get(key, index)) << "key: " << key;
+            ASSERT_EQ(index, value) << "key: " << key;
+        }
+    }
+
+    {
+        IndexCluster cluster(file, 0, n_blocks);
+        for (auto& [key, value] : expected) {
+            MagritteIndex index;
+            ASSERT_TRUE(cluster.get(key, index)) << "key: " << key;
+            ASSERT_EQ(index, value) << "key: " << key;
+        }
+    }
+
+    close(file);
+}
+
+TEST(IndexCluster, TimeoutFlush) {
+    if (access(tempFilePath.c_str(), F_OK) != -1) {
+        remove(tempFilePath.c_str());
+    }
+
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+    size_t n_blocks;
+    {
+        IndexCluster cluster(file, 0, 0);
+        for (MagritteKey key = 0; key < 4 * INDEX_BLOCK_MAX_CAP; key++)
+            cluster.put(key, key);
+        n_blocks = cluster.size();
+        ASSERT_TRUE(cluster.flush(FlushReason::Timeout));
+
+        // nothing is written while the barrier holds it back, the block
+        // stays dirty.
+        auto ready = false;
+        int n_calls = 0;
+        cluster.set_flush_barrier([&] {
+            n_calls++;
+            return ready;
+        });
+        MagritteIndex index;
+        ASSERT_TRUE(cluster.remove(10, index));
+        ASSERT_FALSE(cluster.flush(FlushReason::Timeout));
+        EXPECT_EQ(n_calls, 1);
+
+        ready = true;
+        ASSERT_TRUE(cluster.remove(11, index));
+        ASSERT_TRUE(cluster.flush(FlushReason::Timeout));
+        EXPECT_EQ(n_calls, 2);
+        // nothing changed since, nothing is written.
+        ASSERT_TRUE(cluster.flush(FlushReason::Timeout));
+        EXPECT_EQ(n_calls, 2);
+    }
+
+    // the removed keys are not loaded from the tail of their block.
+    IndexCluster cluster(file, 0, n_blocks);
+    for (MagritteKey key = 0; key < 4 * INDEX_BLOCK_MAX_CAP; key++) {
+        MagritteIndex index;
+        ASSERT_EQ(cluster.get(key, index), key != 10 && key != 11)
+            << "key: " << key;
+    }
+
+    close(file);
+}
@@ -0,0 +1,122 @@
+#include "io_ring.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <random>
+#include <unistd.h>
+#include <vector>
+
+const std::string tempFilePath = "/tmp/libmgrt-io-ring-test-file";
+const size_t n_records = 1 << 14;
+
+// every record is filled with bytes derived from its number.
+static int prepare_file() {
+    remove(tempFilePath.c_str());
+    int file = open(tempFilePath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+    std::vector<char> buffer(IO_RING_MAX_READ * n_records);
+    for (size_t i = 0; i < buffer.size(); i++)
+        buffer[i] = (i / IO_RING_MAX_READ * 31 + i) & 0xFF;
+    pwrite(file, buffer.data(), buffer.size(), 0);
+    return file;
+}
+
+static bool check_record(const std::vector<char>& buffer, size_t record) {
+    for (size_t i = 0; i < buffer.size(); i++) {
+        auto j = record * IO_RING_MAX_READ + i;
+        if (buffer[i] != char((j / IO_RING_MAX_READ * 31 + j) & 0xFF))
+            return false;
+    }
+    return true;
+}
+
+TEST(IoRing, ReadsMoreThanDepth) {
+    int file = prepare_file();
+    IoRing ring(file, 8);
+    if (!ring.available())
+        std::cout << "io_uring unavailable, testing the pread fallback"
+                  << std::endl;
+
+    std::mt19937 rng(7);
+    std::vector<size_t> records(1000);
+    std::vector<std::vector<char>> buffers(records.size());
+    std::vector<IoRingRead> reads(records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        records[i] = rng() % n_records;
+        buffers[i].assign(IO_RING_MAX_READ, 0);
+        reads[i] = {.buffer = buffers[i].data(),
+                    .len = IO_RING_MAX_READ,
+                    .offset = int64_t(records[i] * IO_RING_MAX_READ)};
+    }
+
+    ring.read(reads.data(), reads.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        ASSERT_EQ(reads[i].result, IO_RING_MAX_READ);
+        ASSERT_TRUE(check_record(buffers[i], records[i]))
+            << "record: " << records[i];
+    }
+    auto stats = ring.stats();
+    ASSERT_EQ(stats.n_ring_reads + stats.n_pread_reads, records.size());
+    if (ring.available())
+        ASSERT_EQ(stats.n_pread_reads, 0);
+    else
+        ASSERT_EQ(stats.n_ring_reads, 0);
+
+    // past the end of file is a short read, not an error.
+    std::vector<char> buffer(IO_RING_MAX_READ);
+    IoRingRead tail = {.buffer = buffer.data(),
+                       .len = IO_RING_MAX_READ,
+                       .offset = int64_t(n_records * IO_RING_MAX_READ)};
+    ring.read(&tail, 1);
+    ASSERT_EQ(tail.result, 0);
+
+    close(file);
+}
+
+TEST(IoRing, ReadBenchmark) {
+    int file = prepare_file();
+    IoRing ring(file);
+
+    std::mt19937 rng(11);
+    std::vector<std::vector<char>> buffers(IO_RING_DEPTH);
+    std::vector<IoRingRead> reads(IO_RING_DEPTH);
+    for (auto& buffer : buffers)
+        buffer.assign(IO_RING_MAX_READ, 0);
+
+    const int rounds = 200;
+    uint64_t pread_nanosecs = 0, ring_nanosecs = 0;
+    for (int round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < reads.size(); i++) {
+            auto record = rng() % n_records;
+            reads[i] = {.buffer = buffers[i].data(),
+                        .len = IO_RING_MAX_READ,
+                        .offset = int64_t(record * IO_RING_MAX_READ)};
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (auto& read : reads)
+            read.result = pread(file, read.buffer, read.len, read.offset);
+        auto finish = std::chrono::steady_clock::now();
+        pread_nanosecs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              finish - start)
+                              .count();
+
+        start = std::chrono::steady_clock::now();
+        ring.read(reads.data(), reads.size());
+        finish = std::chrono::steady_clock::now();
+        ring_nanosecs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             finish - start)
+                             .count();
+    }
+
+    auto n_reads = rounds * reads.size();
+    std::cout << "pread: " << pread_nanosecs / n_reads
+              << " ns per read / io_uring"
+              << (ring.available() ? "" : " (fallback)") << ": "
+              << ring_nanosecs / n_reads << " ns per read" << std::endl;
+
+    close(file);
+}
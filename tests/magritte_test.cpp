@@ -1,16 +1,24 @@
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <climits>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <filesystem>
+#include <fstream>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <iostream>
 #include <magritte_impl.h>
 #include <magritte_typedefs.h>
+#include <map>
+#include <random>
 #include <ratio>
+#include <span>
 #include <string>
+#include <sys/wait.h>
 #include <thread>
 #include <vector>
 
@@ -23,58 +31,21 @@ MagritteValue generateData() {
     return buffer;
 }
 
-TEST(MagritteTest, BasicOperations) {
-    auto file = "/tmp/libmgrt-test-file.mgrt";
-    auto _fn = std::getenv("MGRT_PRESSURE_TEST_FILE");
-    if (_fn && strlen(_fn)) {
-        file = _fn;
-    }
-
-    std::remove(file);
-
-    Magritte mgrt(file);
-    auto data = generateData();
-
-    MagritteKey key = 0x12345678;
-    ASSERT_TRUE(mgrt.put(key, data));
-
-    ASSERT_TRUE(mgrt.get(key, data));
-    EXPECT_EQ(data.size(), 1024);
-
-    for (size_t i = 0; i < 1024; ++i) {
-        EXPECT_EQ(data[i], data[i]) << "Data mismatch at byte " << i;
-    }
-
-    std::atomic<uint64_t> write_nanosecs = 0;
-    std::atomic<uint64_t> read_nanosecs = 0;
+// put and read back keys [0, n_test) using n_threads threads, each key is
+// handled by exactly one thread.
+void pressure(Magritte& mgrt, int n_threads, int n_test,
+              bool enable_speed_couting, std::atomic<uint64_t>& write_nanosecs,
+              std::atomic<uint64_t>& read_nanosecs) {
     std::vector<std::thread> threads;
-
-    int n_test = 100000;
-
-    auto n_test_str = std::getenv("MGRT_PRESSURE_TEST_SIZE");
-    if (n_test_str && strlen(n_test_str) != 0) {
-        n_test = atoi(n_test_str);
-    }
-    auto enable_speed_couting = n_test < 500000;
-    if (!enable_speed_couting) {
-        std::cout << "! NOTE: test size is too large, r/w speed measure "
-                     "disabled due to floating point inaccuracy."
-                  << std::endl;
-    }
-
-    const int n_threads = std::thread::hardware_concurrency();
-
     std::atomic<int32_t> curr_key = 0;
-    std::cout << "Start pressuring libmagritte using "
-              << std::to_string(n_threads) << " threads." << std::endl;
-
-    std::chrono::time_point<
-        std::chrono::system_clock,
-        std::chrono::duration<long, std::ratio<1, 1000000000>>>
-        start, finish;
 
     for (int i = 0; i < n_threads; ++i) {
         threads.emplace_back([&, i] {
+            std::chrono::time_point<
+                std::chrono::system_clock,
+                std::chrono::duration<long, std::ratio<1, 1000000000>>>
+                start, finish;
+
             auto key = curr_key++;
             while (key < n_test) {
                 auto data = generateData();
@@ -134,6 +105,53 @@ TEST(MagritteTest, BasicOperations) {
     for (auto& thread : threads) {
         thread.join();
     }
+}
+
+TEST(MagritteTest, BasicOperations) {
+    auto file = "/tmp/libmgrt-test-file.mgrt";
+    auto _fn = std::getenv("MGRT_PRESSURE_TEST_FILE");
+    if (_fn && strlen(_fn)) {
+        file = _fn;
+    }
+
+    std::remove(file);
+
+    Magritte mgrt(file);
+    auto data = generateData();
+
+    MagritteKey key = 0x12345678;
+    ASSERT_TRUE(mgrt.put(key, data));
+
+    ASSERT_TRUE(mgrt.get(key, data));
+    EXPECT_EQ(data.size(), 1024);
+
+    for (size_t i = 0; i < 1024; ++i) {
+        EXPECT_EQ(data[i], data[i]) << "Data mismatch at byte " << i;
+    }
+
+    std::atomic<uint64_t> write_nanosecs = 0;
+    std::atomic<uint64_t> read_nanosecs = 0;
+
+    int n_test = 100000;
+
+    auto n_test_str = std::getenv("MGRT_PRESSURE_TEST_SIZE");
+    if (n_test_str && strlen(n_test_str) != 0) {
+        n_test = atoi(n_test_str);
+    }
+    auto enable_speed_couting = n_test < 500000;
+    if (!enable_speed_couting) {
+        std::cout << "! NOTE: test size is too large, r/w speed measure "
+                     "disabled due to floating point inaccuracy."
+                  << std::endl;
+    }
+
+    const int n_threads = std::thread::hardware_concurrency();
+
+    std::cout << "Start pressuring libmagritte using "
+              << std::to_string(n_threads) << " threads." << std::endl;
+
+    pressure(mgrt, n_threads, n_test, enable_speed_couting, write_nanosecs,
+             read_nanosecs);
 
     std::cout << std::endl;
     if (enable_speed_couting) {
@@ -151,3 +169,742 @@ TEST(MagritteTest, BasicOperations) {
 
     mgrt.shutdown();
 }
+
+// runs the pressure loop on a fresh file with 1 to 64 threads and reports
+// wall clock throughput, to show how writers contend with each other.
+TEST(MagritteTest, ContentionBenchmark) {
+    auto file = "/tmp/libmgrt-contention-test-file.mgrt";
+    auto _fn = std::getenv("MGRT_PRESSURE_TEST_FILE");
+    if (_fn && strlen(_fn)) {
+        file = _fn;
+    }
+
+    int n_test = 20000;
+    auto n_test_str = std::getenv("MGRT_CONTENTION_TEST_SIZE");
+    if (n_test_str && strlen(n_test_str) != 0) {
+        n_test = atoi(n_test_str);
+    }
+
+    for (int n_threads = 1; n_threads <= 64; n_threads *= 2) {
+        std::remove(file);
+        Magritte mgrt(file);
+
+        std::atomic<uint64_t> write_nanosecs = 0;
+        std::atomic<uint64_t> read_nanosecs = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        pressure(mgrt, n_threads, n_test, true, write_nanosecs, read_nanosecs);
+        auto finish = std::chrono::steady_clock::now();
+        auto seconds = std::chrono::duration<double>(finish - start).count();
+
+        std::cout << std::endl
+                  << n_threads << " threads: " << n_test / seconds
+                  << " put+get/s, write: " << write_nanosecs / n_test
+                  << " ns / read: " << read_nanosecs / n_test << " ns"
+                  << std::endl;
+
+        mgrt.shutdown();
+    }
+}
+
+TEST(MagritteTest, ReopenWithEachIndexType) {
+    auto file = "/tmp/libmgrt-reopen-test-file.mgrt";
+
+    for (auto type : {MagritteIndexType::Cluster, MagritteIndexType::Direct,
+                      MagritteIndexType::Hash}) {
+        std::remove(file);
+        MagritteConfig config = {
+            .n_read_cache = 1024,
+            .n_write_buffer_per_block = 32,
+            .millisec_flush_timeout = 500,
+            .index_type = type,
+        };
+
+        std::vector<MagritteValue> values;
+        {
+            Magritte mgrt(file, &config);
+            for (MagritteKey key = 0; key < 4096; key++) {
+                values.push_back(generateData());
+                ASSERT_TRUE(mgrt.put(key, values.back()));
+            }
+        }
+
+        {
+            // the kind recorded in the file wins over the config.
+            Magritte mgrt(file);
+            for (MagritteKey key = 0; key < 4096; key++) {
+                std::vector<char> value;
+                ASSERT_TRUE(mgrt.get(key, value)) << "key: " << key;
+                ASSERT_EQ(value, values[key]) << "key: " << key;
+            }
+        }
+    }
+}
+
+TEST(MagritteTest, ScanInKeyOrder) {
+    auto file = "/tmp/libmgrt-scan-test-file.mgrt";
+
+    for (auto type : {MagritteIndexType::Cluster, MagritteIndexType::Direct,
+                      MagritteIndexType::Hash}) {
+        std::remove(file);
+        MagritteConfig config = {
+            .n_read_cache = 1024,
+            .n_write_buffer_per_block = 32,
+            .millisec_flush_timeout = 500,
+            .index_type = type,
+        };
+        Magritte mgrt(file, &config);
+
+        // insert out of order, so slots and keys are not in the same order.
+        std::map<MagritteKey, MagritteValue> expected;
+        for (int i = 0; i < 3000; i++) {
+            MagritteKey key = (i * 7919) % 3000 - 1500;
+            expected[key] = generateData();
+            ASSERT_TRUE(mgrt.put(key, expected[key]));
+        }
+
+        auto it = expected.lower_bound(-1000);
+        ASSERT_TRUE(mgrt.scan(-1000, 999, [&](MagritteKey key,
+                                              MagritteValue& value) {
+            EXPECT_EQ(key, it->first);
+            EXPECT_EQ(value, it->second) << "key: " << key;
+            it++;
+            return true;
+        }));
+        ASSERT_EQ(it, expected.lower_bound(1000));
+
+        // stop early
+        int n = 0;
+        mgrt.scan(INT_MIN, INT_MAX, [&](MagritteKey, MagritteValue&) {
+            return ++n < 10;
+        });
+        ASSERT_EQ(n, 10);
+    }
+}
+
+// a hash index sweeps its tables for every batch, but hands out no more than
+// the batch asks for.
+TEST(MagritteTest, ScanBatchesOfHashIndex) {
+    auto file = "/tmp/libmgrt-scan-batch-test-file.mgrt";
+    std::remove(file);
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 500,
+        .index_type = MagritteIndexType::Hash,
+    };
+    Magritte mgrt(file, &config);
+    for (MagritteKey key = 0; key < 1000; key++)
+        ASSERT_TRUE(mgrt.put((key * 7919) % 1000, MagritteValue(8, 'v')));
+
+    const size_t limit = 16;
+    MagritteScanCursor cursor = {.next = 100, .to = 899, .done = false};
+    MagritteKey next = 100;
+    std::vector<std::pair<MagritteKey, MagritteValue>> batch;
+    while (mgrt.scan_batch(cursor, limit, batch)) {
+        ASSERT_LE(batch.size(), limit);
+        for (auto& [key, value] : batch)
+            ASSERT_EQ(key, next++);
+        batch.clear();
+    }
+    ASSERT_EQ(next, 900);
+}
+
+TEST(MagritteTest, MultiGetAndPut) {
+    auto file = "/tmp/libmgrt-multi-test-file.mgrt";
+    std::remove(file);
+    Magritte mgrt(file);
+
+    std::vector<MagritteKey> keys;
+    std::vector<MagritteValue> values;
+    for (MagritteKey key = 0; key < 2000; key++) {
+        keys.push_back(key * 3);
+        values.push_back(generateData());
+    }
+
+    // half of the keys exist before, so the batch both inserts and updates.
+    for (size_t i = 0; i < keys.size(); i += 2)
+        ASSERT_TRUE(mgrt.put(keys[i], generateData()));
+    ASSERT_TRUE(mgrt.multi_put(keys, values));
+
+    std::vector<MagritteKey> lookup(keys.rbegin(), keys.rend());
+    lookup.push_back(1);
+    std::vector<MagritteValue> read;
+    std::vector<bool> found;
+    mgrt.multi_get(lookup, read, found);
+
+    ASSERT_EQ(found.size(), lookup.size());
+    ASSERT_FALSE(found.back());
+    for (size_t i = 0; i < keys.size(); i++) {
+        ASSERT_TRUE(found[i]) << "key: " << lookup[i];
+        ASSERT_EQ(read[i], values[keys.size() - 1 - i]) << "key: " << lookup[i];
+
+        MagritteValue value;
+        ASSERT_TRUE(mgrt.get(lookup[i], value));
+        ASSERT_EQ(value, read[i]) << "key: " << lookup[i];
+    }
+}
+
+TEST(MagritteTest, CallerBuffers) {
+    auto file = "/tmp/libmgrt-buffer-test-file.mgrt";
+    std::remove(file);
+    Magritte mgrt(file);
+
+    auto value = generateData();
+    ASSERT_TRUE(mgrt.put(1, std::span<const char>(value.data(), 100)));
+
+    std::vector<char> buffer(1024);
+    ASSERT_EQ(mgrt.get_into(1, buffer), 100);
+    ASSERT_TRUE(std::equal(value.begin(), value.begin() + 100, buffer.begin()));
+    ASSERT_EQ(mgrt.get_into(2, buffer), -1);
+
+    // too small, the length is still reported.
+    ASSERT_TRUE(mgrt.put(1, std::span<const char>(value)));
+    std::vector<char> small(16);
+    ASSERT_EQ(mgrt.get_into(1, small), 1024);
+    // new keys are not cached, this reads the pending value of the block.
+    ASSERT_TRUE(mgrt.put(3, std::span<const char>(value)));
+    ASSERT_EQ(mgrt.get_into(3, small), 1024);
+
+    ASSERT_EQ(mgrt.get_into(1, buffer), 1024);
+    ASSERT_EQ(buffer, value);
+    ASSERT_EQ(mgrt.get_into(3, buffer), 1024);
+    ASSERT_EQ(buffer, value);
+}
+
+// values of every size class, moved to another class when they grow or
+// shrink, read back with their own length before and after reopening.
+TEST(MagritteTest, VariableSizeValues) {
+    auto file = "/tmp/libmgrt-variable-size-test-file.mgrt";
+    std::remove(file);
+
+    const std::vector<size_t> sizes = {0, 10, 62, 100, 300, 1000, 2000};
+    std::map<MagritteKey, MagritteValue> values;
+    auto value_of = [](MagritteKey key, size_t len) {
+        return MagritteValue(len, 'a' + key % 26);
+    };
+    {
+        Magritte mgrt(file);
+        for (MagritteKey key = 0; key < 700; key++) {
+            values[key] = value_of(key, sizes[key % 7]);
+            ASSERT_TRUE(mgrt.put(key, values[key]));
+        }
+        ASSERT_FALSE(mgrt.put(700, MagritteValue(BLOCK_MAX_VALUE_SIZE + 1)));
+
+        // a tenth grow by a class, a tenth shrink to the smallest.
+        for (MagritteKey key = 0; key < 700; key += 10) {
+            values[key] = value_of(key, sizes[(key + 1) % 7]);
+            ASSERT_TRUE(mgrt.put(key, values[key]));
+        }
+        std::vector<MagritteKey> keys;
+        std::vector<MagritteValue> batch;
+        for (MagritteKey key = 5; key < 700; key += 10) {
+            keys.push_back(key);
+            batch.push_back(values[key] = value_of(key, 1));
+        }
+        ASSERT_TRUE(mgrt.multi_put(keys, batch));
+
+        for (auto& [key, value] : values) {
+            MagritteValue read;
+            ASSERT_TRUE(mgrt.get(key, read)) << "key: " << key;
+            ASSERT_EQ(read, value) << "key: " << key;
+        }
+    }
+
+    Magritte mgrt(file);
+    std::vector<MagritteKey> keys;
+    for (auto& [key, value] : values) {
+        MagritteValue read;
+        ASSERT_TRUE(mgrt.get(key, read)) << "key: " << key;
+        ASSERT_EQ(read, value) << "key: " << key;
+        keys.push_back(key);
+    }
+    std::vector<MagritteValue> read;
+    std::vector<bool> found;
+    mgrt.multi_get(keys, read, found);
+    for (size_t i = 0; i < keys.size(); i++)
+        ASSERT_EQ(read[i], values[keys[i]]) << "key: " << keys[i];
+}
+
+// threads move the same keys between size classes and extent lengths while
+// others insert, a slot freed twice would hand a live value's slot out again.
+TEST(MagritteTest, ConcurrentMoves) {
+    auto file = "/tmp/libmgrt-concurrent-moves-test-file.mgrt";
+    std::remove(file);
+    Magritte mgrt(file);
+
+    const std::vector<size_t> sizes = {10, 300, 1000, 5000, 9000};
+    const int n_threads = 8, n_shared = 16, n_rounds = 2000;
+    auto value_of = [](MagritteKey key, size_t len) {
+        return MagritteValue(len, 'a' + key % 26);
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            for (int i = 0; i < n_rounds; i++) {
+                MagritteKey shared = rng() % n_shared;
+                mgrt.put(shared, value_of(shared, sizes[rng() % sizes.size()]));
+                MagritteKey own = n_shared + t * n_rounds + i;
+                mgrt.put(own, value_of(own, sizes[own % sizes.size()]));
+                if (i % 64 == 0) {
+                    std::vector<MagritteKey> keys = {shared, own};
+                    std::vector<MagritteValue> values = {
+                        value_of(shared, sizes[i % sizes.size()]),
+                        value_of(own, sizes[own % sizes.size()])};
+                    mgrt.multi_put(keys, values);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    MagritteValue read;
+    for (MagritteKey key = 0; key < n_shared; key++) {
+        ASSERT_TRUE(mgrt.get(key, read)) << "key: " << key;
+        ASSERT_TRUE(std::find(sizes.begin(), sizes.end(), read.size()) !=
+                    sizes.end())
+            << "key: " << key;
+        ASSERT_EQ(read, value_of(key, read.size())) << "key: " << key;
+    }
+    for (MagritteKey key = n_shared; key < n_shared + n_threads * n_rounds;
+         key++) {
+        ASSERT_TRUE(mgrt.get(key, read)) << "key: " << key;
+        ASSERT_EQ(read, value_of(key, sizes[key % sizes.size()]))
+            << "key: " << key;
+    }
+}
+
+// values of 4 to 64 KiB are stored as extents, one growing past its run is
+// moved to a run of its new length.
+TEST(MagritteTest, LargeValues) {
+    auto file = "/tmp/libmgrt-large-value-test-file.mgrt";
+    std::remove(file);
+
+    std::map<MagritteKey, MagritteValue> values;
+    auto value_of = [](MagritteKey key, size_t len) {
+        MagritteValue value(len);
+        for (size_t i = 0; i < len; i++)
+            value[i] = key * 31 + i;
+        return value;
+    };
+    {
+        Magritte mgrt(file);
+        for (MagritteKey key = 0; key < 64; key++) {
+            values[key] = value_of(key, (4 << 10) + key * 1000);
+            ASSERT_TRUE(mgrt.put(key, values[key]));
+        }
+        ASSERT_TRUE(mgrt.put(64, values[64] = value_of(64, 100)));
+
+        for (MagritteKey key = 0; key < 64; key += 4) {
+            values[key] = value_of(key + 1, values[key].size() * 2);
+            ASSERT_TRUE(mgrt.put(key, values[key]));
+        }
+        std::vector<MagritteKey> keys = {1, 2, 64};
+        std::vector<MagritteValue> batch;
+        for (auto key : keys)
+            batch.push_back(values[key] = value_of(key + 2, 20000));
+        ASSERT_TRUE(mgrt.multi_put(keys, batch));
+
+        MagritteValue removed;
+        ASSERT_TRUE(mgrt.remove(3, removed));
+        ASSERT_EQ(removed, values[3]);
+        values.erase(3);
+    }
+
+    // a large get is a single read with every backend.
+    for (auto backend : {MagritteIoBackend::Pread, MagritteIoBackend::IoUring,
+                         MagritteIoBackend::Mmap}) {
+        MagritteConfig config = {
+            .n_read_cache = 1024,
+            .n_write_buffer_per_block = 32,
+            .millisec_flush_timeout = 500,
+            .index_type = MagritteIndexType::Cluster,
+            .io_backend = backend,
+        };
+        Magritte mgrt(file, &config);
+        std::vector<MagritteKey> keys;
+        for (auto& [key, value] : values) {
+            MagritteValue read;
+            ASSERT_TRUE(mgrt.get(key, read)) << "key: " << key;
+            ASSERT_EQ(read, value) << "key: " << key;
+            BlockView view;
+            ASSERT_TRUE(mgrt.get_view(key, view));
+            ASSERT_TRUE(std::equal(value.begin(), value.end(),
+                                   view.data().begin(), view.data().end()));
+            keys.push_back(key);
+        }
+        ASSERT_FALSE(mgrt.probe(3));
+
+        std::vector<MagritteValue> read;
+        std::vector<bool> found;
+        mgrt.multi_get(keys, read, found);
+        for (size_t i = 0; i < keys.size(); i++)
+            ASSERT_EQ(read[i], values[keys[i]]) << "key: " << keys[i];
+    }
+}
+
+// the index has a file of its own, adding blocks does not move it.
+TEST(MagritteTest, IndexFile) {
+    auto file = "/tmp/libmgrt-index-file-test-file.mgrt";
+    auto index_file = std::string(file) + ".idx";
+    std::remove(file);
+
+    // long enough for the index not to be written in the background.
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 60000,
+        .index_type = MagritteIndexType::Cluster,
+        .io_backend = MagritteIoBackend::Pread,
+    };
+    {
+        Magritte mgrt(file, &config);
+        // a block of every size class.
+        for (MagritteKey key = 0; key < BLOCK_N_SLOT_SIZES; key++)
+            ASSERT_TRUE(mgrt.put(key, MagritteValue(BLOCK_SLOT_SIZES[key] / 2,
+                                                    char(key))));
+        EXPECT_EQ(std::filesystem::file_size(index_file), 0);
+    }
+    EXPECT_GT(std::filesystem::file_size(index_file), 0);
+
+    Magritte mgrt(file);
+    for (MagritteKey key = 0; key < BLOCK_N_SLOT_SIZES; key++) {
+        MagritteValue read;
+        ASSERT_TRUE(mgrt.get(key, read));
+        ASSERT_EQ(read, MagritteValue(BLOCK_SLOT_SIZES[key] / 2, char(key)));
+    }
+}
+
+// the index is written in the background while the store is open.
+TEST(MagritteTest, IndexCheckpointer) {
+    auto file = "/tmp/libmgrt-index-checkpointer-test-file.mgrt";
+    auto index_file = std::string(file) + ".idx";
+    std::remove(file);
+
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 20,
+        .index_type = MagritteIndexType::Cluster,
+        .io_backend = MagritteIoBackend::Pread,
+        .durability = MagritteDurability::Batched,
+    };
+    Magritte mgrt(file, &config);
+    for (MagritteKey key = 0; key < 4096; key++)
+        ASSERT_TRUE(mgrt.put(key, MagritteValue(16, char(key))));
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::filesystem::file_size(index_file) == 0 &&
+           std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_GT(std::filesystem::file_size(index_file), 0);
+    // the log was synced before the index was written.
+    EXPECT_GT(mgrt.wal_stats().n_syncs, 0);
+}
+
+// a child process makes the changes and exits without shutting the store
+// down, as a crash would leave it, blocks are not written back.
+TEST(MagritteTest, WalReplay) {
+    auto file = "/tmp/libmgrt-wal-test-file.mgrt";
+    auto wal_file = std::string(file) + ".wal";
+    std::remove(file);
+    std::remove(wal_file.c_str());
+
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 60000,
+        .index_type = MagritteIndexType::Cluster,
+        .io_backend = MagritteIoBackend::Pread,
+        .durability = MagritteDurability::PerOp,
+    };
+    // makes the changes to `mgrt` if given, and returns the values expected
+    // after them.
+    auto run = [](Magritte* mgrt) {
+        std::map<MagritteKey, MagritteValue> values;
+        for (MagritteKey key = 0; key < 300; key++) {
+            values[key] = MagritteValue(key * 37 % 3000 + 1, char(key));
+            if (mgrt && !mgrt->put(key, values[key]))
+                _exit(1);
+        }
+        // updates in place, to another size class and to an extent.
+        for (MagritteKey key = 0; key < 300; key += 3) {
+            auto len = key % 2 ? values[key].size() : 10000 + key;
+            values[key] = MagritteValue(len, char(key + 1));
+            if (mgrt && !mgrt->put(key, values[key]))
+                _exit(1);
+        }
+        std::vector<MagritteKey> keys;
+        std::vector<MagritteValue> batch;
+        for (MagritteKey key = 1; key < 300; key += 5) {
+            keys.push_back(key);
+            batch.push_back(values[key] = MagritteValue(key + 100, 'b'));
+        }
+        if (mgrt && !mgrt->multi_put(keys, batch))
+            _exit(1);
+        MagritteValue removed;
+        for (MagritteKey key = 2; key < 300; key += 7) {
+            if (mgrt && !mgrt->remove(key, removed))
+                _exit(1);
+            values.erase(key);
+        }
+        return values;
+    };
+
+    auto pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        auto mgrt = new Magritte(file, &config);
+        run(mgrt);
+        _exit(mgrt->wal_stats().n_syncs > 0 ? 0 : 1);
+    }
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ASSERT_GT(std::filesystem::file_size(wal_file), 0);
+
+    auto values = run(nullptr);
+    Magritte mgrt(file, &config);
+    for (MagritteKey key = 0; key < 300; key++) {
+        MagritteValue read;
+        ASSERT_EQ(mgrt.get(key, read), values.count(key) > 0)
+            << "key: " << key;
+        if (values.count(key))
+            ASSERT_EQ(read, values[key]) << "key: " << key;
+    }
+    // everything replayed is in the store, the log starts over.
+    EXPECT_EQ(std::filesystem::file_size(wal_file), 0);
+}
+
+TEST(MagritteTest, CacheStats) {
+    auto file = "/tmp/libmgrt-cache-stats-test-file.mgrt";
+    std::remove(file);
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 500,
+        .index_type = MagritteIndexType::Cluster,
+        .io_backend = MagritteIoBackend::Pread,
+        .cache_policy = MagritteCachePolicy::TinyLfu,
+    };
+    Magritte mgrt(file, &config);
+
+    auto value = generateData();
+    for (MagritteKey key = 0; key < 10; key++)
+        ASSERT_TRUE(mgrt.put(key, value));
+
+    // the first read of a key misses and caches it.
+    std::vector<char> read;
+    for (int round = 0; round < 3; round++) {
+        for (MagritteKey key = 0; key < 10; key++) {
+            ASSERT_TRUE(mgrt.get(key, read));
+            ASSERT_EQ(read, value);
+        }
+    }
+
+    auto stats = mgrt.cache_stats();
+    EXPECT_EQ(stats.misses, 10);
+    EXPECT_EQ(stats.hits, 20);
+
+    // without a budget every read goes to the blocks.
+    mgrt.set_cache_budget(0, 0);
+    for (MagritteKey key = 0; key < 10; key++) {
+        ASSERT_TRUE(mgrt.get(key, read));
+        ASSERT_EQ(read, value);
+    }
+    stats = mgrt.cache_stats();
+    EXPECT_EQ(stats.misses, 20);
+    EXPECT_EQ(stats.hits, 20);
+}
+
+TEST(MagritteTest, IoUringBackend) {
+    auto file = "/tmp/libmgrt-io-uring-test-file.mgrt";
+    std::remove(file);
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 500,
+        .index_type = MagritteIndexType::Cluster,
+        .io_backend = MagritteIoBackend::IoUring,
+    };
+
+    std::vector<MagritteKey> keys;
+    std::vector<MagritteValue> values;
+    for (MagritteKey key = 0; key < 5000; key++) {
+        keys.push_back(key);
+        values.push_back(generateData());
+    }
+    {
+        Magritte mgrt(file, &config);
+        ASSERT_TRUE(mgrt.multi_put(keys, values));
+    }
+
+    // reopen so that reads hit the file instead of pending changes.
+    Magritte mgrt(file, &config);
+    std::vector<MagritteValue> read;
+    std::vector<bool> found;
+    mgrt.multi_get(keys, read, found);
+    for (size_t i = 0; i < keys.size(); i++) {
+        ASSERT_TRUE(found[i]) << "key: " << keys[i];
+        ASSERT_EQ(read[i], values[i]) << "key: " << keys[i];
+    }
+    // every read went through one of the shared rings, or its fallback.
+    auto stats = mgrt.io_stats();
+    ASSERT_EQ(stats.n_ring_reads + stats.n_pread_reads, keys.size());
+
+    std::atomic<uint64_t> write_nanosecs = 0, read_nanosecs = 0;
+    pressure(mgrt, 8, 20000, false, write_nanosecs, read_nanosecs);
+}
+
+TEST(MagritteTest, MmapBackend) {
+    auto file = "/tmp/libmgrt-mmap-test-file.mgrt";
+    std::remove(file);
+    MagritteConfig config = {
+        .n_read_cache = 1024,
+        .n_write_buffer_per_block = 32,
+        .millisec_flush_timeout = 500,
+        .index_type = MagritteIndexType::Cluster,
+        .io_backend = MagritteIoBackend::Mmap,
+    };
+
+    std::vector<MagritteValue> values;
+    {
+        Magritte mgrt(file, &config);
+        for (MagritteKey key = 0; key < 5000; key++) {
+            values.push_back(generateData());
+            ASSERT_TRUE(mgrt.put(key, values.back()));
+        }
+
+        // still pending or just flushed, both must read back.
+        BlockView view;
+        for (MagritteKey key = 0; key < 5000; key++) {
+            ASSERT_TRUE(mgrt.get_view(key, view));
+            ASSERT_TRUE(std::equal(values[key].begin(), values[key].end(),
+                                   view.data().begin()))
+                << "key: " << key;
+        }
+    }
+
+    Magritte mgrt(file, &config);
+    BlockView view;
+    for (MagritteKey key = 0; key < 5000; key++) {
+        ASSERT_TRUE(mgrt.get_view(key, view));
+        ASSERT_EQ(view.data().size(), 1024);
+        ASSERT_TRUE(std::equal(values[key].begin(), values[key].end(),
+                               view.data().begin()))
+            << "key: " << key;
+    }
+    // the view pins the block, writes must wait until it is released.
+    view.release();
+
+    values[42] = generateData();
+    ASSERT_TRUE(mgrt.put(42, values[42]));
+    ASSERT_TRUE(mgrt.get_view(42, view));
+    ASSERT_TRUE(std::equal(values[42].begin(), values[42].end(),
+                           view.data().begin()));
+    view.release();
+
+    std::atomic<uint64_t> write_nanosecs = 0, read_nanosecs = 0;
+    pressure(mgrt, 8, 20000, false, write_nanosecs, read_nanosecs);
+}
+
+// cold reads through each backend, the caches are skipped.
+TEST(MagritteTest, ReadBackendBenchmark) {
+    auto file = "/tmp/libmgrt-backend-test-file.mgrt";
+    const int n_keys = 20000;
+
+    std::remove(file);
+    {
+        Magritte mgrt(file);
+        std::vector<MagritteKey> keys(n_keys);
+        std::vector<MagritteValue> values(n_keys);
+        for (MagritteKey key = 0; key < n_keys; key++) {
+            keys[key] = key;
+            values[key] = generateData();
+        }
+        ASSERT_TRUE(mgrt.multi_put(keys, std::move(values)));
+    }
+
+    for (auto backend : {MagritteIoBackend::Pread, MagritteIoBackend::IoUring,
+                         MagritteIoBackend::Mmap}) {
+        MagritteConfig config = {
+            .n_read_cache = 1024,
+            .n_write_buffer_per_block = 32,
+            .millisec_flush_timeout = 500,
+            .index_type = MagritteIndexType::Cluster,
+            .io_backend = backend,
+        };
+        Magritte mgrt(file, &config);
+
+        std::mt19937 rng(3);
+        BlockView view;
+        uint64_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < n_keys; i++) {
+            ASSERT_TRUE(mgrt.get_view(rng() % n_keys, view));
+            checksum += view.data()[i % 1024];
+        }
+        auto finish = std::chrono::steady_clock::now();
+        view.release();
+
+        std::cout << "backend " << int(backend) << ": "
+                  << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         finish - start)
+                             .count() /
+                         n_keys
+                  << " ns per read (checksum " << checksum << ")" << std::endl;
+    }
+}
+
+// compares a batch of lookups against the same lookups one at a time.
+TEST(MagritteTest, MultiGetBenchmark) {
+    auto file = "/tmp/libmgrt-multi-test-file.mgrt";
+    std::remove(file);
+    Magritte mgrt(file);
+
+    const int n_keys = 20000;
+    const int batch_size = 500;
+    std::vector<MagritteKey> keys;
+    std::vector<MagritteValue> values;
+    for (MagritteKey key = 0; key < n_keys; key++) {
+        keys.push_back(key);
+        values.push_back(generateData());
+    }
+    ASSERT_TRUE(mgrt.multi_put(keys, values));
+
+    std::mt19937 rng(5);
+    std::vector<MagritteKey> lookup(batch_size);
+    std::vector<MagritteValue> read;
+    std::vector<bool> found;
+    uint64_t single_nanosecs = 0, batch_nanosecs = 0;
+
+    for (int round = 0; round < 20; round++) {
+        for (auto& key : lookup)
+            key = rng() % n_keys;
+
+        auto start = std::chrono::steady_clock::now();
+        for (auto key : lookup) {
+            MagritteValue value;
+            mgrt.get(key, value);
+        }
+        auto finish = std::chrono::steady_clock::now();
+        single_nanosecs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               finish - start)
+                               .count();
+
+        start = std::chrono::steady_clock::now();
+        mgrt.multi_get(lookup, read, found);
+        finish = std::chrono::steady_clock::now();
+        batch_nanosecs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              finish - start)
+                              .count();
+    }
+
+    std::cout << "get: " << single_nanosecs / (20 * batch_size)
+              << " ns per key / multi_get: "
+              << batch_nanosecs / (20 * batch_size) << " ns per key"
+              << std::endl;
+}
@@ -0,0 +1,95 @@
+#include "tiny_lfu.h"
+#include <gtest/gtest.h>
+#include <iostream>
+#include <random>
+#include <vector>
+
+TEST(TinyLfuTest, SketchCountsAndAges) {
+    FrequencySketch sketch(64);
+
+    for (int i = 0; i < 5; i++)
+        sketch.increment(1);
+    sketch.increment(2);
+    EXPECT_EQ(sketch.frequency(1), 5);
+    EXPECT_EQ(sketch.frequency(2), 1);
+    EXPECT_EQ(sketch.frequency(3), 0);
+
+    // counters saturate at 15.
+    for (int i = 0; i < 20; i++)
+        sketch.increment(4);
+    EXPECT_EQ(sketch.frequency(4), 15);
+
+    // the 640th increment halves every counter.
+    for (int i = 26; i < 640; i++)
+        sketch.increment(1000 + i);
+    EXPECT_EQ(sketch.frequency(1), 2);
+    EXPECT_EQ(sketch.frequency(4), 7);
+
+    // a larger sketch starts over and ages later.
+    sketch.resize(1024);
+    EXPECT_EQ(sketch.frequency(1), 0);
+    for (int i = 0; i < 640; i++)
+        sketch.increment(1);
+    EXPECT_EQ(sketch.frequency(1), 15);
+}
+
+TEST(TinyLfuTest, BasicOperations) {
+    for (bool admission : {false, true}) {
+        TinyLfuCache<int, std::string> cache(100, admission);
+
+        std::string value;
+        EXPECT_FALSE(cache.get(1, value));
+        cache.put(1, "one");
+        EXPECT_TRUE(cache.get(1, value));
+        EXPECT_EQ(value, "one");
+
+        cache.put(1, "ONE");
+        EXPECT_TRUE(cache.get(1, value));
+        EXPECT_EQ(value, "ONE");
+
+        cache.remove(1);
+        EXPECT_FALSE(cache.get(1, value));
+
+        auto stats = cache.stats();
+        EXPECT_EQ(stats.hits, 2);
+        EXPECT_EQ(stats.misses, 2);
+    }
+}
+
+// a hot set that fits in the cache is read at random, with a scan of keys
+// read once in between every read.
+static double hot_hit_rate(TinyLfuCache<int, int>& cache, int n_hot) {
+    std::mt19937 rng(1);
+    int value, hits = 0, reads = 0, scanned = 1 << 20;
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < n_hot; i++, reads++) {
+            auto key = rng() % n_hot;
+            if (cache.get(key, value))
+                hits++;
+            else
+                cache.put(key, key);
+
+            if (!cache.get(scanned, value))
+                cache.put(scanned, scanned);
+            scanned++;
+        }
+    }
+    return double(hits) / reads;
+}
+
+TEST(TinyLfuTest, ScanResistance) {
+    const int capacity = 1024 * 3, n_hot = 2000;
+
+    TinyLfuCache<int, int> clock(capacity, false);
+    auto clock_rate = hot_hit_rate(clock, n_hot);
+    TinyLfuCache<int, int> tiny_lfu(capacity, true);
+    auto tiny_lfu_rate = hot_hit_rate(tiny_lfu, n_hot);
+
+    auto stats = tiny_lfu.stats();
+    std::cout << "hot hit rate, clock: " << clock_rate
+              << " / tinylfu: " << tiny_lfu_rate
+              << ", admitted: " << stats.admitted
+              << ", rejected: " << stats.rejected << std::endl;
+    EXPECT_GT(tiny_lfu_rate, 0.9);
+    EXPECT_GT(tiny_lfu_rate, clock_rate);
+}
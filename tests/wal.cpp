@@ -0,0 +1,95 @@
+#include "wal.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+static std::vector<char> value_of(int i) {
+    return std::vector<char>(i % 100 + 1, char(i));
+}
+
+TEST(WalTest, GroupCommit) {
+    auto path = "/tmp/libmgrt-wal-group-test-file.wal";
+    std::remove(path);
+
+    WriteAheadLog wal(path, PerOp);
+    uint64_t position = 0;
+    for (int i = 0; i < 100; i++) {
+        auto record = WriteAheadLog::encode(WalPut, i, value_of(i));
+        position = wal.append(record, i);
+    }
+    // one sync covers everything appended before it.
+    ASSERT_TRUE(wal.commit(position));
+    EXPECT_EQ(wal.stats().n_records, 100);
+    EXPECT_EQ(wal.stats().n_syncs, 1);
+    ASSERT_TRUE(wal.commit(position));
+    EXPECT_EQ(wal.stats().n_syncs, 1);
+    EXPECT_EQ(wal.size(), position);
+
+    wal.reset();
+    EXPECT_EQ(wal.size(), 0);
+}
+
+TEST(WalTest, Replay) {
+    auto path = "/tmp/libmgrt-wal-replay-test-file.wal";
+    std::remove(path);
+
+    {
+        WriteAheadLog wal(path, Batched);
+        for (int i = 0; i < 100; i++) {
+            auto record = WriteAheadLog::encode(i % 3 ? WalPut : WalRemove, i,
+                                                i % 3 ? value_of(i)
+                                                      : std::vector<char>());
+            wal.append(record, i * 2, i % 2 ? i : WAL_NO_INDEX);
+        }
+    }
+
+    WriteAheadLog wal(path, Batched);
+    int i = 0;
+    auto n = wal.replay(
+        [&i](const WalRecordHeader& header, std::span<const char> value) {
+            EXPECT_EQ(header.key, i);
+            EXPECT_EQ(header.type, i % 3 ? WalPut : WalRemove);
+            EXPECT_EQ(header.index, i * 2);
+            EXPECT_EQ(header.old_index, i % 2 ? i : WAL_NO_INDEX);
+            auto expected = i % 3 ? value_of(i) : std::vector<char>();
+            EXPECT_TRUE(std::equal(value.begin(), value.end(),
+                                   expected.begin(), expected.end()));
+            i++;
+        });
+    EXPECT_EQ(n, 100);
+}
+
+TEST(WalTest, TornTail) {
+    auto path = "/tmp/libmgrt-wal-torn-test-file.wal";
+    std::remove(path);
+
+    uint64_t intact;
+    {
+        WriteAheadLog wal(path, PerOp);
+        for (int i = 0; i < 10; i++) {
+            auto record = WriteAheadLog::encode(WalPut, i, value_of(i));
+            intact = wal.append(record, i);
+        }
+        ASSERT_TRUE(wal.commit(intact));
+    }
+    // half a record, as a crash while writing leaves it.
+    {
+        auto record = WriteAheadLog::encode(WalPut, 10, value_of(10));
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out.write(record.data(), record.size() / 2);
+    }
+
+    WriteAheadLog wal(path, PerOp);
+    auto n = wal.replay([](const WalRecordHeader&, std::span<const char>) {});
+    EXPECT_EQ(n, 10);
+    EXPECT_EQ(wal.size(), intact);
+
+    // appends follow the last intact record.
+    auto record = WriteAheadLog::encode(WalPut, 11, value_of(11));
+    ASSERT_TRUE(wal.commit(wal.append(record, 11)));
+    n = wal.replay([](const WalRecordHeader&, std::span<const char>) {});
+    EXPECT_EQ(n, 11);
+}